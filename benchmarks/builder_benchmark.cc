@@ -0,0 +1,270 @@
+// Decode throughput of PgBuilder over synthetic binary COPY rows, one case per
+// mapped type. Needs no database.
+
+#include "../src/pg2arrow.h"
+#include "../tests/row_writer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <functional>
+#include <random>
+#include <string>
+
+namespace {
+
+using Pg2Arrow::RowWriter;
+
+const int64_t kNumRows = 1 << 16;
+
+typedef std::function<void(std::mt19937_64&, RowWriter&)> FieldWriter;
+
+template <typename T, void (RowWriter::*kWrite)(T)>
+FieldWriter Fixed(double null_ratio = 0) {
+    return [null_ratio](std::mt19937_64& rng, RowWriter& row) {
+        if (null_ratio > 0 && std::uniform_real_distribution<>()(rng) < null_ratio)
+            return row.Null();
+        RowWriter value;
+        (value.*kWrite)(T(rng() % 1000000));
+        row.Field(value);
+    };
+}
+
+FieldWriter Bool() {
+    return [](std::mt19937_64& rng, RowWriter& row) {
+        row.Int32(1);
+        row.Bytes(std::string(1, char(rng() & 1)));
+    };
+}
+
+// Strings of `length` characters out of `cardinality` distinct values
+FieldWriter Text(int length, int cardinality, double null_ratio = 0) {
+    return [=](std::mt19937_64& rng, RowWriter& row) {
+        if (null_ratio > 0 && std::uniform_real_distribution<>()(rng) < null_ratio)
+            return row.Null();
+        auto value = std::to_string(rng() % cardinality);
+        value.resize(length, 'x');
+        row.Int32(length);
+        row.Bytes(value);
+    };
+}
+
+FieldWriter Uuid() {
+    return [](std::mt19937_64& rng, RowWriter& row) {
+        RowWriter value;
+        value.Int64(rng());
+        value.Int64(rng());
+        row.Field(value);
+    };
+}
+
+FieldWriter Interval() {
+    return [](std::mt19937_64& rng, RowWriter& row) {
+        RowWriter value;
+        value.Int64(rng() % 86400000000LL);
+        value.Int32(rng() % 365);
+        value.Int32(0);
+        row.Field(value);
+    };
+}
+
+// numeric values with 4 integer and 2 fractional digit groups
+FieldWriter Numeric() {
+    return [](std::mt19937_64& rng, RowWriter& row) {
+        RowWriter value;
+        value.Int16(6);
+        value.Int16(3);
+        value.Int16((rng() & 1) ? 0x4000 : 0);
+        value.Int16(8);
+        for (int i = 0; i < 6; i++)
+            value.Int16(rng() % 10000);
+        row.Field(value);
+    };
+}
+
+// 1D array of `size` elements of type `oid`, some of them null
+FieldWriter Array(int32_t oid, int size, FieldWriter element) {
+    return [=](std::mt19937_64& rng, RowWriter& row) {
+        RowWriter value;
+        value.Int32(1);
+        value.Int32(1);
+        value.Int32(oid);
+        value.Int32(size);
+        value.Int32(1);
+        for (int i = 0; i < size; i++)
+            element(rng, value);
+        row.Field(value);
+    };
+}
+
+// Composite of an int8 and a short text
+FieldWriter Composite() {
+    auto id = Fixed<int64_t, &RowWriter::Int64>();
+    auto name = Text(12, 1000);
+    return [=](std::mt19937_64& rng, RowWriter& row) {
+        RowWriter value;
+        value.Int32(2);
+        value.Int32(20);
+        id(rng, value);
+        value.Int32(25);
+        name(rng, value);
+        row.Field(value);
+    };
+}
+
+struct Case {
+    std::shared_ptr<arrow::Schema> schema;
+    std::vector<FieldWriter> fields;
+    Pg2Arrow::UserOptions options;
+};
+
+// Rows of a case, ending with the file trailer
+struct Rows {
+    std::vector<std::string> data;
+    std::vector<const char*> rows;
+    int64_t num_bytes = 0;
+
+    explicit Rows(const Case& c) {
+        std::mt19937_64 rng(42);
+        for (int64_t i = 0; i < kNumRows; i++) {
+            RowWriter row;
+            row.Int16(c.fields.size());
+            for (auto& field : c.fields)
+                field(rng, row);
+            data.push_back(row.data());
+            num_bytes += row.data().size();
+        }
+        RowWriter trailer;
+        trailer.Int16(-1);
+        data.push_back(trailer.data());
+        for (auto& row : data)
+            rows.push_back(row.data());
+    }
+};
+
+void SetCounters(benchmark::State& state, const Rows& rows) {
+    state.SetItemsProcessed(state.iterations() * kNumRows);
+    state.SetBytesProcessed(state.iterations() * rows.num_bytes);
+}
+
+// Row by row decoding followed by a flush, as done by the old CopyQuery
+void BM_Append(benchmark::State& state, const Case& c) {
+    Rows rows(c);
+    Pg2Arrow::PgBuilder builder(c.schema, c.options);
+    std::shared_ptr<arrow::RecordBatch> batch;
+    for (auto _ : state) {
+        for (auto row : rows.rows)
+            builder.Append(row);
+        auto status = builder.Flush(&batch);
+        benchmark::DoNotOptimize(batch);
+    }
+    SetCounters(state, rows);
+}
+
+// Block decoding, as done by CopyQuery
+void BM_AppendRows(benchmark::State& state, const Case& c) {
+    const int64_t kBlockRows = 1024;
+    Rows rows(c);
+    Pg2Arrow::PgBuilder builder(c.schema, c.options);
+    std::shared_ptr<arrow::RecordBatch> batch;
+    for (auto _ : state) {
+        for (size_t i = 0; i < rows.rows.size(); i += kBlockRows)
+            builder.AppendRows(
+                rows.rows.data() + i,
+                std::min<int64_t>(kBlockRows, rows.rows.size() - i));
+        auto status = builder.Flush(&batch);
+        benchmark::DoNotOptimize(batch);
+    }
+    SetCounters(state, rows);
+}
+
+// Flush alone, which finishes the arrays and builds dictionaries. Run a fixed
+// number of times as every iteration first decodes a whole batch untimed.
+const int64_t kFlushIterations = 100;
+
+void BM_Flush(benchmark::State& state, const Case& c) {
+    Rows rows(c);
+    Pg2Arrow::PgBuilder builder(c.schema, c.options);
+    std::shared_ptr<arrow::RecordBatch> batch;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (auto row : rows.rows)
+            builder.Append(row);
+        state.ResumeTiming();
+        auto status = builder.Flush(&batch);
+        benchmark::DoNotOptimize(batch);
+    }
+    SetCounters(state, rows);
+}
+
+Case Single(std::shared_ptr<arrow::DataType> type, FieldWriter field) {
+    return {arrow::schema({arrow::field("a", type)}), {field}, {}};
+}
+
+std::vector<std::pair<std::string, Case>> MakeCases() {
+    using namespace arrow;
+    typedef RowWriter W;
+    std::vector<std::pair<std::string, Case>> cases = {
+        {"bool", Single(boolean(), Bool())},
+        {"int2", Single(int16(), Fixed<int16_t, &W::Int16>())},
+        {"int4", Single(int32(), Fixed<int32_t, &W::Int32>())},
+        {"int8", Single(int64(), Fixed<int64_t, &W::Int64>())},
+        {"float4", Single(float32(), Fixed<float, &W::Float>())},
+        {"float8", Single(float64(), Fixed<double, &W::Double>())},
+        {"date", Single(date32(), Fixed<int32_t, &W::Int32>())},
+        {"timestamp",
+         Single(timestamp(TimeUnit::MICRO), Fixed<int64_t, &W::Int64>())},
+        {"interval", Single(duration(TimeUnit::MICRO), Interval())},
+        {"numeric", Single(decimal128(38, 8), Numeric())},
+        {"uuid", Single(fixed_size_binary(16), Uuid())},
+        {"text8", Single(utf8(), Text(8, kNumRows))},
+        {"text64", Single(utf8(), Text(64, kNumRows))},
+        {"text512", Single(utf8(), Text(512, kNumRows))},
+        {"real[]",
+         Single(list(float32()), Array(700, 8, Fixed<float, &W::Float>(0.1)))},
+        {"composite[]",
+         Single(
+             list(struct_({field("id", int64()), field("name", utf8())})),
+             Array(0, 4, Composite()))},
+        {"int4_null90", Single(int32(), Fixed<int32_t, &W::Int32>(0.9))},
+        {"text16_null90", Single(utf8(), Text(16, kNumRows, 0.9))},
+    };
+
+    // Low cardinality strings, plain and dictionary encoded
+    cases.push_back({"text8_card100", Single(utf8(), Text(8, 100))});
+    auto dictionary = Single(utf8(), Text(8, 100));
+    dictionary.options.dictionary_columns = {"a"};
+    cases.push_back({"text8_card100_dict", dictionary});
+
+    // A typical row of minute bars
+    cases.push_back(
+        {"bars",
+         {schema(
+              {field("ts", timestamp(TimeUnit::MICRO)), field("symbol", utf8()),
+               field("open", float32()), field("high", float32()),
+               field("low", float32()), field("close", float32()),
+               field("volume", int64())}),
+          {Fixed<int64_t, &W::Int64>(), Text(4, 500), Fixed<float, &W::Float>(),
+           Fixed<float, &W::Float>(), Fixed<float, &W::Float>(),
+           Fixed<float, &W::Float>(), Fixed<int64_t, &W::Int64>()},
+          {}}});
+    return cases;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    static auto cases = MakeCases();
+    for (auto& [name, c] : cases) {
+        benchmark::RegisterBenchmark(("Append/" + name).c_str(), BM_Append, c);
+        benchmark::RegisterBenchmark(("AppendRows/" + name).c_str(), BM_AppendRows, c);
+        benchmark::RegisterBenchmark(("Flush/" + name).c_str(), BM_Flush, c)
+            ->Iterations(kFlushIterations);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Python bindings. Batches are handed to pyarrow through the Arrow C stream
+// interface, so they are never copied nor converted.
+
+#include "../src/pg2arrow.h"
+
+#include <arrow/c/bridge.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace py = pybind11;
+
+namespace Pg2Arrow {
+
+static void Check(const arrow::Status& status) {
+    if (!status.ok())
+        throw std::runtime_error(status.message());
+}
+
+// Reads batches on a thread of its own, one batch ahead of the consumer at
+// most, so that pulling a batch from Python mostly finds it ready
+class PrefetchBatchReader : public arrow::RecordBatchReader {
+   public:
+    // Takes over `conn`, which may be null for COPY files, and closes it along
+    // with the reader
+    PrefetchBatchReader(std::shared_ptr<PgRecordBatchReader> reader, PGconn* conn)
+        : reader_(std::move(reader)), conn_(conn) {
+        thread_ = std::thread(&PrefetchBatchReader::Run, this);
+    }
+
+    ~PrefetchBatchReader() override { Stop(); }
+
+    std::shared_ptr<arrow::Schema> schema() const override {
+        return reader_->schema();
+    }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return !queue_.empty() || done_; });
+        if (queue_.empty()) {
+            batch->reset();
+            return status_;
+        }
+        *batch = std::move(queue_.front());
+        queue_.pop_front();
+        cv_.notify_all();
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Close() override {
+        Stop();
+        return arrow::Status::OK();
+    }
+
+   private:
+    static const size_t kMaxQueued = 1;
+
+    // A batch being read when the reader is closed is cut short by cancelling
+    // the query
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!done_ && conn_ != nullptr) {
+                char message[256];
+                auto cancel = PQgetCancel(conn_);
+                PQcancel(cancel, message, sizeof(message));
+                PQfreeCancel(cancel);
+            }
+            closed_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+        auto status = reader_->Close();
+        if (conn_ != nullptr)
+            PQfinish(conn_);
+        conn_ = nullptr;
+    }
+
+    void Run() {
+        while (true) {
+            std::shared_ptr<arrow::RecordBatch> batch;
+            auto status = reader_->ReadNext(&batch);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!status.ok() || batch == nullptr) {
+                status_ = status;
+                done_ = true;
+                cv_.notify_all();
+                return;
+            }
+            cv_.wait(lock, [&] { return queue_.size() < kMaxQueued || closed_; });
+            if (closed_) {
+                done_ = true;
+                return;
+            }
+            queue_.push_back(std::move(batch));
+            cv_.notify_all();
+        }
+    }
+
+    std::shared_ptr<PgRecordBatchReader> reader_;
+    PGconn* conn_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<arrow::RecordBatch>> queue_;
+    bool done_ = false;
+    bool closed_ = false;
+    arrow::Status status_;
+};
+
+// Keyword arguments shared by all the readers, with the defaults of pg2parquet
+static UserOptions ParseOptions(const py::kwargs& kwargs) {
+    UserOptions options;
+    options.batch_rows = 1 << 20;
+    options.batch_bytes = 256 << 20;
+    for (auto item : kwargs) {
+        auto name = item.first.cast<std::string>();
+        auto value = item.second;
+        if (name == "batch_rows")
+            options.batch_rows = value.cast<int64_t>();
+        else if (name == "batch_bytes")
+            options.batch_bytes = value.cast<int64_t>();
+        else if (name == "raw_socket")
+            options.raw_socket = value.cast<bool>();
+        else if (name == "numeric_precision")
+            options.numeric_precision = value.cast<int32_t>();
+        else if (name == "numeric_scale")
+            options.numeric_scale = value.cast<int32_t>();
+        else if (name == "dictionary_columns")
+            options.dictionary_columns = value.cast<std::vector<std::string>>();
+        else if (name == "auto_dictionary")
+            options.auto_dictionary = value.cast<bool>();
+        else if (name == "type_cache")
+            options.type_cache_filename = value.cast<std::string>();
+        else if (name == "string_views")
+            options.string_views = value.cast<bool>();
+        else if (name == "array_shapes")
+            options.array_shapes =
+                value.cast<std::map<std::string, std::vector<int32_t>>>();
+        else
+            throw py::type_error("unexpected keyword argument: " + name);
+    }
+    return options;
+}
+
+static PGconn* Connect(const std::string& conninfo) {
+    PGconn* conn = PQconnectdb(conninfo.c_str());
+    if (PQstatus(conn) != CONNECTION_OK) {
+        std::string message = PQerrorMessage(conn);
+        PQfinish(conn);
+        throw std::runtime_error("failed on PostgreSQL connection: " + message);
+    }
+    return conn;
+}
+
+static py::object ToPyArrow(const std::shared_ptr<arrow::Schema>& schema) {
+    auto c_schema = new ArrowSchema;
+    auto status = arrow::ExportSchema(*schema, c_schema);
+    if (!status.ok())
+        delete c_schema;
+    Check(status);
+
+    auto capsule = py::reinterpret_steal<py::object>(
+        PyCapsule_New(c_schema, "arrow_schema", [](PyObject* capsule) {
+            auto c_schema =
+                (ArrowSchema*)PyCapsule_GetPointer(capsule, "arrow_schema");
+            if (c_schema->release != nullptr)
+                c_schema->release(c_schema);
+            delete c_schema;
+        }));
+    return py::module_::import("pyarrow").attr("Schema").attr(
+        "_import_from_c_capsule")(capsule);
+}
+
+static py::object ToPyArrow(std::shared_ptr<arrow::RecordBatchReader> reader) {
+    auto stream = new ArrowArrayStream;
+    auto status = arrow::ExportRecordBatchReader(std::move(reader), stream);
+    if (!status.ok())
+        delete stream;
+    Check(status);
+
+    auto capsule = py::reinterpret_steal<py::object>(
+        PyCapsule_New(stream, "arrow_array_stream", [](PyObject* capsule) {
+            auto stream = (ArrowArrayStream*)PyCapsule_GetPointer(
+                capsule, "arrow_array_stream");
+            if (stream->release != nullptr)
+                stream->release(stream);
+            delete stream;
+        }));
+    return py::module_::import("pyarrow").attr("RecordBatchReader").attr(
+        "_import_from_c_capsule")(capsule);
+}
+
+// Any object exporting an Arrow schema, like a pyarrow.Schema
+static std::shared_ptr<arrow::Schema> FromPyArrow(const py::object& schema) {
+    py::object capsule = schema.attr("__arrow_c_schema__")();
+    auto c_schema = (ArrowSchema*)PyCapsule_GetPointer(capsule.ptr(), "arrow_schema");
+    if (c_schema == nullptr)
+        throw py::error_already_set();
+    auto result = arrow::ImportSchema(c_schema);
+    Check(result.status());
+    return *result;
+}
+
+static py::object GetSchema(
+    const std::string& conninfo,
+    const std::string& query,
+    const py::kwargs& kwargs) {
+    auto options = ParseOptions(kwargs);
+    std::shared_ptr<arrow::Schema> schema;
+    {
+        py::gil_scoped_release release;
+        PGconn* conn = Connect(conninfo);
+        auto query_schema = GetQuerySchema(conn, query.c_str(), options);
+        PQfinish(conn);
+        Check(query_schema.status());
+        schema = *query_schema;
+    }
+    return ToPyArrow(schema);
+}
+
+static py::object ReadBatches(
+    const std::string& conninfo,
+    const std::string& query,
+    const py::kwargs& kwargs) {
+    auto options = ParseOptions(kwargs);
+    std::shared_ptr<arrow::RecordBatchReader> reader;
+    {
+        py::gil_scoped_release release;
+        PGconn* conn = Connect(conninfo);
+        auto query_reader = PgRecordBatchReader::Open(conn, query.c_str(), options);
+        if (!query_reader.ok())
+            PQfinish(conn);
+        Check(query_reader.status());
+        reader = std::make_shared<PrefetchBatchReader>(std::move(*query_reader), conn);
+    }
+    return ToPyArrow(std::move(reader));
+}
+
+static py::object ReadCopyFileBatches(
+    const std::string& filename,
+    const py::object& schema,
+    const py::kwargs& kwargs) {
+    auto options = ParseOptions(kwargs);
+    // Same schema file as written next to the COPY file by pg2parquet --tee
+    auto arrow_schema = FromPyArrow(
+        schema.is_none() ? py::module_::import("pyarrow.ipc").attr("read_schema")(
+                               filename + ".schema")
+                         : schema);
+
+    std::shared_ptr<arrow::RecordBatchReader> reader;
+    {
+        py::gil_scoped_release release;
+        auto stream = OpenCopyFile(filename.c_str());
+        Check(stream.status());
+        auto file_reader =
+            PgRecordBatchReader::Open(std::move(*stream), arrow_schema, options);
+        Check(file_reader.status());
+        reader = std::make_shared<PrefetchBatchReader>(std::move(*file_reader), nullptr);
+    }
+    return ToPyArrow(std::move(reader));
+}
+
+}  // namespace Pg2Arrow
+
+PYBIND11_MODULE(pg2arrow, m) {
+    using namespace Pg2Arrow;
+
+    m.doc() = "PostgreSQL query results as Arrow record batches";
+
+    m.def(
+        "get_schema", &GetSchema, py::arg("conninfo"), py::arg("query"),
+        "Arrow schema of the results of `query`");
+
+    m.def(
+        "read_batches", &ReadBatches, py::arg("conninfo"), py::arg("query"),
+        "pyarrow.RecordBatchReader over the results of `query`, decoded as "
+        "they are read");
+
+    m.def(
+        "read_table",
+        [](const std::string& conninfo, const std::string& query,
+           const py::kwargs& kwargs) {
+            return ReadBatches(conninfo, query, kwargs).attr("read_all")();
+        },
+        py::arg("conninfo"), py::arg("query"),
+        "pyarrow.Table of the results of `query`");
+
+    m.def(
+        "read_copy_file_batches", &ReadCopyFileBatches, py::arg("filename"),
+        py::arg("schema") = py::none(),
+        "pyarrow.RecordBatchReader over a binary COPY file, its schema defaulting "
+        "to the one saved next to it by pg2parquet --tee");
+
+    m.def(
+        "read_copy_file",
+        [](const std::string& filename, const py::object& schema,
+           const py::kwargs& kwargs) {
+            return ReadCopyFileBatches(filename, schema, kwargs).attr("read_all")();
+        },
+        py::arg("filename"), py::arg("schema") = py::none(),
+        "pyarrow.Table of a binary COPY file");
+}
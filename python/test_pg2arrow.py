@@ -0,0 +1,143 @@
+# Decodes binary COPY files written here, without a database
+
+import decimal
+import struct
+
+import pyarrow as pa
+import pytest
+
+pg2arrow = pytest.importorskip("pg2arrow")
+
+SIGNATURE = b"PGCOPY\n\xff\r\n\x00"
+
+
+def field(value):
+    if value is None:
+        return struct.pack("!i", -1)
+    return struct.pack("!i", len(value)) + value
+
+
+def int8(value):
+    return None if value is None else struct.pack("!q", value)
+
+
+def text(value):
+    return None if value is None else value.encode()
+
+
+def array(rows, element, oid):
+    """A two dimensional array of `rows`, or an empty one"""
+    if not rows:
+        return struct.pack("!iii", 0, 0, oid)
+    elements = [element(v) for row in rows for v in row]
+    data = struct.pack("!iii", 2, None in elements, oid)
+    data += struct.pack("!iiii", len(rows), 1, len(rows[0]), 1)
+    return data + b"".join(field(e) for e in elements)
+
+
+def numeric(value):
+    """Base 10000 digit groups of a decimal, the weight of the first one"""
+    if value is None:
+        return None
+    sign, digits, exponent = value.as_tuple()
+    scale = max(0, -exponent)
+    digits = "".join(map(str, digits)) + "0" * max(0, exponent)
+    integer, fraction = digits[: len(digits) - scale], digits[len(digits) - scale :]
+    integer = integer.zfill((len(integer) + 3) // 4 * 4)
+    fraction = fraction.ljust((len(fraction) + 3) // 4 * 4, "0")
+    digits = integer + fraction
+    groups = [int(digits[i : i + 4]) for i in range(0, len(digits), 4)]
+    weight = len(integer) // 4 - 1
+    while groups and groups[0] == 0:
+        groups.pop(0)
+        weight -= 1
+    while groups and groups[-1] == 0:
+        groups.pop()
+    data = struct.pack(
+        "!hhHh", len(groups), weight if groups else 0, 0x4000 if sign else 0, scale
+    )
+    return data + b"".join(struct.pack("!h", g) for g in groups)
+
+
+def write_copy_file(path, columns):
+    """`columns` are (encoder, values) pairs of the same length"""
+    with open(path, "wb") as f:
+        f.write(SIGNATURE + struct.pack("!ii", 0, 0))
+        for row in zip(*(values for _, values in columns)):
+            f.write(struct.pack("!h", len(row)))
+            for (encoder, _), value in zip(columns, row):
+                f.write(field(encoder(value)))
+        f.write(struct.pack("!h", -1))
+
+
+ROWS = 5000
+IDS = list(range(ROWS))
+TEXTS = [None if i % 7 == 0 else f"value {i % 100}" for i in range(ROWS)]
+ARRAYS = [
+    None if i % 5 == 0 else [] if i % 5 == 1 else [[i, None], [i + 1, i + 2]]
+    for i in range(ROWS)
+]
+NUMERICS = [None if i % 3 == 0 else decimal.Decimal(i - 2500) / 8 for i in range(ROWS)]
+MOODS = ["sad", "ok", "happy"]
+ENUMS = [MOODS[i % 3] if i % 4 else None for i in range(ROWS)]
+
+SCHEMA = pa.schema(
+    [
+        pa.field("id", pa.int64()),
+        pa.field("t", pa.utf8()),
+        pa.field("a", pa.list_(pa.int64())),
+        pa.field("n", pa.decimal128(10, 3)),
+        pa.field(
+            "e",
+            pa.dictionary(pa.int8(), pa.utf8()),
+            metadata={b"pg2arrow.enum_labels": "\0".join(MOODS).encode()},
+        ),
+    ]
+)
+
+
+@pytest.fixture
+def copy_file(tmp_path):
+    path = str(tmp_path / "rows.pgcopy")
+    write_copy_file(
+        path,
+        [
+            (int8, IDS),
+            (text, TEXTS),
+            (lambda v: None if v is None else array(v, int8, 20), ARRAYS),
+            (numeric, NUMERICS),
+            (text, ENUMS),
+        ],
+    )
+    return path
+
+
+def test_read_copy_file(copy_file):
+    table = pg2arrow.read_copy_file(copy_file, SCHEMA, array_shapes={"a": [-1, -1]})
+    assert table.num_rows == ROWS
+    assert table.schema.field("a").type == pa.list_(pa.list_(pa.int64()))
+    assert table.schema.field("e").type == pa.dictionary(pa.int8(), pa.utf8())
+    assert table.column("id").to_pylist() == IDS
+    assert table.column("t").to_pylist() == TEXTS
+    assert table.column("a").to_pylist() == ARRAYS
+    assert table.column("n").to_pylist() == NUMERICS
+    assert table.column("e").to_pylist() == ENUMS
+
+
+@pytest.mark.parametrize(
+    "options, type",
+    [
+        ({}, pa.utf8()),
+        ({"dictionary_columns": ["t"]}, pa.dictionary(pa.int32(), pa.utf8())),
+        ({"auto_dictionary": True}, pa.dictionary(pa.int32(), pa.utf8())),
+        ({"string_views": True}, pa.string_view()),
+    ],
+)
+def test_read_copy_file_batches(copy_file, options, type):
+    reader = pg2arrow.read_copy_file_batches(
+        copy_file, SCHEMA, batch_rows=1000, **options
+    )
+    batches = list(reader)
+    assert [b.num_rows for b in batches] == [1000] * 5
+    assert batches[0].schema.field("t").type == type
+    assert pa.Table.from_batches(batches).column("t").to_pylist() == TEXTS
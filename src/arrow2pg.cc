@@ -0,0 +1,266 @@
+// Loads Parquet and Arrow IPC files into a PostgreSQL table with binary COPY,
+// the reverse of pg2parquet
+
+#include "./pg2arrow.h"
+
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/file_reader.h>
+
+#include <getopt.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+static const char* conninfo = "postgresql://localhost/mytests";
+static const char* table = nullptr;
+static int jobs = 1;
+static std::vector<std::string> filenames;
+static Pg2Arrow::UserOptions user_options;
+
+static const char kUsage[] =
+    "usage: arrow2pg -d conninfo -T table [-j jobs] file ...\n";
+
+static void parse_options(int argc, char* const argv[]) {
+    static struct option options[] = {
+        {"conninfo", 1, NULL, 'd'},
+        {"table", 1, NULL, 'T'},
+        {"jobs", 1, NULL, 'j'},
+        {"help", 0, NULL, 9999},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "d:T:j:", options, NULL)) >= 0) {
+        if (c == 'd')
+            conninfo = optarg;
+        else if (c == 'T')
+            table = optarg;
+        else if (c == 'j')
+            jobs = std::max(1, atoi(optarg));
+        else {
+            fputs(kUsage, stderr);
+            exit(c == 9999 ? 0 : 1);
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        filenames.push_back(argv[i]);
+    if (table == nullptr || filenames.empty()) {
+        fputs(kUsage, stderr);
+        exit(1);
+    }
+}
+
+enum class FileFormat { kParquet, kIpcFile, kIpcStream };
+
+static FileFormat GetFileFormat(const std::string& filename) {
+    char magic[6] = {};
+    std::ifstream(filename, std::ios::binary).read(magic, sizeof(magic));
+    if (memcmp(magic, "PAR1", 4) == 0)
+        return FileFormat::kParquet;
+    if (memcmp(magic, "ARROW1", 6) == 0)
+        return FileFormat::kIpcFile;
+    return FileFormat::kIpcStream;
+}
+
+// A file, or a single row group of a Parquet file
+struct LoadUnit {
+    std::string filename;
+    FileFormat format;
+    int row_group = -1;
+};
+
+// Keeps the Parquet file open for as long as its batches are read
+class ParquetUnitReader : public arrow::RecordBatchReader {
+   public:
+    ParquetUnitReader(
+        std::unique_ptr<parquet::arrow::FileReader> file,
+        std::unique_ptr<arrow::RecordBatchReader> reader)
+        : file_(std::move(file)), reader_(std::move(reader)) {}
+
+    std::shared_ptr<arrow::Schema> schema() const override {
+        return reader_->schema();
+    }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+        return reader_->ReadNext(batch);
+    }
+
+   private:
+    std::unique_ptr<parquet::arrow::FileReader> file_;
+    std::unique_ptr<arrow::RecordBatchReader> reader_;
+};
+
+// Reads the record batches of an IPC file one after the other
+class IpcFileUnitReader : public arrow::RecordBatchReader {
+   public:
+    explicit IpcFileUnitReader(std::shared_ptr<arrow::ipc::RecordBatchFileReader> file)
+        : file_(std::move(file)) {}
+
+    std::shared_ptr<arrow::Schema> schema() const override { return file_->schema(); }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+        if (next_ == file_->num_record_batches()) {
+            batch->reset();
+            return arrow::Status::OK();
+        }
+        ARROW_ASSIGN_OR_RAISE(*batch, file_->ReadRecordBatch(next_++));
+        return arrow::Status::OK();
+    }
+
+   private:
+    std::shared_ptr<arrow::ipc::RecordBatchFileReader> file_;
+    int next_ = 0;
+};
+
+static arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> OpenUnit(
+    const LoadUnit& unit) {
+    switch (unit.format) {
+        case FileFormat::kParquet: {
+            ARROW_ASSIGN_OR_RAISE(
+                auto input, arrow::io::ReadableFile::Open(unit.filename));
+            ARROW_ASSIGN_OR_RAISE(
+                auto file,
+                parquet::arrow::OpenFile(input, arrow::default_memory_pool()));
+            std::vector<int> row_groups;
+            if (unit.row_group >= 0) {
+                row_groups.push_back(unit.row_group);
+            } else {
+                for (int i = 0; i < file->num_row_groups(); i++)
+                    row_groups.push_back(i);
+            }
+            ARROW_ASSIGN_OR_RAISE(auto reader, file->GetRecordBatchReader(row_groups));
+            return std::make_shared<ParquetUnitReader>(
+                std::move(file), std::move(reader));
+        }
+        case FileFormat::kIpcFile: {
+            ARROW_ASSIGN_OR_RAISE(
+                auto input, arrow::io::ReadableFile::Open(unit.filename));
+            ARROW_ASSIGN_OR_RAISE(
+                auto file, arrow::ipc::RecordBatchFileReader::Open(input));
+            return std::make_shared<IpcFileUnitReader>(std::move(file));
+        }
+        default: {
+            ARROW_ASSIGN_OR_RAISE(
+                auto input, arrow::io::ReadableFile::Open(unit.filename));
+            ARROW_ASSIGN_OR_RAISE(
+                auto reader, arrow::ipc::RecordBatchStreamReader::Open(input));
+            return reader;
+        }
+    }
+}
+
+// Parquet files are split into their row groups when loading in parallel, so
+// that a single large file still keeps every connection busy
+static arrow::Result<std::vector<LoadUnit>> GetLoadUnits() {
+    std::vector<LoadUnit> units;
+    for (auto& filename : filenames) {
+        auto format = GetFileFormat(filename);
+        if (format != FileFormat::kParquet || jobs == 1) {
+            units.push_back({filename, format});
+            continue;
+        }
+        std::unique_ptr<parquet::ParquetFileReader> file;
+        try {
+            file = parquet::ParquetFileReader::OpenFile(filename);
+        } catch (const std::exception& e) {
+            return arrow::Status::IOError(filename, ": ", e.what());
+        }
+        for (int i = 0; i < file->metadata()->num_row_groups(); i++)
+            units.push_back({filename, format, i});
+    }
+    return units;
+}
+
+static arrow::Status Exec(PGconn* conn, const char* query) {
+    auto res = PQexec(conn, query);
+    auto status = PQresultStatus(res) == PGRES_COMMAND_OK
+                      ? arrow::Status::OK()
+                      : arrow::Status::IOError(
+                            "error in '", query, "': ", PQresultErrorMessage(res));
+    PQclear(res);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+    auto start_time = std::chrono::steady_clock::now();
+
+    auto units = GetLoadUnits();
+    if (!units.ok()) {
+        std::cerr << units.status().message() << std::endl;
+        return 1;
+    }
+    int num_connections = std::min<int>(jobs, units->size());
+
+    // Every connection loads in a transaction of its own, all of them being
+    // committed only once every unit is loaded. They are committed one after
+    // the other, so a failed COMMIT leaves the units of the connections
+    // committed before it in the table.
+    std::vector<PGconn*> conns;
+    for (int i = 0; i < num_connections; i++) {
+        conns.push_back(PQconnectdb(conninfo));
+        if (PQstatus(conns.back()) != CONNECTION_OK) {
+            std::cerr << "failed on PostgreSQL connection: "
+                      << PQerrorMessage(conns.back()) << std::endl;
+            for (auto conn : conns)
+                PQfinish(conn);
+            return 1;
+        }
+    }
+
+    Pg2Arrow::CopyStats stats;
+    std::atomic<size_t> next_unit{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+    for (auto conn : conns) {
+        threads.emplace_back([&, conn]() {
+            auto status = Exec(conn, "BEGIN");
+            size_t i;
+            while (status.ok() && !failed && (i = next_unit++) < units->size()) {
+                auto& unit = (*units)[i];
+                auto reader = OpenUnit(unit);
+                status = reader.ok() ? Pg2Arrow::CopyIntoTable(
+                                           conn, table, **reader, user_options, &stats)
+                                     : reader.status();
+                if (!status.ok())
+                    status = status.WithMessage(unit.filename, ": ", status.message());
+            }
+            if (!status.ok()) {
+                std::cerr << status.message() << std::endl;
+                failed = true;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    size_t committed = 0;
+    for (auto conn : conns) {
+        auto status = Exec(conn, failed ? "ROLLBACK" : "COMMIT");
+        if (!status.ok()) {
+            std::cerr << status.message() << std::endl;
+            if (committed > 0)
+                std::cerr << "the data of " << committed << " of " << conns.size()
+                          << " connections was committed, the table holds a "
+                             "partial load"
+                          << std::endl;
+            failed = true;
+        } else if (!failed) {
+            committed++;
+        }
+        PQfinish(conn);
+    }
+    if (failed)
+        return 1;
+
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time)
+            .count();
+    fprintf(
+        stderr, "loaded %lld rows, %.1f MB of COPY data in %.2f s\n",
+        (long long)stats.rows.load(), stats.bytes.load() / 1e6, seconds);
+    return 0;
+}
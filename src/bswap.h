@@ -0,0 +1,120 @@
+// In place network to host byte order conversion of whole arrays, used by the
+// columnar decode path. Runs 32 or 16 bytes at a time with AVX2 / SSSE3
+// shuffles (picked at runtime) on x86 and byte reversals on NEON.
+
+#pragma once
+
+#include "./hton.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define PG2ARROW_BSWAP_X86
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PG2ARROW_BSWAP_NEON
+#endif
+
+namespace Pg2Arrow {
+
+#if defined(PG2ARROW_BSWAP_X86)
+
+// pshufb masks reversing the bytes of each word of a 16 bytes lane
+template <int kWidth>
+static inline const char* ByteSwapMask() {
+    static const char kMask2[16] = {
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14};
+    static const char kMask4[16] = {
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+    static const char kMask8[16] = {
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8};
+    return kWidth == 2 ? kMask2 : kWidth == 4 ? kMask4 : kMask8;
+}
+
+template <int kWidth>
+__attribute__((target("avx2"))) static int64_t ByteSwapAvx2(char* data, int64_t size) {
+    auto mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)ByteSwapMask<kWidth>()));
+    int64_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+template <int kWidth>
+__attribute__((target("ssse3"))) static int64_t ByteSwapSsse3(
+    char* data,
+    int64_t size) {
+    auto mask = _mm_loadu_si128((const __m128i*)ByteSwapMask<kWidth>());
+    int64_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+#elif defined(PG2ARROW_BSWAP_NEON)
+
+template <int kWidth>
+static int64_t ByteSwapNeon(char* data, int64_t size) {
+    int64_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto v = vld1q_u8((const uint8_t*)(data + i));
+        if constexpr (kWidth == 2)
+            v = vrev16q_u8(v);
+        else if constexpr (kWidth == 4)
+            v = vrev32q_u8(v);
+        else
+            v = vrev64q_u8(v);
+        vst1q_u8((uint8_t*)(data + i), v);
+    }
+    return i;
+}
+
+#endif
+
+// Converts `length` big endian words of `kWidth` bytes to host order
+template <int kWidth>
+static inline void NetworkToHost(void* values, int64_t length) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    char* data = (char*)values;
+    int64_t size = length * kWidth;
+    int64_t done = 0;
+
+#if defined(PG2ARROW_BSWAP_X86)
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    static const bool kHasSsse3 = __builtin_cpu_supports("ssse3");
+    if (kHasAvx2)
+        done = ByteSwapAvx2<kWidth>(data, size);
+    else if (kHasSsse3)
+        done = ByteSwapSsse3<kWidth>(data, size);
+#elif defined(PG2ARROW_BSWAP_NEON)
+    done = ByteSwapNeon<kWidth>(data, size);
+#endif
+
+    for (; done < size; done += kWidth) {
+        if constexpr (kWidth == 2) {
+            uint16_t x;
+            memcpy(&x, data + done, 2);
+            x = apg_bswap16(x);
+            memcpy(data + done, &x, 2);
+        } else if constexpr (kWidth == 4) {
+            uint32_t x;
+            memcpy(&x, data + done, 4);
+            x = apg_bswap32(x);
+            memcpy(data + done, &x, 4);
+        } else {
+            uint64_t x;
+            memcpy(&x, data + done, 8);
+            x = apg_bswap64(x);
+            memcpy(data + done, &x, 8);
+        }
+    }
+#endif
+}
+
+}  // namespace Pg2Arrow
@@ -1,6 +1,17 @@
 #include "./pg2arrow.h"
 
+#include "./bswap.h"
 #include "./hton.h"
+#include "./memo_table.h"
+
+#include <arrow/util/byte_size.h>
+#if ARROW_VERSION_MAJOR >= 15
+#include <arrow/util/binary_view_util.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 using namespace arrow;
 
@@ -55,7 +66,8 @@ struct DoubleMapper {
 };
 
 template <typename T, typename F>
-int32_t GenericDecoder(DecoderMap&, ArrayBuilder* builder, const char* cursor) {
+int32_t GenericDecoder(const DecodeNode& node, const char* cursor) {
+    auto builder = node.builder;
     int32_t flen = unpack_int32(cursor);
     cursor += 4;
 
@@ -81,76 +93,646 @@ int32_t GenericDecoder(DecoderMap&, ArrayBuilder* builder, const char* cursor) {
     return 4 + flen;
 }
 
-int32_t ListDecoder(DecoderMap& decoders, ArrayBuilder* builder, const char* cursor) {
+// Same as GenericDecoder for fixed width builders with room already reserved
+// for the value, skipping capacity checks and status construction
+template <typename T, typename F>
+int32_t ReservedDecoder(const DecodeNode& node, const char* cursor) {
+    auto builder = (T*)node.builder;
     int32_t flen = unpack_int32(cursor);
     cursor += 4;
 
     if (flen == -1) {
+        if constexpr (
+            std::is_base_of<T, FloatBuilder>::value ||
+            std::is_base_of<T, DoubleBuilder>::value)
+            builder->UnsafeAppend(NAN);
+        else
+            builder->UnsafeAppendNull();
+        return 4;
+    }
+
+    builder->UnsafeAppend(F::Unpack(cursor));
+    return 4 + flen;
+}
+
+// Decodes a whole column of a block of rows, the value of row `i` starting at
+// `rows[i] + offsets[i * step]`. Values are gathered into `values`, converted to
+// host order all at once and appended in bulk along with their validity.
+template <typename T, int kWidth, int64_t kEpoch = 0>
+void FixedColumnDecoder(
+    const DecodeNode& node,
+    const char* const* rows,
+    const int32_t* offsets,
+    int64_t step,
+    int64_t num_rows,
+    void* values,
+    uint8_t* valid) {
+    typedef std::conditional_t<
+        std::is_same<T, BooleanBuilder>::value, uint8_t, typename T::value_type>
+        V;
+    constexpr bool kNanNulls = std::is_floating_point<V>::value;
+
+    auto data = (char*)values;
+    int64_t null_count = 0;
+    for (int64_t i = 0; i < num_rows; i++) {
+        const char* cursor = rows[i] + offsets[i * step];
+        bool is_valid = unpack_int32(cursor) != -1;
+        if (is_valid)
+            memcpy(data + i * kWidth, cursor + 4, kWidth);
+        else
+            memset(data + i * kWidth, 0, kWidth);
+        valid[i] = is_valid;
+        null_count += !is_valid;
+    }
+
+    if constexpr (kWidth > 1)
+        NetworkToHost<kWidth>(values, num_rows);
+
+    auto typed_values = (V*)values;
+    if constexpr (kEpoch != 0) {
+        for (int64_t i = 0; i < num_rows; i++)
+            typed_values[i] += kEpoch;
+    }
+
+    auto builder = (T*)node.builder;
+    if (null_count == 0) {
+        auto status = builder->AppendValues(typed_values, num_rows);
+    } else if constexpr (kNanNulls) {
+        for (int64_t i = 0; i < num_rows; i++)
+            typed_values[i] = valid[i] ? typed_values[i] : NAN;
+        auto status = builder->AppendValues(typed_values, num_rows);
+    } else {
+        auto status = builder->AppendValues(typed_values, num_rows, valid);
+    }
+}
+
+// Falls back to the row decoder of the node, one value after the other
+void RowColumnDecoder(
+    const DecodeNode& node,
+    const char* const* rows,
+    const int32_t* offsets,
+    int64_t step,
+    int64_t num_rows,
+    void*,
+    uint8_t*) {
+    for (int64_t i = 0; i < num_rows; i++)
+        node.decoder(node, rows[i] + offsets[i * step]);
+}
+
+struct NumericState : public DecoderState {
+    int32_t scale;
+    // Integer digits the decimal has room for, and values with more of them
+    // appended as nulls since the last flush
+    int32_t max_digits;
+    int64_t overflows = 0;
+};
+
+// Accumulates base 10000 digit groups into a 128 bits integer natively when the
+// compiler supports it, through arrow decimal arithmetic otherwise
+template <typename D>
+struct NumericAccumulator {
+    typedef D type;
+    static inline D ToDecimal(D value, bool negative) {
+        return negative ? value.Negate() : value;
+    }
+};
+
+#ifdef __SIZEOF_INT128__
+template <>
+struct NumericAccumulator<Decimal128> {
+    typedef __int128 type;
+    static inline Decimal128 ToDecimal(__int128 value, bool negative) {
+        value = negative ? -value : value;
+        return Decimal128((int64_t)(value >> 64), (uint64_t)value);
+    }
+};
+#endif
+
+// PostgreSQL numerics are sent as base 10000 digit groups: the value is the sum
+// of digits[i] * 10000^(weight - i). The decimal is that value times 10^scale,
+// built with one multiply-accumulate per group down to the last fractional
+// group covered by the scale.
+template <typename T, typename D>
+int32_t NumericDecoder(const DecodeNode& node, const char* cursor) {
+    static const int32_t kPowersOfTen[] = {1, 10, 100, 1000, 10000};
+    static const uint16_t kNumericNegative = 0x4000;
+    static const uint16_t kNumericSpecial = 0xC000;  // NaN and infinities
+
+    auto builder = (T*)node.builder;
+    int32_t flen = unpack_int32(cursor);
+    cursor += 4;
+
+    if (flen == -1) {
+        auto status = builder->AppendNull();
+        return 4;
+    }
+
+    int16_t ndigits = unpack_int16(cursor);
+    int16_t weight = unpack_int16(cursor + 2);
+    uint16_t sign = unpack_uint16(cursor + 4);
+    // int16_t dscale = unpack_int16(cursor + 6);
+    const char* digits = cursor + 8;
+
+    if ((sign & kNumericSpecial) == kNumericSpecial) {
         auto status = builder->AppendNull();
+        return 4 + flen;
+    }
+
+    // Values too large for the decimal would otherwise wrap around
+    auto state = (NumericState*)node.state;
+    if (4 * (weight + 1) > state->max_digits && ndigits > 0) {
+        int32_t first = unpack_int16(digits);
+        int32_t first_digits =
+            first >= 1000 ? 4 : first >= 100 ? 3 : first >= 10 ? 2 : 1;
+        if (4 * weight + first_digits > state->max_digits) {
+            state->overflows++;
+            auto status = builder->AppendNull();
+            return 4 + flen;
+        }
+    }
+
+    int32_t scale = state->scale;
+    int32_t frac_groups = (scale + 3) / 4;
+    int32_t last_digits = scale - 4 * (frac_groups - 1);
+
+    typedef typename NumericAccumulator<D>::type A;
+    A value = 0;
+    int32_t last = -frac_groups + (scale % 4 != 0);
+    for (int32_t i = 0, w = weight; w >= last; i++, w--) {
+        int32_t digit = i < ndigits ? unpack_int16(digits + 2 * i) : 0;
+        value = value * A(10000) + A(digit);
+    }
+    // Only the leading digits of the last group fit in the scale
+    if (scale % 4 != 0 && weight >= -frac_groups) {
+        int32_t i = weight + frac_groups;
+        int32_t digit = i < ndigits ? unpack_int16(digits + 2 * i) : 0;
+        value = value * A(kPowersOfTen[last_digits]) +
+                A(digit / kPowersOfTen[4 - last_digits]);
+    }
+
+    auto status = builder->Append(
+        NumericAccumulator<D>::ToDecimal(value, sign == kNumericNegative));
+    return 4 + flen;
+}
+
+// Decodes the `count` elements of an array without nulls starting at `cursor`
+// and returns the end of the array, or null when the builder could not make
+// room for them, for the elements to be appended one by one instead
+typedef const char* (*ArrayDecoder)(const DecodeNode&, const char*, int32_t);
+
+// Elements are (int32 length, value) pairs of a fixed size: the values are
+// gathered straight into the reserved buffer of the builder, then converted to
+// host order there all at once
+template <typename T, int kWidth, int64_t kEpoch = 0>
+const char* FixedArrayDecoder(
+    const DecodeNode& node,
+    const char* cursor,
+    int32_t count) {
+    auto builder = (T*)node.builder;
+    if (!builder->Reserve(count).ok())
+        return nullptr;
+    auto values = builder->GetMutableValue(builder->length());
+    auto data = (char*)values;
+    for (int32_t i = 0; i < count; i++)
+        memcpy(data + i * kWidth, cursor + i * (4 + kWidth) + 4, kWidth);
+
+    NetworkToHost<kWidth>(values, count);
+    if constexpr (kEpoch != 0) {
+        for (int32_t i = 0; i < count; i++)
+            values[i] += kEpoch;
+    }
+    builder->UnsafeAdvance(count);
+    return cursor + count * (4 + kWidth);
+}
+
+// As in PostgreSQL
+static const int32_t kMaxArrayDims = 6;
+
+struct ListState : public DecoderState {
+    // Size of each dimension, -1 for the variable ones (lists rather than
+    // fixed size lists), the last one holding the elements
+    std::vector<int32_t> sizes;
+    // Bulk decoder of the elements and their size in the COPY data, if they
+    // have a fixed width
+    ArrayDecoder bulk_decoder = nullptr;
+    int32_t element_size = 0;
+};
+
+// Appends the elements of an array, dimension after dimension down from
+// `level`, each of them getting one (fixed size) list builder of the plan
+static const char* AppendDimension(
+    const DecodeNode& node,
+    const ListState& state,
+    const int32_t* dims,
+    size_t level,
+    bool hasnulls,
+    const char* cursor) {
+    auto status = node.builder->type()->id() == Type::type::LIST
+                      ? ((ListBuilder*)node.builder)->Append()
+                      : ((FixedSizeListBuilder*)node.builder)->Append();
+
+    auto& child = node.children[0];
+    if (level + 1 < state.sizes.size()) {
+        for (int32_t i = 0; i < dims[level]; i++)
+            cursor = AppendDimension(child, state, dims, level + 1, hasnulls, cursor);
+        return cursor;
+    }
+
+    if (!hasnulls && state.bulk_decoder) {
+        auto end = state.bulk_decoder(child, cursor, dims[level]);
+        if (end != nullptr)
+            return end;
+    }
+    for (int32_t i = 0; i < dims[level]; i++)
+        cursor += child.decoder(child, cursor);
+    return cursor;
+}
+
+// Arrays have as many nested lists as dimensions. Those of another number of
+// dimensions, or with another size where the list has a fixed size, are
+// appended as nulls. One dimensional lists take all the elements of arrays of
+// any shape, as a flat list.
+int32_t ListDecoder(const DecodeNode& node, const char* cursor) {
+    int32_t flen = unpack_int32(cursor);
+    cursor += 4;
+
+    if (flen == -1) {
+        auto status = node.builder->AppendNull();
         return 4;
     }
 
+    auto& state = *(const ListState*)node.state;
+    const char* end = cursor + flen;
     int32_t ndims = unpack_int32(cursor);
     cursor += 4;
-    // int32_t hasnulls = unpack_int32(cursor);
+    bool hasnulls = unpack_int32(cursor) != 0;
     cursor += 4;
     // int32_t elem_oid = unpack_int32(cursor);
     cursor += 4;
 
-    // Element will be flattened
-    int32_t total_elem = 1;
-    for (size_t i = 0; i < ndims; i++) {
+    int32_t dims[kMaxArrayDims];
+    int32_t total_elem = ndims > 0 ? 1 : 0;
+    for (int32_t i = 0; i < ndims; i++) {
         int32_t dim_sz = unpack_int32(cursor);
         cursor += 4;
         // int32_t dim_lb = unpack_int32(cursor);
         cursor += 4;
+        if (i < kMaxArrayDims)
+            dims[i] = dim_sz;
         total_elem *= dim_sz;
     }
 
-    auto lbuilder = (ListBuilder*)builder;
-    auto status = lbuilder->Append();
-    auto value_builder = lbuilder->value_builder();
-    auto decoder = decoders[value_builder];
-    for (size_t i = 0; i < total_elem; i++) {
-        cursor += decoder(decoders, value_builder, cursor);
+    auto& sizes = state.sizes;
+    if (sizes.size() == 1) {
+        dims[0] = total_elem;
+    } else if (ndims == 0 && (int32_t)sizes.size() <= kMaxArrayDims) {
+        // Empty arrays have no dimensions, they go as an empty outer list
+        for (size_t i = 0; i < sizes.size(); i++)
+            dims[i] = i > 0 && sizes[i] >= 0 ? sizes[i] : 0;
+    } else if (ndims != (int32_t)sizes.size()) {
+        auto status = node.builder->AppendNull();
+        return 4 + flen;
+    }
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] >= 0 && dims[i] != sizes[i]) {
+            auto status = node.builder->AppendNull();
+            return 4 + flen;
+        }
     }
 
+    // The elements fill the rest of the array unless the COPY data disagrees
+    // with their type
+    if (!hasnulls && state.bulk_decoder &&
+        cursor + total_elem * (4 + state.element_size) != end)
+        hasnulls = true;
+    AppendDimension(node, state, dims, 0, hasnulls, cursor);
     return 4 + flen;
 }
 
-int32_t StructDecoder(DecoderMap& decoders, ArrayBuilder* builder, const char* cursor) {
+int32_t StructDecoder(const DecodeNode& node, const char* cursor) {
     int32_t flen = unpack_int32(cursor);
     cursor += 4;
 
     if (flen == -1) {
-        auto status = builder->AppendNull();
+        auto status = node.builder->AppendNull();
         return 4;
     }
 
-    auto sbuilder = (StructBuilder*)builder;
-    auto status = sbuilder->Append();
+    auto status = ((StructBuilder*)node.builder)->Append();
 
     int32_t nvalids = unpack_int32(cursor);
     cursor += 4;
 
-    int num_fields = sbuilder->num_fields();
-    for (size_t i = 0; i < num_fields; i++) {
+    for (size_t i = 0; i < node.num_children; i++) {
+        auto& field = node.children[i];
         if (i >= nvalids) {
             // TODO: check postgres ref code
-            status = sbuilder->field_builder(i)->AppendNull();
+            status = field.builder->AppendNull();
             continue;
         }
         // int32_t elem_oid = unpack_int32(cursor);
         cursor += 4;
 
-        auto item_builder = sbuilder->field_builder(i);
-        cursor += decoders[item_builder](decoders, item_builder, cursor);
+        cursor += field.decoder(field, cursor);
+    }
+
+    return 4 + flen;
+}
+
+struct DictionaryState : public DecoderState {
+    StringMemoTable memo;
+    // Whether the column may still go back to plain strings
+    bool adaptive;
+    int64_t max_size;
+    int64_t max_bytes;
+
+    bool IsFull() const {
+        return memo.size() > max_size || memo.value_bytes() > max_bytes;
+    }
+};
+
+// Appends the index of the value in the memo table of the column, the top level
+// builder being reserved
+int32_t DictionaryDecoder(const DecodeNode& node, const char* cursor) {
+    auto builder = (Int32Builder*)node.builder;
+    int32_t flen = unpack_int32(cursor);
+    cursor += 4;
+
+    if (flen == -1) {
+        builder->UnsafeAppendNull();
+        return 4;
+    }
+
+    auto state = (DictionaryState*)node.state;
+    builder->UnsafeAppend(state->memo.GetOrInsert(cursor, flen));
+    return 4 + flen;
+}
+
+// Labels of an enum and their dictionary, shared by all the batches
+struct EnumState : public DecoderState {
+    static const size_t kMaxScan = 8;
+
+    std::vector<std::string> labels;
+    // Indices of the labels of every length, sorted by label when there are
+    // more than kMaxScan of them
+    std::vector<std::vector<int32_t>> buckets;
+    std::shared_ptr<ArrayData> dictionary;
+
+    int32_t Find(const char* value, int32_t size) const {
+        if (size >= (int32_t)buckets.size())
+            return -1;
+        auto& bucket = buckets[size];
+        if (bucket.size() <= kMaxScan) {
+            for (auto index : bucket) {
+                if (memcmp(labels[index].data(), value, size) == 0)
+                    return index;
+            }
+            return -1;
+        }
+        auto it = std::lower_bound(
+            bucket.begin(), bucket.end(), value, [&](int32_t index, const char* v) {
+                return memcmp(labels[index].data(), v, size) < 0;
+            });
+        if (it == bucket.end() || memcmp(labels[*it].data(), value, size) != 0)
+            return -1;
+        return *it;
+    }
+};
+
+// Appends the index of the label to the builder of the index type, labels
+// missing from the schema, added since it was read, being nulls
+template <typename T, bool kReserved>
+int32_t EnumDecoder(const DecodeNode& node, const char* cursor) {
+    auto builder = (T*)node.builder;
+    int32_t flen = unpack_int32(cursor);
+    cursor += 4;
+
+    int32_t index = flen == -1 ? -1 : ((EnumState*)node.state)->Find(cursor, flen);
+    if constexpr (kReserved) {
+        if (index < 0)
+            builder->UnsafeAppendNull();
+        else
+            builder->UnsafeAppend(index);
+    } else {
+        auto status = index < 0 ? builder->AppendNull() : builder->Append(index);
+    }
+    return flen == -1 ? 4 : 4 + flen;
+}
+
+static std::unique_ptr<EnumState> MakeEnumState(const Field& field, MemoryPool* pool) {
+    if (field.type()->id() != Type::type::DICTIONARY || !field.HasMetadata())
+        return nullptr;
+    auto labels = field.metadata()->Get(kEnumLabelsKey);
+    if (!labels.ok())
+        return nullptr;
+
+    auto state = std::make_unique<EnumState>();
+    size_t start = 0;
+    while (!labels->empty() && start <= labels->size()) {
+        auto end = labels->find('\0', start);
+        if (end == std::string::npos)
+            end = labels->size();
+        state->labels.push_back(labels->substr(start, end - start));
+        start = end + 1;
+    }
+
+    StringBuilder builder(pool);
+    for (size_t i = 0; i < state->labels.size(); i++) {
+        auto& label = state->labels[i];
+        if (label.size() >= state->buckets.size())
+            state->buckets.resize(label.size() + 1);
+        state->buckets[label.size()].push_back(i);
+        auto status = builder.Append(label);
+    }
+    for (auto& bucket : state->buckets) {
+        if (bucket.size() > EnumState::kMaxScan)
+            std::sort(bucket.begin(), bucket.end(), [&](int32_t a, int32_t b) {
+                return state->labels[a] < state->labels[b];
+            });
+    }
+    auto status = builder.FinishInternal(&state->dictionary);
+    return state;
+}
+
+static FieldDecoder GetEnumDecoder(const DataType& index_type, bool reserved) {
+    switch (index_type.id()) {
+        case Type::type::INT8:
+            return reserved ? EnumDecoder<Int8Builder, true>
+                            : EnumDecoder<Int8Builder, false>;
+        case Type::type::INT16:
+            return reserved ? EnumDecoder<Int16Builder, true>
+                            : EnumDecoder<Int16Builder, false>;
+        default:
+            return reserved ? EnumDecoder<Int32Builder, true>
+                            : EnumDecoder<Int32Builder, false>;
+    }
+}
+
+#if ARROW_VERSION_MAJOR >= 15
+// Builds utf8_view or binary_view arrays. Values longer than the 12 bytes
+// inlined in their view point into the buffer set with SetBuffer, through
+// slices of it small enough for int32 offsets, which the array then keeps.
+// Values outside of it are copied into a buffer of the builder. The buffer
+// itself is only weakly held, so that streams can tell whether any array
+// still points into it.
+class ViewBuilder : public ArrayBuilder {
+   public:
+    ViewBuilder(std::shared_ptr<DataType> type, MemoryPool* pool)
+        : ArrayBuilder(pool), type_(std::move(type)), views_(pool), heap_(pool) {}
+
+    std::shared_ptr<DataType> type() const override { return type_; }
+
+    void SetBuffer(const std::shared_ptr<Buffer>& buffer) {
+        buffer_ = buffer;
+        begin_ = buffer ? (const char*)buffer->data() : nullptr;
+        end_ = buffer ? begin_ + buffer->size() : nullptr;
+        window_ = -1;
+    }
+
+    Status Resize(int64_t capacity) override {
+        ARROW_RETURN_NOT_OK(CheckCapacity(capacity));
+        ARROW_RETURN_NOT_OK(views_.Resize(capacity));
+        return ArrayBuilder::Resize(capacity);
+    }
+
+    void UnsafeAppend(const char* data, int32_t size) {
+        UnsafeAppendToBitmap(true);
+        views_.UnsafeAppend(View(data, size));
+    }
+
+    void UnsafeAppendNull() {
+        UnsafeAppendToBitmap(false);
+        views_.UnsafeAppend(BinaryViewType::c_type{});
+    }
+
+    Status AppendNulls(int64_t length) override {
+        ARROW_RETURN_NOT_OK(Reserve(length));
+        UnsafeAppendToBitmap(length, false);
+        views_.UnsafeAppend(length, BinaryViewType::c_type{});
+        return Status::OK();
+    }
+
+    Status AppendNull() override { return AppendNulls(1); }
+
+    Status AppendEmptyValues(int64_t length) override {
+        ARROW_RETURN_NOT_OK(Reserve(length));
+        UnsafeAppendToBitmap(length, true);
+        views_.UnsafeAppend(length, BinaryViewType::c_type{});
+        return Status::OK();
+    }
+
+    Status AppendEmptyValue() override { return AppendEmptyValues(1); }
+
+    // Values copied so far, the others belonging to the buffer set
+    int64_t heap_capacity() const { return heap_.capacity(); }
+
+    // Slices end at the last byte referenced, so that writers of the array
+    // only see the data of its own rows
+    Status FinishInternal(std::shared_ptr<ArrayData>* out) override {
+        FinishHeap();
+        for (size_t i = 0; i < buffers_.size(); i++) {
+            if (used_[i] < buffers_[i]->size())
+                buffers_[i] = SliceBuffer(buffers_[i], 0, used_[i]);
+        }
+
+        std::shared_ptr<Buffer> null_bitmap;
+        if (null_count_ > 0) {
+            ARROW_ASSIGN_OR_RAISE(
+                null_bitmap, null_bitmap_builder_.FinishWithLength(length_));
+        }
+        ARROW_ASSIGN_OR_RAISE(auto views, views_.Finish());
+        BufferVector buffers = {std::move(null_bitmap), std::move(views)};
+        buffers.insert(buffers.end(), buffers_.begin(), buffers_.end());
+        *out = ArrayData::Make(type_, length_, std::move(buffers), null_count_);
+        Reset();
+        return Status::OK();
+    }
+
+    // The buffer set with SetBuffer stays, as the next rows may come from it
+    void Reset() override {
+        ArrayBuilder::Reset();
+        views_.Reset();
+        heap_.Reset();
+        buffers_.clear();
+        used_.clear();
+        window_ = -1;
+        heap_index_ = -1;
+    }
+
+   private:
+    static const int64_t kMaxBufferSize = std::numeric_limits<int32_t>::max();
+
+    BinaryViewType::c_type View(const char* data, int32_t size) {
+        if (size <= BinaryViewType::kInlineSize)
+            return util::ToInlineBinaryView(data, size);
+
+        if (begin_ != nullptr && data >= begin_ && data + size <= end_) {
+            // A new slice starts at the value when it is out of the current one
+            if (window_ < 0 || data < window_begin_ ||
+                data + size - window_begin_ > kMaxBufferSize) {
+                window_ = buffers_.size();
+                window_begin_ = data;
+                auto length = std::min<int64_t>(end_ - data, kMaxBufferSize);
+                buffers_.push_back(SliceBuffer(buffer_.lock(), data - begin_, length));
+                used_.push_back(0);
+            }
+            int32_t offset = data - window_begin_;
+            used_[window_] = std::max<int64_t>(used_[window_], offset + size);
+            return util::ToNonInlineBinaryView(data, size, window_, offset);
+        }
+
+        if (heap_index_ < 0 || heap_.length() + size > kMaxBufferSize) {
+            FinishHeap();
+            heap_index_ = buffers_.size();
+            buffers_.push_back(nullptr);
+            used_.push_back(0);
+        }
+        int32_t offset = heap_.length();
+        auto status = heap_.Append(data, size);
+        return util::ToNonInlineBinaryView(data, size, heap_index_, offset);
+    }
+
+    void FinishHeap() {
+        if (heap_index_ < 0)
+            return;
+        used_[heap_index_] = heap_.length();
+        auto status = heap_.Finish(&buffers_[heap_index_]);
+        heap_index_ = -1;
+    }
+
+    std::shared_ptr<DataType> type_;
+    TypedBufferBuilder<BinaryViewType::c_type> views_;
+    // Data buffers of the array so far, and the bytes used in each of them
+    std::vector<std::shared_ptr<Buffer>> buffers_;
+    std::vector<int64_t> used_;
+    std::weak_ptr<Buffer> buffer_;
+    const char* begin_ = nullptr;
+    const char* end_ = nullptr;
+    // Slice of buffer_ the last value pointed into
+    int32_t window_ = -1;
+    const char* window_begin_ = nullptr;
+    // Copied values, going to buffers_[heap_index_]
+    BufferBuilder heap_;
+    int32_t heap_index_ = -1;
+};
+
+// The top level builder being reserved
+int32_t ViewDecoder(const DecodeNode& node, const char* cursor) {
+    auto builder = (ViewBuilder*)node.builder;
+    int32_t flen = unpack_int32(cursor);
+    cursor += 4;
+
+    if (flen == -1) {
+        builder->UnsafeAppendNull();
+        return 4;
     }
 
+    builder->UnsafeAppend(cursor, flen);
     return 4 + flen;
 }
+#endif
 
-int32_t NullDecoder(DecoderMap&, ArrayBuilder* builder, const char* cursor) {
+int32_t NullDecoder(const DecodeNode&, const char* cursor) {
     int32_t flen = unpack_int32(cursor);
     return flen > 0 ? 4 + flen : 4;
 }
@@ -170,31 +752,434 @@ std::map<Type::type, FieldDecoder> gDecoderMap = {
     {Type::type::TIME64, GenericDecoder<Time64Builder, Int64Mapper>},
     {Type::type::DURATION, GenericDecoder<DurationBuilder, IntervalMapper>},
     {Type::type::DICTIONARY, GenericDecoder<StringDictionaryBuilder, IdMapper>},
+    {Type::type::DECIMAL128, NumericDecoder<Decimal128Builder, Decimal128>},
+    {Type::type::DECIMAL256, NumericDecoder<Decimal256Builder, Decimal256>},
     {Type::type::LIST, ListDecoder},
+    {Type::type::FIXED_SIZE_LIST, ListDecoder},
     {Type::type::STRUCT, StructDecoder},
     {Type::type::NA, NullDecoder}};
 
-void InitDecoders(DecoderMap& decoders, ArrayBuilder* builder) {
-    auto type = builder->type()->id();
-    decoders[builder] = gDecoderMap[type];
+std::map<Type::type, FieldDecoder> gReservedDecoderMap = {
+    {Type::type::BOOL, ReservedDecoder<BooleanBuilder, BoolMapper>},
+    {Type::type::INT16, ReservedDecoder<Int16Builder, Int16Mapper>},
+    {Type::type::INT32, ReservedDecoder<Int32Builder, Int32Mapper>},
+    {Type::type::INT64, ReservedDecoder<Int64Builder, Int64Mapper>},
+    {Type::type::FLOAT, ReservedDecoder<FloatBuilder, FloatMapper>},
+    {Type::type::DOUBLE, ReservedDecoder<DoubleBuilder, DoubleMapper>},
+    {Type::type::FIXED_SIZE_BINARY, ReservedDecoder<FixedSizeBinaryBuilder, IdMapper>},
+    {Type::type::DATE32, ReservedDecoder<Date32Builder, DateMapper>},
+    {Type::type::TIMESTAMP, ReservedDecoder<TimestampBuilder, TimestampMapper>},
+    {Type::type::TIME64, ReservedDecoder<Time64Builder, Int64Mapper>},
+    {Type::type::DURATION, ReservedDecoder<DurationBuilder, IntervalMapper>}};
 
+std::map<Type::type, std::pair<ArrayDecoder, int32_t>> gArrayDecoderMap = {
+    {Type::type::INT16, {FixedArrayDecoder<Int16Builder, 2>, 2}},
+    {Type::type::INT32, {FixedArrayDecoder<Int32Builder, 4>, 4}},
+    {Type::type::INT64, {FixedArrayDecoder<Int64Builder, 8>, 8}},
+    {Type::type::FLOAT, {FixedArrayDecoder<FloatBuilder, 4>, 4}},
+    {Type::type::DOUBLE, {FixedArrayDecoder<DoubleBuilder, 8>, 8}},
+    {Type::type::DATE32,
+     {FixedArrayDecoder<Date32Builder, 4, DateMapper::kEpoch>, 4}},
+    {Type::type::TIMESTAMP,
+     {FixedArrayDecoder<TimestampBuilder, 8, TimestampMapper::kEpoch>, 8}},
+    {Type::type::TIME64, {FixedArrayDecoder<Time64Builder, 8>, 8}}};
+
+static std::unique_ptr<DecoderState> MakeDecoderState(const DataType& type) {
+    if (type.id() == Type::type::DECIMAL128 || type.id() == Type::type::DECIMAL256) {
+        auto& decimal = (const DecimalType&)type;
+        auto state = std::make_unique<NumericState>();
+        state->scale = decimal.scale();
+        state->max_digits = decimal.precision() - decimal.scale();
+        return state;
+    }
+
+    // Nested lists are the dimensions of a single array
+    if (type.id() == Type::type::LIST || type.id() == Type::type::FIXED_SIZE_LIST) {
+        auto state = std::make_unique<ListState>();
+        auto element = &type;
+        while (element->id() == Type::type::LIST ||
+               element->id() == Type::type::FIXED_SIZE_LIST) {
+            state->sizes.push_back(
+                element->id() == Type::type::LIST
+                    ? -1
+                    : ((const FixedSizeListType*)element)->list_size());
+            element = ((const BaseListType*)element)->value_type().get();
+        }
+        auto it = gArrayDecoderMap.find(element->id());
+        if (it != gArrayDecoderMap.end())
+            std::tie(state->bulk_decoder, state->element_size) = it->second;
+        return state;
+    }
+    return nullptr;
+}
+
+static std::vector<ArrayBuilder*> GetChildBuilders(ArrayBuilder* builder) {
+    std::vector<ArrayBuilder*> children;
+    auto type = builder->type()->id();
     if (type == Type::type::LIST) {
-        InitDecoders(decoders, ((ListBuilder*)builder)->value_builder());
+        children.push_back(((ListBuilder*)builder)->value_builder());
+    } else if (type == Type::type::FIXED_SIZE_LIST) {
+        children.push_back(((FixedSizeListBuilder*)builder)->value_builder());
     } else if (type == Type::type::STRUCT) {
         auto sbuilder = (StructBuilder*)builder;
-        for (size_t i = 0; i < sbuilder->num_fields(); i++) {
-            InitDecoders(decoders, sbuilder->field_builder(i));
+        for (size_t i = 0; i < sbuilder->num_fields(); i++)
+            children.push_back(sbuilder->field_builder(i));
+    }
+    return children;
+}
+
+std::map<Type::type, ColumnDecoder> gColumnDecoderMap = {
+    {Type::type::BOOL, FixedColumnDecoder<BooleanBuilder, 1>},
+    {Type::type::INT16, FixedColumnDecoder<Int16Builder, 2>},
+    {Type::type::INT32, FixedColumnDecoder<Int32Builder, 4>},
+    {Type::type::INT64, FixedColumnDecoder<Int64Builder, 8>},
+    {Type::type::FLOAT, FixedColumnDecoder<FloatBuilder, 4>},
+    {Type::type::DOUBLE, FixedColumnDecoder<DoubleBuilder, 8>},
+    {Type::type::DATE32, FixedColumnDecoder<Date32Builder, 4, DateMapper::kEpoch>},
+    {Type::type::TIMESTAMP,
+     FixedColumnDecoder<TimestampBuilder, 8, TimestampMapper::kEpoch>},
+    {Type::type::TIME64, FixedColumnDecoder<Time64Builder, 8>}};
+
+// Size in the COPY stream of the values of fixed width types, 0 otherwise
+static int32_t GetFixedSize(const DataType& type) {
+    switch (type.id()) {
+        case Type::type::BOOL:
+            return 1;
+        case Type::type::INT16:
+            return 2;
+        case Type::type::INT32:
+        case Type::type::FLOAT:
+        case Type::type::DATE32:
+            return 4;
+        case Type::type::INT64:
+        case Type::type::DOUBLE:
+        case Type::type::TIMESTAMP:
+        case Type::type::TIME64:
+            return 8;
+        case Type::type::DURATION:
+            return 16;
+        case Type::type::FIXED_SIZE_BINARY:
+            return ((const FixedSizeBinaryType&)type).byte_width();
+        default:
+            return 0;
+    }
+}
+
+// Lays out the builder tree breadth first in a single array: top level fields
+// come first and the children of every node are stored next to each other.
+// Nodes receiving exactly one value per row (top level fields and fields of
+// such structs) are listed in reserved_nodes_ as their capacity can be reserved
+// ahead of time.
+void PgBuilder::CompilePlan() {
+    std::vector<int32_t> first_child;
+    std::vector<bool> one_per_row;
+    // Fields of the schema, which differ from the builder types for enums
+    arrow::FieldVector fields;
+    for (size_t i = 0; i < builders_.size(); i++) {
+        plan_.push_back({nullptr, builders_[i].get(), nullptr, 0, nullptr});
+        one_per_row.push_back(true);
+        fields.push_back(schema_->field(i));
+    }
+
+    for (size_t i = 0; i < plan_.size(); i++) {
+        auto& node = plan_[i];
+        auto type = node.builder->type()->id();
+        if (one_per_row[i]) {
+            reserved_nodes_.push_back(i);
+            auto it = gReservedDecoderMap.find(type);
+            node.decoder = it != gReservedDecoderMap.end() ? it->second
+                                                           : gDecoderMap[type];
+        } else {
+            node.decoder = gDecoderMap[type];
+        }
+
+        auto field = fields[i];
+        std::unique_ptr<DecoderState> state = MakeEnumState(*field, pool_);
+        if (state)
+            node.decoder = GetEnumDecoder(*node.builder->type(), one_per_row[i]);
+        else
+            state = MakeDecoderState(*field->type());
+        if (state) {
+            node.state = state.get();
+            states_.push_back(std::move(state));
+        }
+
+        auto children = GetChildBuilders(node.builder);
+        node.num_children = children.size();
+        first_child.push_back(plan_.size());
+        for (size_t k = 0; k < children.size(); k++) {
+            plan_.push_back({nullptr, children[k], nullptr, 0, nullptr});
+            one_per_row.push_back(one_per_row[i] && type == Type::type::STRUCT);
+            fields.push_back(field->type()->field(k));
+        }
+    }
+
+    // The plan does not move anymore, pointers to children can be resolved
+    for (size_t i = 0; i < plan_.size(); i++)
+        plan_[i].children = plan_.data() + first_child[i];
+}
+
+// PostgreSQL array types do not carry their dimensions: the one dimensional
+// lists of the columns given a shape become nested lists, fixed size or not
+static std::shared_ptr<arrow::Schema> ApplyArrayShapes(
+    const std::shared_ptr<arrow::Schema>& schema,
+    const UserOptions& options) {
+    if (options.array_shapes.empty())
+        return schema;
+
+    auto fields = schema->fields();
+    for (auto& field : fields) {
+        auto it = options.array_shapes.find(field->name());
+        if (it == options.array_shapes.end() || it->second.empty() ||
+            field->type()->id() != Type::type::LIST)
+            continue;
+        auto element = ((const ListType&)*field->type()).value_field();
+        if (element->type()->id() == Type::type::LIST)
+            continue;
+
+        std::shared_ptr<DataType> type;
+        auto& sizes = it->second;
+        for (auto size = sizes.rbegin(); size != sizes.rend(); ++size) {
+            type = *size > 0 ? fixed_size_list(element, *size) : list(element);
+            element = arrow::field("item", type);
+        }
+        field = field->WithType(type);
+    }
+    return arrow::schema(fields, schema->metadata());
+}
+
+// Enums are built as the indices of their labels, nested ones included
+static std::shared_ptr<DataType> GetBuilderType(const Field& field) {
+    auto& type = field.type();
+    if (type->id() == Type::type::DICTIONARY) {
+        bool is_enum =
+            field.HasMetadata() && field.metadata()->Contains(kEnumLabelsKey);
+        return is_enum ? ((const DictionaryType&)*type).index_type() : type;
+    }
+
+    FieldVector children;
+    for (auto& child : type->fields())
+        children.push_back(child->WithType(GetBuilderType(*child)));
+    switch (type->id()) {
+        case Type::type::LIST:
+            return list(children[0]);
+        case Type::type::FIXED_SIZE_LIST:
+            return fixed_size_list(
+                children[0], ((const FixedSizeListType&)*type).list_size());
+        case Type::type::STRUCT:
+            return struct_(children);
+        default:
+            return type;
+    }
+}
+
+// Gives the arrays of enum indices their type and dictionary back
+static std::shared_ptr<ArrayData> RestoreEnums(
+    const DecodeNode& node,
+    const std::shared_ptr<DataType>& type,
+    const std::shared_ptr<ArrayData>& data) {
+    if (data->type->Equals(*type))
+        return data;
+
+    auto restored = data->Copy();
+    restored->type = type;
+    if (type->id() == Type::type::DICTIONARY) {
+        restored->dictionary = ((EnumState*)node.state)->dictionary;
+        return restored;
+    }
+    for (int32_t k = 0; k < node.num_children; k++)
+        restored->child_data[k] =
+            RestoreEnums(node.children[k], type->field(k)->type(), data->child_data[k]);
+    return restored;
+}
+
+PgBuilder::PgBuilder(
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options) {
+    pool_ = options.memory_pool ? options.memory_pool : default_memory_pool();
+    schema = ApplyArrayShapes(schema, options);
+    schema_ = schema;
+    for (auto& field : schema->fields()) {
+        std::unique_ptr<ArrayBuilder> builder;
+        auto type = GetBuilderType(*field);
+        auto status = MakeBuilder(pool_, type, &builder);
+        builders_.push_back(std::move(builder));
+        if (!type->Equals(*field->type()))
+            enum_columns_.push_back(builders_.size() - 1);
+    }
+    CompilePlan();
+    value_sizes_.resize(plan_.size(), 0);
+
+    // Reserve room for a whole batch at once when we know how big it will be
+    reserve_rows_ = options.batch_rows > 0 ? options.batch_rows : kDefaultReserveRows;
+    if (options.expected_rows > 0)
+        reserve_rows_ = std::min(reserve_rows_, options.expected_rows);
+    if (options.batch_bytes > 0 && options.expected_width > 0)
+        reserve_rows_ =
+            std::min(reserve_rows_, options.batch_bytes / options.expected_width + 1);
+    // A batch may be flushed well before its row limit under a memory limit,
+    // builders then grow as needed
+    if (options.memory_limit > 0)
+        reserve_rows_ = std::min(reserve_rows_, kDefaultReserveRows);
+
+    // When every field has a fixed width, rows without nulls all share the
+    // same layout and need no offset scan
+    int32_t row_size = 2;
+    for (size_t i = 0; i < builders_.size(); i++) {
+        auto type = schema_->field(i)->type();
+        auto it = gColumnDecoderMap.find(type->id());
+        column_decoders_.push_back(
+            it != gColumnDecoderMap.end() ? it->second : RowColumnDecoder);
+
+        auto size = GetFixedSize(*type);
+        fixed_offsets_.push_back(row_size);
+        fixed_sizes_.push_back(size);
+        row_size = (row_size > 0 && size > 0) ? row_size + 4 + size : 0;
+    }
+    fixed_row_size_ = row_size;
+
+    SetupDictionaries(options);
+    SetupViews(options);
+
+    column_stats_ = options.column_stats;
+    if (column_stats_) {
+        column_bytes_.resize(builders_.size(), 0);
+        column_memory_.resize(builders_.size(), 0);
+    }
+}
+
+// Dictionary columns get an index builder in place of their string builder, and
+// the dictionary itself is only materialized when flushing
+void PgBuilder::SetupDictionaries(const UserOptions& options) {
+    auto& columns = options.dictionary_columns;
+    for (size_t i = 0; i < builders_.size(); i++) {
+        auto& field = schema_->field(i);
+        bool forced =
+            std::find(columns.begin(), columns.end(), field->name()) != columns.end();
+        if (field->type()->id() != Type::type::STRING ||
+            !(forced || options.auto_dictionary))
+            continue;
+
+        auto state = std::make_unique<DictionaryState>();
+        state->adaptive = !forced;
+        state->max_size = options.dictionary_max_size;
+        state->max_bytes = options.dictionary_max_bytes;
+        adaptive_dictionaries_ |= state->adaptive;
+
+        builders_[i] = std::make_unique<Int32Builder>(pool_);
+        plan_[i] = {DictionaryDecoder, builders_[i].get(), nullptr, 0, state.get()};
+        states_.push_back(std::move(state));
+        column_decoders_[i] = RowColumnDecoder;
+        dictionary_nodes_.push_back(i);
+        schema_ = schema_->SetField(i, field->WithType(dictionary(int32(), utf8())))
+                      .ValueOrDie();
+    }
+}
+
+// View columns get a ViewBuilder in place of their string or binary builder.
+// Their plan nodes stay reserved.
+void PgBuilder::SetupViews(const UserOptions& options) {
+#if ARROW_VERSION_MAJOR >= 15
+    string_views_ = options.string_views;
+    for (size_t i = 0; i < builders_.size() && string_views_; i++) {
+        auto type = schema_->field(i)->type()->id();
+        if (type != Type::type::STRING && type != Type::type::BINARY)
+            continue;
+
+        auto view_type = type == Type::type::STRING ? utf8_view() : binary_view();
+        builders_[i] = std::make_unique<ViewBuilder>(view_type, pool_);
+        plan_[i] = {ViewDecoder, builders_[i].get(), nullptr, 0, nullptr};
+        view_nodes_.push_back(i);
+        schema_ = schema_->SetField(i, schema_->field(i)->WithType(view_type))
+                      .ValueOrDie();
+    }
+#endif
+}
+
+// Only kept with views, and weakly so, streams reusing their buffer as long as
+// no array points into it
+void PgBuilder::SetBuffer(const std::shared_ptr<arrow::Buffer>& buffer) {
+    if (!string_views_)
+        return;
+    buffer_ = buffer;
+#if ARROW_VERSION_MAJOR >= 15
+    for (auto i : view_nodes_)
+        ((ViewBuilder*)plan_[i].builder)->SetBuffer(buffer);
+#endif
+}
+
+// Replays the indices appended so far as strings into a new builder, which
+// takes over the column
+void PgBuilder::CheckDictionaries() {
+    for (auto it = dictionary_nodes_.begin(); it != dictionary_nodes_.end();) {
+        auto i = *it;
+        auto state = (DictionaryState*)plan_[i].state;
+        if (!state->adaptive || !state->IsFull()) {
+            ++it;
+            continue;
+        }
+
+        std::shared_ptr<Array> array;
+        auto status = builders_[i]->Finish(&array);
+        auto indices = std::static_pointer_cast<Int32Array>(array);
+        auto& offsets = state->memo.offsets();
+        auto data = state->memo.data().data();
+
+        std::shared_ptr<DataType> type = utf8();
+        builders_[i] = std::make_unique<StringBuilder>(pool_);
+        plan_[i] = {
+            gDecoderMap[Type::type::STRING], builders_[i].get(), nullptr, 0, nullptr};
+#if ARROW_VERSION_MAJOR >= 15
+        if (string_views_) {
+            type = utf8_view();
+            auto builder = std::make_unique<ViewBuilder>(type, pool_);
+            builder->SetBuffer(buffer_.lock());
+            builders_[i] = std::move(builder);
+            plan_[i] = {ViewDecoder, builders_[i].get(), nullptr, 0, nullptr};
+            view_nodes_.push_back(i);
         }
+#endif
+
+        // Values are fed back to the decoder as COPY fields
+        auto& node = plan_[i];
+        status = node.builder->Reserve(capacity_);
+        std::string field;
+        for (int64_t j = 0; j < indices->length(); j++) {
+            field.assign(4, 0);
+            if (indices->IsNull(j)) {
+                pack_int32(&field[0], -1);
+            } else {
+                auto index = indices->Value(j);
+                int32_t size = offsets[index + 1] - offsets[index];
+                pack_int32(&field[0], size);
+                field.append(data + offsets[index], size);
+            }
+            node.decoder(node, field.data());
+        }
+
+        state->memo.Reset();
+        schema_ = schema_->SetField(i, schema_->field(i)->WithType(type)).ValueOrDie();
+        it = dictionary_nodes_.erase(it);
     }
 }
 
-PgBuilder::PgBuilder(std::shared_ptr<arrow::Schema> schema) {
-    auto status = RecordBatchBuilder::Make(schema, default_memory_pool(), &builder_);
-    for (size_t i = 0; i < builder_->num_fields(); i++) {
-        auto builder = builder_->GetField(i);
-        InitDecoders(decoders_, builder);
-        field_builders_.push_back({decoders_[builder], builder});
+void PgBuilder::Reserve(int64_t num_rows) {
+    for (auto i : reserved_nodes_) {
+        auto builder = plan_[i].builder;
+        auto status = builder->Reserve(num_rows);
+
+        // Variable width data gets sized after the values seen so far
+        auto type = builder->type()->id();
+        if (type == Type::type::STRING || type == Type::type::BINARY) {
+            auto bbuilder = (BinaryBuilder*)builder;
+            if (bbuilder->length() > 0)
+                value_sizes_[i] = bbuilder->value_data_length() / bbuilder->length();
+            status = bbuilder->ReserveData(value_sizes_[i] * num_rows);
+        }
     }
+    // Builders make room for that many rows past their length, not past their
+    // current capacity
+    capacity_ = num_rows_ + num_rows;
 }
 
 int32_t PgBuilder::Append(const char* cursor) {
@@ -205,15 +1190,191 @@ int32_t PgBuilder::Append(const char* cursor) {
     if (nfields == -1)
         return 2;
 
+    if (num_rows_ == capacity_)
+        Reserve(reserve_rows_);
+
     for (size_t i = 0; i < nfields; i++) {
-        auto [decoder, builder] = field_builders_[i];
-        cur += decoder(decoders_, builder, cur);
+        auto& node = plan_[i];
+        int32_t size = node.decoder(node, cur);
+        cur += size;
+        if (column_stats_)
+            column_bytes_[i] += size;
     }
+    if (adaptive_dictionaries_)
+        CheckDictionaries();
+
+    num_rows_ += 1;
+    num_bytes_ += cur - cursor;
     return cur - cursor;
 }
 
+int64_t PgBuilder::AppendRows(const char* const* rows, int64_t num_rows) {
+    // Drop the file trailer
+    while (num_rows > 0 && unpack_int16(rows[num_rows - 1]) == -1)
+        num_rows--;
+    if (num_rows == 0)
+        return 0;
+
+    if (num_rows_ + num_rows > capacity_)
+        Reserve(std::max(reserve_rows_, num_rows));
+
+    size_t num_fields = column_decoders_.size();
+    if (values_.size() < num_rows) {
+        values_.resize(num_rows);
+        valid_.resize(num_rows);
+    }
+
+    bool fixed_layout = fixed_row_size_ > 0;
+    for (int64_t i = 0; i < num_rows && fixed_layout; i++) {
+        const char* row = rows[i];
+        fixed_layout = unpack_int16(row) == num_fields;
+        for (size_t j = 0; j < num_fields; j++)
+            fixed_layout &= unpack_int32(row + fixed_offsets_[j]) == fixed_sizes_[j];
+    }
+
+    // Pass one: offsets of every field of every row, stored column major
+    if (!fixed_layout) {
+        offsets_.resize(num_rows * num_fields);
+        for (int64_t i = 0; i < num_rows; i++) {
+            const char* row = rows[i];
+            int32_t pos = 2;
+            for (size_t j = 0; j < num_fields; j++) {
+                offsets_[j * num_rows + i] = pos;
+                int32_t flen = unpack_int32(row + pos);
+                int32_t size = flen > 0 ? 4 + flen : 4;
+                pos += size;
+                if (column_stats_)
+                    column_bytes_[j] += size;
+            }
+            num_bytes_ += pos;
+        }
+    } else {
+        num_bytes_ += num_rows * fixed_row_size_;
+        for (size_t j = 0; j < num_fields && column_stats_; j++)
+            column_bytes_[j] += num_rows * (4 + fixed_sizes_[j]);
+    }
+
+    // Pass two: one tight loop per column
+    for (size_t j = 0; j < num_fields; j++) {
+        auto offsets = fixed_layout ? &fixed_offsets_[j] : &offsets_[j * num_rows];
+        column_decoders_[j](
+            plan_[j], rows, offsets, fixed_layout ? 0 : 1, num_rows, values_.data(),
+            valid_.data());
+    }
+    if (adaptive_dictionaries_)
+        CheckDictionaries();
+
+    num_rows_ += num_rows;
+    return num_rows;
+}
+
+arrow::Result<std::shared_ptr<arrow::Array>> PgBuilder::FinishColumn(int32_t i) {
+    std::shared_ptr<Array> array;
+    ARROW_RETURN_NOT_OK(builders_[i]->Finish(&array));
+    auto& enums = enum_columns_;
+    if (std::find(enums.begin(), enums.end(), i) != enums.end()) {
+        auto type = schema_->field(i)->type();
+        return MakeArray(RestoreEnums(plan_[i], type, array->data()));
+    }
+    if (plan_[i].decoder != DictionaryDecoder)
+        return array;
+
+    // The memo table keeps growing across batches so that indices stay stable,
+    // each batch carrying the whole dictionary
+    auto state = (DictionaryState*)plan_[i].state;
+    auto& offsets = state->memo.offsets();
+    auto& data = state->memo.data();
+    ARROW_ASSIGN_OR_RAISE(
+        auto offsets_buffer,
+        AllocateBuffer(offsets.size() * sizeof(int32_t), pool_));
+    ARROW_ASSIGN_OR_RAISE(auto data_buffer, AllocateBuffer(data.size(), pool_));
+    memcpy(offsets_buffer->mutable_data(), offsets.data(), offsets_buffer->size());
+    memcpy(data_buffer->mutable_data(), data.data(), data.size());
+    auto values = std::make_shared<StringArray>(
+        state->memo.size(), std::move(offsets_buffer), std::move(data_buffer));
+
+    // The column type is fixed now, an oversized dictionary starts over
+    state->adaptive = false;
+    if (state->IsFull())
+        state->memo.Reset();
+
+    return std::make_shared<DictionaryArray>(schema_->field(i)->type(), array, values);
+}
+
+// Bytes reserved by `builder` and its children
+static int64_t BuilderSize(const ArrayBuilder& builder) {
+    auto capacity = builder.capacity();
+    int64_t size = bit_util::BytesForBits(capacity);
+    auto& type = *builder.type();
+    switch (type.id()) {
+        case Type::type::STRING:
+        case Type::type::BINARY:
+            size += (capacity + 1) * sizeof(int32_t) +
+                    ((const BinaryBuilder&)builder).value_data_capacity();
+            break;
+        case Type::type::LIST:
+        case Type::type::MAP:
+            size += (capacity + 1) * sizeof(int32_t);
+            break;
+#if ARROW_VERSION_MAJOR >= 15
+        case Type::type::STRING_VIEW:
+        case Type::type::BINARY_VIEW:
+            size += capacity * sizeof(BinaryViewType::c_type) +
+                    ((const ViewBuilder&)builder).heap_capacity();
+            break;
+#endif
+        default:
+            if (is_fixed_width(type.id()))
+                size += capacity * ((const FixedWidthType&)type).bit_width() / 8;
+            break;
+    }
+    for (int i = 0; i < builder.num_children(); i++)
+        size += BuilderSize(*builder.child_builder(i));
+    return size;
+}
+
+int64_t PgBuilder::memory_size() const {
+    int64_t size = 0;
+    for (auto& builder : builders_)
+        size += BuilderSize(*builder);
+    for (auto i : dictionary_nodes_) {
+        auto& memo = ((DictionaryState*)plan_[i].state)->memo;
+        size += memo.value_bytes() + memo.size() * sizeof(int32_t);
+    }
+    return size;
+}
+
 arrow::Status PgBuilder::Flush(std::shared_ptr<arrow::RecordBatch>* batch) {
-    return builder_->Flush(batch);
+    if (adaptive_dictionaries_)
+        CheckDictionaries();
+    adaptive_dictionaries_ = false;
+
+    std::vector<std::shared_ptr<Array>> arrays;
+    for (size_t i = 0; i < builders_.size(); i++) {
+        ARROW_ASSIGN_OR_RAISE(auto array, FinishColumn(i));
+        if (column_stats_)
+            column_memory_[i] =
+                std::max(column_memory_[i], util::TotalBufferSize(*array));
+        arrays.push_back(std::move(array));
+    }
+    *batch = RecordBatch::Make(schema_, num_rows_, std::move(arrays));
+    num_rows_ = 0;
+    capacity_ = 0;
+    num_bytes_ = 0;
+
+    // Rather than writing them as nulls
+    for (auto& node : plan_) {
+        auto state = dynamic_cast<NumericState*>(node.state);
+        if (state == nullptr || state->overflows == 0)
+            continue;
+        auto overflows = state->overflows;
+        state->overflows = 0;
+        batch->reset();
+        return Status::Invalid(
+            overflows, " numeric values with more than ", state->max_digits,
+            " integer digits do not fit ", node.builder->type()->ToString());
+    }
+    return arrow::Status::OK();
 }
 
 }  // namespace Pg2Arrow
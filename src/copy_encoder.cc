@@ -0,0 +1,674 @@
+#include "pg2arrow.h"
+
+#include "./hton.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace Pg2Arrow {
+
+static const char kBinaryHeader[] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+static const int kBinaryHeaderSize = 19;
+
+// CopyData messages sent at once, large enough for their overhead not to
+// matter and small enough not to grow the libpq output buffer much
+static const int64_t kCopyDataSize = 4 << 20;
+
+static const int32_t kEpochDays = 10957;  // 2000-01-01 - 1970-01-01 (days)
+static const int64_t kEpochMicros = kEpochDays * 86400000000LL;
+
+// Encodes the values of a column, or the elements of an array, in their
+// binary COPY representation
+class ValueEncoder {
+   public:
+    virtual ~ValueEncoder() = default;
+
+    // Size of the valid value `i`
+    virtual int32_t Size(const arrow::Array& array, int64_t i) const = 0;
+    // Writes the valid value `i`, Size bytes
+    virtual void Write(const arrow::Array& array, int64_t i, char* out) const = 0;
+
+    // Adds the field size of every row of `array`, length included, to `sizes`
+    virtual void AddSizes(const arrow::Array& array, int64_t* sizes) const {
+        for (int64_t i = 0; i < array.length(); i++)
+            sizes[i] += 4 + (array.IsValid(i) ? Size(array, i) : 0);
+    }
+
+    // Writes the field of every row of `array` at `cursors`, moving them past it
+    virtual void WriteColumn(const arrow::Array& array, char** cursors) const {
+        for (int64_t i = 0; i < array.length(); i++) {
+            char*& out = cursors[i];
+            if (array.IsNull(i)) {
+                pack_int32(out, -1);
+                out += 4;
+                continue;
+            }
+            int32_t size = Size(array, i);
+            pack_int32(out, size);
+            Write(array, i, out + 4);
+            out += 4 + size;
+        }
+    }
+};
+
+// Integers of kWidth bytes computed as value * mul / div - offset, the division
+// rounding down, as timestamps of a finer unit need. Intervals only have their
+// microseconds set.
+template <typename ArrayType, int kWidth>
+class IntegerEncoder : public ValueEncoder {
+   public:
+    IntegerEncoder(int64_t mul = 1, int64_t div = 1, int64_t offset = 0)
+        : mul_(mul), div_(div), offset_(offset) {}
+
+    int32_t Size(const arrow::Array&, int64_t) const override { return kWidth; }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        int64_t value = ((const ArrayType&)array).Value(i);
+        if (div_ > 1)
+            value = value >= 0 ? value / div_ : -((-value + div_ - 1) / div_);
+        value = value * mul_ - offset_;
+
+        if constexpr (kWidth == 2)
+            pack_int16(out, value);
+        else if constexpr (kWidth == 4)
+            pack_int32(out, value);
+        else
+            pack_int64(out, value);
+        if constexpr (kWidth == 16)
+            memset(out + 8, 0, 8);
+    }
+
+    void AddSizes(const arrow::Array& array, int64_t* sizes) const override {
+        if (array.null_count() == 0) {
+            for (int64_t i = 0; i < array.length(); i++)
+                sizes[i] += 4 + kWidth;
+            return;
+        }
+        ValueEncoder::AddSizes(array, sizes);
+    }
+
+    void WriteColumn(const arrow::Array& array, char** cursors) const override {
+        for (int64_t i = 0; i < array.length(); i++) {
+            char*& out = cursors[i];
+            if (array.IsNull(i)) {
+                pack_int32(out, -1);
+                out += 4;
+                continue;
+            }
+            pack_int32(out, kWidth);
+            Write(array, i, out + 4);
+            out += 4 + kWidth;
+        }
+    }
+
+   private:
+    int64_t mul_;
+    int64_t div_;
+    int64_t offset_;
+};
+
+template <typename ArrayType, typename T>
+class FloatEncoder : public ValueEncoder {
+   public:
+    int32_t Size(const arrow::Array&, int64_t) const override { return sizeof(T); }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        T value = ((const ArrayType&)array).Value(i);
+        if constexpr (sizeof(T) == 4)
+            pack_float(out, value);
+        else
+            pack_double(out, value);
+    }
+};
+
+class BoolEncoder : public ValueEncoder {
+   public:
+    int32_t Size(const arrow::Array&, int64_t) const override { return 1; }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        *out = ((const arrow::BooleanArray&)array).Value(i) ? 1 : 0;
+    }
+};
+
+// Strings and binaries go as they are, text being sent in the client encoding
+template <typename ArrayType>
+class BinaryEncoder : public ValueEncoder {
+   public:
+    int32_t Size(const arrow::Array& array, int64_t i) const override {
+        return ((const ArrayType&)array).GetView(i).size();
+    }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        auto value = ((const ArrayType&)array).GetView(i);
+        memcpy(out, value.data(), value.size());
+    }
+};
+
+// Dictionary encoded strings, also the labels of enums
+template <typename DictionaryType>
+class DictionaryEncoder : public ValueEncoder {
+   public:
+    int32_t Size(const arrow::Array& array, int64_t i) const override {
+        return GetView(array, i).size();
+    }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        auto value = GetView(array, i);
+        memcpy(out, value.data(), value.size());
+    }
+
+   private:
+    static std::string_view GetView(const arrow::Array& array, int64_t i) {
+        auto& dictionary_array = (const arrow::DictionaryArray&)array;
+        auto& dictionary = (const DictionaryType&)*dictionary_array.dictionary();
+        return dictionary.GetView(dictionary_array.GetValueIndex(i));
+    }
+};
+
+// numeric is sent as base 10000 digits: int16 number of digits, weight of the
+// first one, sign and display scale, then the digits
+template <typename ArrayType, typename Decimal>
+class NumericEncoder : public ValueEncoder {
+   public:
+    explicit NumericEncoder(int32_t scale) : scale_(scale) {}
+
+    int32_t Size(const arrow::Array& array, int64_t i) const override {
+        int16_t digits[kMaxDigits];
+        int16_t weight;
+        bool negative;
+        return 8 + 2 * GetDigits(array, i, digits, &weight, &negative);
+    }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        int16_t digits[kMaxDigits];
+        int16_t weight;
+        bool negative;
+        int32_t num_digits = GetDigits(array, i, digits, &weight, &negative);
+        pack_int16(out, num_digits);
+        pack_int16(out + 2, weight);
+        pack_int16(out + 4, negative ? 0x4000 : 0);
+        pack_int16(out + 6, std::max(scale_, 0));
+        for (int32_t k = 0; k < num_digits; k++)
+            pack_int16(out + 8 + 2 * k, digits[k]);
+    }
+
+   private:
+    // 32 bit limbs of the magnitude, one more than its words hold for the
+    // decimal digits that align the scale on a group
+    static constexpr int kMaxLimbs = 2 * Decimal::kBitWidth / 64 + 1;
+    // A group of 4 decimal digits takes more than 13 bits
+    static constexpr int kMaxDigits = (kMaxLimbs * 32 + 12) / 13;
+
+    // Fills `digits` with the base 10000 digits of value `i`, the most
+    // significant first, without leading or trailing zeros, and returns their
+    // number. The magnitude is divided by 10000 limb by limb rather than
+    // converted to a string.
+    int32_t GetDigits(
+        const arrow::Array& array,
+        int64_t i,
+        int16_t* digits,
+        int16_t* weight,
+        bool* negative) const {
+        static const uint32_t kPowersOfTen[] = {1, 10, 100, 1000};
+
+        Decimal value(((const ArrayType&)array).GetValue(i));
+        *negative = value.IsNegative();
+        if (*negative)
+            value.Negate();
+
+        // Scaled by 10^pad so that the decimal point falls between groups
+        int32_t pad = ((-scale_) % 4 + 4) % 4;
+        uint32_t limbs[kMaxLimbs];
+        int n = 0;
+        uint64_t carry = 0;
+        for (uint64_t word : value.little_endian_array()) {
+            for (uint32_t half : {(uint32_t)word, (uint32_t)(word >> 32)}) {
+                carry += (uint64_t)half * kPowersOfTen[pad];
+                limbs[n++] = (uint32_t)carry;
+                carry >>= 32;
+            }
+        }
+        limbs[n++] = (uint32_t)carry;
+
+        // Least significant group first, skipping the trailing zeros
+        int16_t groups[kMaxDigits];
+        int32_t num_groups = 0;
+        int32_t trailing = 0;
+        while (true) {
+            while (n > 0 && limbs[n - 1] == 0)
+                n--;
+            if (n == 0)
+                break;
+            uint64_t rem = 0;
+            for (int k = n - 1; k >= 0; k--) {
+                uint64_t x = rem << 32 | limbs[k];
+                limbs[k] = (uint32_t)(x / 10000);
+                rem = x % 10000;
+            }
+            if (rem == 0 && num_groups == 0)
+                trailing++;
+            else
+                groups[num_groups++] = (int16_t)rem;
+        }
+        if (num_groups == 0) {
+            *weight = 0;
+            *negative = false;
+            return 0;
+        }
+        *weight = num_groups + trailing - 1 - (scale_ + pad) / 4;
+        for (int32_t k = 0; k < num_groups; k++)
+            digits[k] = groups[num_groups - 1 - k];
+        return num_groups;
+    }
+
+    int32_t scale_;
+};
+
+// One dimensional arrays: int32 number of dimensions, whether some elements are
+// null, element type, then the size and lower bound of the dimension, followed
+// by the elements. Empty lists are arrays without dimensions.
+template <typename ArrayType>
+class ListEncoder : public ValueEncoder {
+   public:
+    ListEncoder(std::unique_ptr<ValueEncoder> element, Oid element_type)
+        : element_(std::move(element)), element_type_(element_type) {}
+
+    int32_t Size(const arrow::Array& array, int64_t i) const override {
+        auto& list = (const ArrayType&)array;
+        auto& values = *list.values();
+        int64_t begin = list.value_offset(i);
+        int64_t end = begin + list.value_length(i);
+        int32_t size = begin == end ? 12 : 20;
+        for (int64_t k = begin; k < end; k++)
+            size += 4 + (values.IsValid(k) ? element_->Size(values, k) : 0);
+        return size;
+    }
+
+    void Write(const arrow::Array& array, int64_t i, char* out) const override {
+        auto& list = (const ArrayType&)array;
+        auto& values = *list.values();
+        int64_t begin = list.value_offset(i);
+        int64_t end = begin + list.value_length(i);
+
+        bool has_nulls = false;
+        for (int64_t k = begin; k < end && !has_nulls; k++)
+            has_nulls = values.IsNull(k);
+        pack_int32(out, begin == end ? 0 : 1);
+        pack_int32(out + 4, has_nulls);
+        pack_int32(out + 8, element_type_);
+        out += 12;
+        if (begin == end)
+            return;
+        pack_int32(out, end - begin);
+        pack_int32(out + 4, 1);
+        out += 8;
+
+        for (int64_t k = begin; k < end; k++) {
+            if (values.IsNull(k)) {
+                pack_int32(out, -1);
+                out += 4;
+                continue;
+            }
+            int32_t size = element_->Size(values, k);
+            pack_int32(out, size);
+            element_->Write(values, k, out + 4);
+            out += 4 + size;
+        }
+    }
+
+   private:
+    std::unique_ptr<ValueEncoder> element_;
+    Oid element_type_;
+};
+
+// Microseconds per unit
+static int64_t GetMicros(arrow::TimeUnit::type unit, int64_t* div) {
+    *div = unit == arrow::TimeUnit::NANO ? 1000 : 1;
+    switch (unit) {
+        case arrow::TimeUnit::SECOND:
+            return 1000000;
+        case arrow::TimeUnit::MILLI:
+            return 1000;
+        default:
+            return 1;
+    }
+}
+
+template <int kWidth>
+static std::unique_ptr<ValueEncoder> MakeIntegerEncoder(const arrow::DataType& source) {
+    // Only conversions that never overflow
+    switch (source.id()) {
+        case arrow::Type::INT8:
+            return std::make_unique<IntegerEncoder<arrow::Int8Array, kWidth>>();
+        case arrow::Type::UINT8:
+            return std::make_unique<IntegerEncoder<arrow::UInt8Array, kWidth>>();
+        case arrow::Type::INT16:
+            return std::make_unique<IntegerEncoder<arrow::Int16Array, kWidth>>();
+        case arrow::Type::UINT16:
+            if (kWidth > 2)
+                return std::make_unique<IntegerEncoder<arrow::UInt16Array, kWidth>>();
+            break;
+        case arrow::Type::INT32:
+            if (kWidth > 2)
+                return std::make_unique<IntegerEncoder<arrow::Int32Array, kWidth>>();
+            break;
+        case arrow::Type::UINT32:
+            if (kWidth > 4)
+                return std::make_unique<IntegerEncoder<arrow::UInt32Array, kWidth>>();
+            break;
+        case arrow::Type::INT64:
+            if (kWidth > 4)
+                return std::make_unique<IntegerEncoder<arrow::Int64Array, kWidth>>();
+            break;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+// Encoder of `source` values into a column of type `target`, as mapped by
+// GetQuerySchema, or null when there is no lossless conversion
+static std::unique_ptr<ValueEncoder> MakeValueEncoder(
+    const arrow::DataType& source,
+    const arrow::DataType& target,
+    Oid element_type) {
+    int64_t mul, div;
+    switch (target.id()) {
+        case arrow::Type::BOOL:
+            if (source.id() == arrow::Type::BOOL)
+                return std::make_unique<BoolEncoder>();
+            break;
+        case arrow::Type::INT16:
+            return MakeIntegerEncoder<2>(source);
+        case arrow::Type::INT32:
+            return MakeIntegerEncoder<4>(source);
+        case arrow::Type::INT64:
+            return MakeIntegerEncoder<8>(source);
+        case arrow::Type::FLOAT:
+            if (source.id() == arrow::Type::FLOAT)
+                return std::make_unique<FloatEncoder<arrow::FloatArray, float>>();
+            break;
+        case arrow::Type::DOUBLE:
+            if (source.id() == arrow::Type::FLOAT)
+                return std::make_unique<FloatEncoder<arrow::FloatArray, double>>();
+            if (source.id() == arrow::Type::DOUBLE)
+                return std::make_unique<FloatEncoder<arrow::DoubleArray, double>>();
+            break;
+        case arrow::Type::DATE32:
+            if (source.id() == arrow::Type::DATE32)
+                return std::make_unique<IntegerEncoder<arrow::Date32Array, 4>>(
+                    1, 1, kEpochDays);
+            if (source.id() == arrow::Type::DATE64)
+                return std::make_unique<IntegerEncoder<arrow::Date64Array, 4>>(
+                    1, 86400000, kEpochDays);
+            break;
+        case arrow::Type::TIMESTAMP:
+            if (source.id() == arrow::Type::TIMESTAMP) {
+                mul = GetMicros(((const arrow::TimestampType&)source).unit(), &div);
+                return std::make_unique<IntegerEncoder<arrow::TimestampArray, 8>>(
+                    mul, div, kEpochMicros);
+            }
+            break;
+        case arrow::Type::TIME64:
+            if (source.id() == arrow::Type::TIME64) {
+                mul = GetMicros(((const arrow::Time64Type&)source).unit(), &div);
+                return std::make_unique<IntegerEncoder<arrow::Time64Array, 8>>(
+                    mul, div);
+            }
+            if (source.id() == arrow::Type::TIME32) {
+                mul = GetMicros(((const arrow::Time32Type&)source).unit(), &div);
+                return std::make_unique<IntegerEncoder<arrow::Time32Array, 8>>(
+                    mul, div);
+            }
+            break;
+        case arrow::Type::DURATION:
+            if (source.id() == arrow::Type::DURATION) {
+                mul = GetMicros(((const arrow::DurationType&)source).unit(), &div);
+                return std::make_unique<IntegerEncoder<arrow::DurationArray, 16>>(
+                    mul, div);
+            }
+            break;
+        case arrow::Type::FIXED_SIZE_BINARY:
+            if (source.Equals(target))
+                return std::make_unique<BinaryEncoder<arrow::FixedSizeBinaryArray>>();
+            break;
+        case arrow::Type::DECIMAL128:
+        case arrow::Type::DECIMAL256:
+            // The server rounds to the scale of the column
+            if (source.id() == arrow::Type::DECIMAL128)
+                return std::make_unique<
+                    NumericEncoder<arrow::Decimal128Array, arrow::Decimal128>>(
+                    ((const arrow::DecimalType&)source).scale());
+            if (source.id() == arrow::Type::DECIMAL256)
+                return std::make_unique<
+                    NumericEncoder<arrow::Decimal256Array, arrow::Decimal256>>(
+                    ((const arrow::DecimalType&)source).scale());
+            break;
+        case arrow::Type::STRING:
+        case arrow::Type::BINARY:
+        case arrow::Type::DICTIONARY:
+            // Text, bytea and enums, which all take any bytes
+            switch (source.id()) {
+                case arrow::Type::STRING:
+                case arrow::Type::BINARY:
+                    return std::make_unique<BinaryEncoder<arrow::BinaryArray>>();
+                case arrow::Type::LARGE_STRING:
+                case arrow::Type::LARGE_BINARY:
+                    return std::make_unique<BinaryEncoder<arrow::LargeBinaryArray>>();
+#if ARROW_VERSION_MAJOR >= 15
+                case arrow::Type::STRING_VIEW:
+                case arrow::Type::BINARY_VIEW:
+                    return std::make_unique<BinaryEncoder<arrow::BinaryViewArray>>();
+#endif
+                case arrow::Type::DICTIONARY: {
+                    auto value_type =
+                        ((const arrow::DictionaryType&)source).value_type()->id();
+                    if (value_type == arrow::Type::STRING ||
+                        value_type == arrow::Type::BINARY)
+                        return std::make_unique<
+                            DictionaryEncoder<arrow::BinaryArray>>();
+                } break;
+                default:
+                    break;
+            }
+            break;
+        case arrow::Type::LIST: {
+            std::shared_ptr<arrow::DataType> value_type;
+            if (source.id() == arrow::Type::LIST ||
+                source.id() == arrow::Type::LARGE_LIST ||
+                source.id() == arrow::Type::FIXED_SIZE_LIST)
+                value_type = ((const arrow::BaseListType&)source).value_type();
+            else
+                break;
+
+            // Arrays of arrays are not supported
+            auto element_target = ((const arrow::ListType&)target).value_type();
+            if (element_target->id() == arrow::Type::LIST)
+                break;
+            auto element = MakeValueEncoder(*value_type, *element_target, 0);
+            if (!element)
+                break;
+            if (source.id() == arrow::Type::LIST)
+                return std::make_unique<ListEncoder<arrow::ListArray>>(
+                    std::move(element), element_type);
+            if (source.id() == arrow::Type::LARGE_LIST)
+                return std::make_unique<ListEncoder<arrow::LargeListArray>>(
+                    std::move(element), element_type);
+            return std::make_unique<ListEncoder<arrow::FixedSizeListArray>>(
+                std::move(element), element_type);
+        }
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+CopyEncoder::CopyEncoder(arrow::MemoryPool* pool) : pool_(pool) {}
+
+CopyEncoder::~CopyEncoder() = default;
+
+arrow::Result<std::unique_ptr<CopyEncoder>> CopyEncoder::Make(
+    const arrow::Schema& source,
+    const arrow::Schema& target,
+    const std::map<std::string, Oid>& element_types,
+    arrow::MemoryPool* pool) {
+    std::unique_ptr<CopyEncoder> encoder(new CopyEncoder(pool));
+    for (auto& field : target.fields()) {
+        int i = source.GetFieldIndex(field->name());
+        if (i < 0)
+            return arrow::Status::Invalid("no column ", field->name(), " to load");
+
+        auto it = element_types.find(field->name());
+        auto value_encoder = MakeValueEncoder(
+            *source.field(i)->type(), *field->type(),
+            it != element_types.end() ? it->second : 0);
+        if (!value_encoder)
+            return arrow::Status::NotImplemented(
+                "unable to load ", source.field(i)->type()->ToString(), " into ",
+                field->type()->ToString(), " column ", field->name());
+        encoder->columns_.push_back(i);
+        encoder->encoders_.push_back(std::move(value_encoder));
+    }
+    return encoder;
+}
+
+// Every row is sized first, so that the rows can then be written column after
+// column straight into a buffer of the right size
+arrow::Result<std::shared_ptr<arrow::Buffer>> CopyEncoder::Encode(
+    const arrow::RecordBatch& batch) {
+    int64_t num_rows = batch.num_rows();
+    sizes_.assign(num_rows, 2);
+    for (size_t c = 0; c < encoders_.size(); c++)
+        encoders_[c]->AddSizes(*batch.column(columns_[c]), sizes_.data());
+
+    int64_t total = 0;
+    for (auto size : sizes_)
+        total += size;
+    ARROW_ASSIGN_OR_RAISE(auto buffer, arrow::AllocateBuffer(total, pool_));
+
+    cursors_.resize(num_rows);
+    auto data = (char*)buffer->mutable_data();
+    for (int64_t i = 0; i < num_rows; i++) {
+        pack_int16(data, encoders_.size());
+        cursors_[i] = data + 2;
+        data += sizes_[i];
+    }
+    for (size_t c = 0; c < encoders_.size(); c++)
+        encoders_[c]->WriteColumn(*batch.column(columns_[c]), cursors_.data());
+    return buffer;
+}
+
+static arrow::Status PutCopyData(PGconn* conn, const char* data, int64_t size) {
+    for (int64_t sent = 0; sent < size; sent += kCopyDataSize) {
+        auto length = std::min(size - sent, kCopyDataSize);
+        if (PQputCopyData(conn, data + sent, length) != 1)
+            return arrow::Status::IOError(
+                "unable to send copy data: ", PQerrorMessage(conn));
+    }
+    return arrow::Status::OK();
+}
+
+// Element types of the array columns of `table`
+static arrow::Result<std::map<std::string, Oid>> GetElementTypes(
+    PGconn* conn,
+    const char* table) {
+    static const char kQuery[] = R"(
+        SELECT a.attname, t.typelem
+        FROM pg_catalog.pg_attribute a
+        JOIN pg_catalog.pg_type t ON t.oid = a.atttypid
+        WHERE a.attrelid = $1::regclass AND a.attnum > 0 AND NOT a.attisdropped
+            AND t.typelem <> 0 AND t.typlen = -1
+        )";
+    const char* values[] = {table};
+    auto res = PQexecParams(conn, kQuery, 1, nullptr, values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        auto status = arrow::Status::IOError(
+            "unable to get the columns of ", table, ": ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
+    std::map<std::string, Oid> types;
+    for (int i = 0; i < PQntuples(res); i++)
+        types[PQgetvalue(res, i, 0)] = atooid(PQgetvalue(res, i, 1));
+    PQclear(res);
+    return types;
+}
+
+arrow::Status CopyIntoTable(
+    PGconn* conn,
+    const char* table,
+    arrow::RecordBatchReader& reader,
+    const UserOptions& options,
+    CopyStats* stats) {
+    auto source = reader.schema();
+    std::string columns;
+    for (auto& field : source->fields()) {
+        auto name =
+            PQescapeIdentifier(conn, field->name().c_str(), field->name().size());
+        if (name == nullptr)
+            return arrow::Status::Invalid(PQerrorMessage(conn));
+        columns += (columns.empty() ? "" : ", ") + std::string(name);
+        PQfreemem(name);
+    }
+
+    // Table columns the way they would be exported, which the batches are
+    // converted to
+    auto select = "SELECT " + columns + " FROM " + table;
+    ARROW_ASSIGN_OR_RAISE(auto target, GetQuerySchema(conn, select.c_str(), options));
+    if (target->num_fields() != source->num_fields())
+        return arrow::Status::Invalid("unable to get the columns of ", table);
+    ARROW_ASSIGN_OR_RAISE(auto element_types, GetElementTypes(conn, table));
+    ARROW_ASSIGN_OR_RAISE(
+        auto encoder,
+        CopyEncoder::Make(
+            *source, *target, element_types,
+            options.memory_pool ? options.memory_pool : arrow::default_memory_pool()));
+
+    auto copy_query =
+        std::string("COPY ") + table + " (" + columns + ") FROM STDIN (FORMAT binary)";
+    auto res = PQexec(conn, copy_query.c_str());
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        auto status = arrow::Status::IOError(
+            "error in copy command: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
+    PQclear(res);
+
+    // The server only sees the end of the data on error, and then aborts
+    auto status = PutCopyData(conn, kBinaryHeader, kBinaryHeaderSize);
+    while (status.ok()) {
+        std::shared_ptr<arrow::RecordBatch> batch;
+        status = reader.ReadNext(&batch);
+        if (!status.ok() || batch == nullptr)
+            break;
+        auto data = encoder->Encode(*batch);
+        status = data.status();
+        if (status.ok())
+            status = PutCopyData(conn, (const char*)(*data)->data(), (*data)->size());
+        if (status.ok() && stats) {
+            stats->rows += batch->num_rows();
+            stats->bytes += (*data)->size();
+            stats->batches++;
+        }
+    }
+    if (status.ok()) {
+        char trailer[2];
+        pack_int16(trailer, -1);
+        status = PutCopyData(conn, trailer, sizeof(trailer));
+    }
+
+    if (PQputCopyEnd(conn, status.ok() ? nullptr : status.message().c_str()) != 1 &&
+        status.ok())
+        status = arrow::Status::IOError("unable to end copy: ", PQerrorMessage(conn));
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK && status.ok())
+        status = arrow::Status::IOError(
+            "copy command failed: ", PQresultErrorMessage(res));
+    PQclear(res);
+    while ((res = PQgetResult(conn)) != nullptr)
+        PQclear(res);
+    return status;
+}
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,175 @@
+#include "pg2arrow.h"
+
+#include "./hton.h"
+
+#include <arrow/io/buffered.h>
+#include <arrow/io/file.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace Pg2Arrow {
+
+// Binary COPY file header: signature, int32 flags and the int32 length of the
+// header extension that follows
+static const char kSignature[] = "PGCOPY\n\377\r\n";
+static const int kSignatureSize = 11;
+static const int kHeaderSize = 19;
+static const int32_t kOidsFlag = 1 << 16;
+
+// Rows handed out at once, as for the libpq stream
+static const size_t kMaxRun = 1024;
+
+int64_t CopyRowSize(const char* row, const char* end) {
+    if (end && end - row < 2)
+        return -1;
+    int16_t nfields = unpack_int16(row);
+    const char* cursor = row + 2;
+    for (int16_t i = 0; i < nfields; i++) {
+        if (end && end - cursor < 4)
+            return -1;
+        int32_t flen = unpack_int32(cursor);
+        cursor += 4;
+        if (flen > 0) {
+            if (end && end - cursor < flen)
+                return -1;
+            cursor += flen;
+        }
+    }
+    return cursor - row;
+}
+
+// Read only memory mapping, unmapped along with the last array pointing into it
+class MappedBuffer : public arrow::Buffer {
+   public:
+    MappedBuffer(const char* data, int64_t size)
+        : arrow::Buffer((const uint8_t*)data, size) {}
+    ~MappedBuffer() override { munmap((void*)data_, size_); }
+};
+
+// Rows of a binary COPY file walked in place in a read only memory mapping
+class MappedCopyStream : public CopyStream {
+   public:
+    arrow::Status Open(const char* filename) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return arrow::Status::IOError(
+                "unable to open ", filename, ": ", strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int error = errno;
+            close(fd);
+            return arrow::Status::IOError(
+                "unable to stat ", filename, ": ", strerror(error));
+        }
+        // mmap fails on an empty file, which is no COPY file either
+        if (st.st_size == 0) {
+            close(fd);
+            return arrow::Status::Invalid(
+                filename, " is empty, not a binary COPY file");
+        }
+        size_ = st.st_size;
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        data_ = data != MAP_FAILED ? (const char*)data : nullptr;
+        int error = errno;
+        close(fd);
+        if (data_ == nullptr)
+            return arrow::Status::IOError(
+                "unable to map ", filename, ": ", strerror(error));
+        mapping_ = std::make_shared<MappedBuffer>(data_, size_);
+        madvise((void*)data_, size_, MADV_SEQUENTIAL);
+
+        if (size_ < kHeaderSize || memcmp(data_, kSignature, kSignatureSize) != 0)
+            return arrow::Status::Invalid(filename, " is not a binary COPY file");
+        if (unpack_int32(data_ + kSignatureSize) & kOidsFlag)
+            return arrow::Status::NotImplemented(filename, " has row OIDs");
+        int64_t extension = unpack_uint32(data_ + kSignatureSize + 4);
+        if (size_ - kHeaderSize < extension)
+            return arrow::Status::Invalid(filename, " has a truncated header");
+
+        cursor_ = data_ + kHeaderSize + extension;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Next(std::vector<const char*>* rows) override {
+        rows->clear();
+        const char* end = data_ + size_;
+        while (rows->size() < kMaxRun && cursor_ < end) {
+            int64_t size = CopyRowSize(cursor_, end);
+            if (size < 0)
+                return arrow::Status::Invalid(
+                    "truncated row at offset ", cursor_ - data_);
+            rows->push_back(cursor_);
+            // Anything past the trailer is not COPY data
+            cursor_ = unpack_int16(cursor_) == -1 ? end : cursor_ + size;
+        }
+        return arrow::Status::OK();
+    }
+
+    std::shared_ptr<arrow::Buffer> buffer() const override { return mapping_; }
+
+   private:
+    std::shared_ptr<arrow::Buffer> mapping_;
+    const char* data_ = nullptr;
+    int64_t size_ = 0;
+    const char* cursor_ = nullptr;
+};
+
+arrow::Result<std::unique_ptr<CopyStream>> OpenCopyFile(const char* filename) {
+    auto stream = std::make_unique<MappedCopyStream>();
+    ARROW_RETURN_NOT_OK(stream->Open(filename));
+    return stream;
+}
+
+static const int64_t kTeeBufferSize = 1 << 20;
+
+// Passes rows through while appending them to a binary COPY file, which gets
+// closed at the end of the stream
+class TeeStream : public CopyStream {
+   public:
+    TeeStream(
+        std::unique_ptr<CopyStream> stream,
+        std::shared_ptr<arrow::io::OutputStream> file)
+        : stream_(std::move(stream)), file_(std::move(file)) {}
+
+    arrow::Status Next(std::vector<const char*>* rows) override {
+        ARROW_RETURN_NOT_OK(stream_->Next(rows));
+        if (file_->closed())
+            return arrow::Status::OK();
+        if (rows->empty())
+            return file_->Close();
+
+        for (auto row : *rows)
+            ARROW_RETURN_NOT_OK(file_->Write(row, CopyRowSize(row, nullptr)));
+        return arrow::Status::OK();
+    }
+
+    std::shared_ptr<arrow::Buffer> buffer() const override { return stream_->buffer(); }
+
+   private:
+    std::unique_ptr<CopyStream> stream_;
+    std::shared_ptr<arrow::io::OutputStream> file_;
+};
+
+arrow::Result<std::unique_ptr<CopyStream>> TeeCopyStream(
+    std::unique_ptr<CopyStream> stream,
+    const char* filename,
+    arrow::MemoryPool* pool) {
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::FileOutputStream::Open(filename));
+    char header[kHeaderSize];
+    memcpy(header, kSignature, kSignatureSize);
+    pack_int32(header + kSignatureSize, 0);
+    pack_int32(header + kSignatureSize + 4, 0);
+    ARROW_ASSIGN_OR_RAISE(
+        auto buffered,
+        arrow::io::BufferedOutputStream::Create(kTeeBufferSize, pool, file));
+    ARROW_RETURN_NOT_OK(buffered->Write(header, kHeaderSize));
+    return std::make_unique<TeeStream>(std::move(stream), std::move(buffered));
+}
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,540 @@
+#include "./writer.h"
+
+#include <arrow/array/concatenate.h>
+#include <arrow/util/byte_size.h>
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+
+namespace Pg2Arrow {
+
+enum class TimeUnit { kNone, kHour, kDay, kMonth, kYear };
+
+static int64_t FloorDiv(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+// Proleptic Gregorian date of a number of days since 1970-01-01
+static void CivilFromDays(int64_t days, int64_t* year, int* month, int* day) {
+    days += 719468;
+    int64_t era = FloorDiv(days, 146097);
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+// Hive escapes path separators and the characters of its own syntax
+static std::string EscapeHive(std::string_view value) {
+    if (value.empty())
+        return "__HIVE_DEFAULT_PARTITION__";
+    std::string escaped;
+    for (unsigned char c : value) {
+        if (c < 0x20 || c == 0x7f || strchr("\"#%'*/:=?\\[]^{}", c) != nullptr) {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            escaped += hex;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Splits batches by the value of a column, or of a date or timestamp column
+// truncated to `unit`. Partition values are only compared between neighbouring
+// rows and formatted once per run of equal values.
+class Partitioning {
+   public:
+    static arrow::Result<Partitioning> Make(
+        const arrow::Schema& schema,
+        const WriterOptions& options) {
+        Partitioning partitioning;
+        partitioning.index_ = schema.GetFieldIndex(options.partition_column);
+        if (partitioning.index_ < 0)
+            return arrow::Status::Invalid(
+                "unknown partition column: ", options.partition_column);
+
+        auto& unit = options.partition_unit;
+        if (unit.empty())
+            partitioning.unit_ = TimeUnit::kNone;
+        else if (unit == "hour")
+            partitioning.unit_ = TimeUnit::kHour;
+        else if (unit == "day")
+            partitioning.unit_ = TimeUnit::kDay;
+        else if (unit == "month")
+            partitioning.unit_ = TimeUnit::kMonth;
+        else if (unit == "year")
+            partitioning.unit_ = TimeUnit::kYear;
+        else
+            return arrow::Status::Invalid("unknown partition unit: ", unit);
+
+        auto& type = *schema.field(partitioning.index_)->type();
+        bool supported;
+        switch (type.id()) {
+            case arrow::Type::TIMESTAMP:
+                supported = partitioning.unit_ != TimeUnit::kNone;
+                partitioning.seconds_per_unit_ = TicksPerSecond(type);
+                break;
+            case arrow::Type::DATE32:
+                supported = partitioning.unit_ != TimeUnit::kHour;
+                break;
+            case arrow::Type::DICTIONARY: {
+                auto& value_type =
+                    *static_cast<const arrow::DictionaryType&>(type).value_type();
+                supported = partitioning.unit_ == TimeUnit::kNone &&
+                            (value_type.id() == arrow::Type::STRING ||
+                             value_type.id() == arrow::Type::LARGE_STRING);
+                break;
+            }
+            default:
+                supported = partitioning.unit_ == TimeUnit::kNone &&
+                            (arrow::is_integer(type.id()) ||
+                             arrow::is_string(type.id()) ||
+#if ARROW_VERSION_MAJOR >= 15
+                             type.id() == arrow::Type::STRING_VIEW ||
+#endif
+                             type.id() == arrow::Type::BOOL);
+        }
+        if (!supported)
+            return arrow::Status::Invalid(
+                "unable to partition ", type.ToString(), " column ",
+                options.partition_column, unit.empty() ? "" : " by ", unit);
+
+        // Plain values go to the directory names only, as Hive readers expect.
+        // Truncated ones keep their column and name the directories after the
+        // unit, which would otherwise shadow it.
+        partitioning.drop_column_ = partitioning.unit_ == TimeUnit::kNone;
+        partitioning.name_ = partitioning.drop_column_
+                                 ? options.partition_column
+                                 : options.partition_column + "_" + unit;
+        return partitioning;
+    }
+
+    int index() const { return index_; }
+    bool drop_column() const { return drop_column_; }
+
+    // Calls `on_run(start, end)` for each run of rows of `batch` going to the
+    // same partition
+    template <typename OnRun>
+    void ForEachRun(const arrow::RecordBatch& batch, OnRun&& on_run) const {
+        auto& array = *batch.column(index_);
+        switch (array.type_id()) {
+            case arrow::Type::TIMESTAMP:
+            case arrow::Type::DATE32: {
+                auto key = [&](int64_t i) { return Truncate(array, i); };
+                return ForEachRun(array, key, on_run);
+            }
+            case arrow::Type::DICTIONARY: {
+                auto& dictionary = static_cast<const arrow::DictionaryArray&>(array);
+                auto key = [&](int64_t i) { return dictionary.GetValueIndex(i); };
+                return ForEachRun(array, key, on_run);
+            }
+            case arrow::Type::STRING:
+                return ForEachStringRun<arrow::StringArray>(array, on_run);
+            case arrow::Type::LARGE_STRING:
+                return ForEachStringRun<arrow::LargeStringArray>(array, on_run);
+#if ARROW_VERSION_MAJOR >= 15
+            case arrow::Type::STRING_VIEW:
+                return ForEachStringRun<arrow::StringViewArray>(array, on_run);
+#endif
+            case arrow::Type::BOOL: {
+                auto& values = static_cast<const arrow::BooleanArray&>(array);
+                auto key = [&](int64_t i) { return values.Value(i); };
+                return ForEachRun(array, key, on_run);
+            }
+            case arrow::Type::UINT64: {
+                auto& values = static_cast<const arrow::UInt64Array&>(array);
+                auto key = [&](int64_t i) { return values.Value(i); };
+                return ForEachRun(array, key, on_run);
+            }
+            default: {
+                auto key = [&](int64_t i) { return IntegerValue(array, i); };
+                return ForEachRun(array, key, on_run);
+            }
+        }
+    }
+
+    // Directory of the partition of `row`, as name=value
+    std::string Key(const arrow::RecordBatch& batch, int64_t row) const {
+        auto& array = *batch.column(index_);
+        if (array.IsNull(row))
+            return name_ + "=__HIVE_DEFAULT_PARTITION__";
+
+        std::string value;
+        switch (array.type_id()) {
+            case arrow::Type::TIMESTAMP:
+            case arrow::Type::DATE32:
+                value = FormatTime(Truncate(array, row));
+                break;
+            case arrow::Type::DICTIONARY: {
+                auto& dictionary = static_cast<const arrow::DictionaryArray&>(array);
+                auto index = dictionary.GetValueIndex(row);
+                auto& values = *dictionary.dictionary();
+                value = EscapeHive(
+                    values.type_id() == arrow::Type::STRING
+                        ? static_cast<const arrow::StringArray&>(values).GetView(index)
+                        : static_cast<const arrow::LargeStringArray&>(values).GetView(
+                              index));
+                break;
+            }
+            case arrow::Type::STRING:
+                value = EscapeHive(
+                    static_cast<const arrow::StringArray&>(array).GetView(row));
+                break;
+            case arrow::Type::LARGE_STRING:
+                value = EscapeHive(
+                    static_cast<const arrow::LargeStringArray&>(array).GetView(row));
+                break;
+#if ARROW_VERSION_MAJOR >= 15
+            case arrow::Type::STRING_VIEW:
+                value = EscapeHive(
+                    static_cast<const arrow::StringViewArray&>(array).GetView(row));
+                break;
+#endif
+            case arrow::Type::BOOL:
+                value = static_cast<const arrow::BooleanArray&>(array).Value(row)
+                            ? "true"
+                            : "false";
+                break;
+            case arrow::Type::UINT64:
+                value = std::to_string(
+                    static_cast<const arrow::UInt64Array&>(array).Value(row));
+                break;
+            default:
+                value = std::to_string(IntegerValue(array, row));
+        }
+        return name_ + "=" + value;
+    }
+
+   private:
+    template <typename GetKey, typename OnRun>
+    static void ForEachRun(const arrow::Array& array, GetKey& get_key, OnRun& on_run) {
+        if (array.length() == 0)
+            return;
+        int64_t start = 0;
+        auto key = get_key(0);
+        for (int64_t i = 1; i < array.length(); i++) {
+            if (array.IsNull(i) != array.IsNull(start) ||
+                (!array.IsNull(i) && get_key(i) != key)) {
+                on_run(start, i);
+                start = i;
+                key = get_key(i);
+            }
+        }
+        on_run(start, array.length());
+    }
+
+    template <typename ArrayType, typename OnRun>
+    static void ForEachStringRun(const arrow::Array& array, OnRun& on_run) {
+        auto& values = static_cast<const ArrayType&>(array);
+        auto key = [&](int64_t i) { return values.GetView(i); };
+        ForEachRun(array, key, on_run);
+    }
+
+    static int64_t TicksPerSecond(const arrow::DataType& type) {
+        switch (static_cast<const arrow::TimestampType&>(type).unit()) {
+            case arrow::TimeUnit::SECOND:
+                return 1;
+            case arrow::TimeUnit::MILLI:
+                return 1000;
+            case arrow::TimeUnit::MICRO:
+                return 1000000;
+            default:
+                return 1000000000;
+        }
+    }
+
+    // Any signed or unsigned integer up to 32 bits, or int64
+    static int64_t IntegerValue(const arrow::Array& array, int64_t i) {
+        auto data = array.data();
+        switch (array.type_id()) {
+            case arrow::Type::INT8:
+                return data->GetValues<int8_t>(1)[i];
+            case arrow::Type::UINT8:
+                return data->GetValues<uint8_t>(1)[i];
+            case arrow::Type::INT16:
+                return data->GetValues<int16_t>(1)[i];
+            case arrow::Type::UINT16:
+                return data->GetValues<uint16_t>(1)[i];
+            case arrow::Type::INT32:
+                return data->GetValues<int32_t>(1)[i];
+            case arrow::Type::UINT32:
+                return data->GetValues<uint32_t>(1)[i];
+            default:
+                return data->GetValues<int64_t>(1)[i];
+        }
+    }
+
+    // Number of the hour, day, month or year of a date or timestamp
+    int64_t Truncate(const arrow::Array& array, int64_t i) const {
+        int64_t days, seconds = 0;
+        if (array.type_id() == arrow::Type::DATE32) {
+            days = static_cast<const arrow::Date32Array&>(array).Value(i);
+        } else {
+            seconds = FloorDiv(
+                static_cast<const arrow::TimestampArray&>(array).Value(i),
+                seconds_per_unit_);
+            days = FloorDiv(seconds, 86400);
+        }
+
+        int64_t year;
+        int month, day;
+        switch (unit_) {
+            case TimeUnit::kHour:
+                return FloorDiv(seconds, 3600);
+            case TimeUnit::kMonth:
+                CivilFromDays(days, &year, &month, &day);
+                return year * 12 + month - 1;
+            case TimeUnit::kYear:
+                CivilFromDays(days, &year, &month, &day);
+                return year;
+            default:
+                return days;
+        }
+    }
+
+    std::string FormatTime(int64_t value) const {
+        int64_t year;
+        int month, day;
+        char text[32];
+        switch (unit_) {
+            case TimeUnit::kHour:
+                CivilFromDays(FloorDiv(value, 24), &year, &month, &day);
+                snprintf(
+                    text, sizeof(text), "%04lld-%02d-%02dT%02d", (long long)year,
+                    month, day, (int)(value - FloorDiv(value, 24) * 24));
+                break;
+            case TimeUnit::kMonth:
+                snprintf(
+                    text, sizeof(text), "%04lld-%02d",
+                    (long long)FloorDiv(value, 12),
+                    (int)(value - FloorDiv(value, 12) * 12) + 1);
+                break;
+            case TimeUnit::kYear:
+                snprintf(text, sizeof(text), "%04lld", (long long)value);
+                break;
+            default:
+                CivilFromDays(value, &year, &month, &day);
+                snprintf(
+                    text, sizeof(text), "%04lld-%02d-%02d", (long long)year, month,
+                    day);
+        }
+        return text;
+    }
+
+    int index_;
+    TimeUnit unit_;
+    int64_t seconds_per_unit_ = 1;
+    bool drop_column_;
+    std::string name_;
+};
+
+// Writes batches to a directory of files, each partition to files of its own
+// rolling over past the row or byte limit. Every open file has its own writer,
+// and its own writer thread when batches are queued, so that partitions are
+// encoded concurrently. Past `max_open_files`, the least recently written file
+// is closed and its partition goes on in a new file.
+class DatasetBatchWriter : public BatchWriter {
+   public:
+    explicit DatasetBatchWriter(const WriterOptions& options) : options_(options) {
+        file_options_ = options;
+        file_options_.max_file_rows = 0;
+        file_options_.max_file_bytes = 0;
+        file_options_.partition_column.clear();
+        file_options_.partition_unit.clear();
+        if (options.format == "parquet")
+            extension_ = ".parquet";
+        else if (options.format == "ipc-stream")
+            extension_ = ".arrows";
+        else
+            extension_ = ".arrow";
+    }
+
+    arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema) override {
+        if (options_.filename == "-")
+            return arrow::Status::Invalid("dataset output needs a directory");
+        file_schema_ = schema;
+        if (!options_.partition_column.empty()) {
+            ARROW_ASSIGN_OR_RAISE(
+                partitioning_, Partitioning::Make(*schema, options_));
+            if (partitioning_->drop_column()) {
+                ARROW_ASSIGN_OR_RAISE(
+                    file_schema_, schema->RemoveField(partitioning_->index()));
+            }
+        }
+        std::error_code error;
+        std::filesystem::create_directories(options_.filename, error);
+        if (error)
+            return arrow::Status::IOError(
+                "unable to create ", options_.filename, ": ", error.message());
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Write(std::shared_ptr<arrow::RecordBatch> batch) override {
+        if (batch->num_rows() == 0)
+            return arrow::Status::OK();
+        // Files roll over on the in memory size of their rows, before encoding
+        double row_bytes =
+            (double)arrow::util::TotalBufferSize(*batch) / batch->num_rows();
+        if (!partitioning_)
+            return WriteRows("", std::move(batch), row_bytes);
+
+        // Runs of rows are gathered by partition, in order of first appearance
+        std::unordered_map<std::string, size_t> indices;
+        std::vector<std::pair<std::string, std::vector<std::pair<int64_t, int64_t>>>>
+            partitions;
+        partitioning_->ForEachRun(*batch, [&](int64_t start, int64_t end) {
+            auto key = partitioning_->Key(*batch, start);
+            auto it = indices.emplace(key, partitions.size()).first;
+            if (it->second == partitions.size())
+                partitions.push_back({std::move(key), {}});
+            partitions[it->second].second.push_back({start, end - start});
+        });
+
+        if (partitioning_->drop_column()) {
+            ARROW_ASSIGN_OR_RAISE(batch, batch->RemoveColumn(partitioning_->index()));
+        }
+        for (auto& [key, runs] : partitions) {
+            ARROW_ASSIGN_OR_RAISE(auto rows, Gather(*batch, runs));
+            ARROW_RETURN_NOT_OK(WriteRows(key, std::move(rows), row_bytes));
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Close() override {
+        // An unpartitioned dataset always has a file, if only for its schema
+        if (files_.empty() && !partitioning_)
+            ARROW_RETURN_NOT_OK(OpenFile("", &files_[""]));
+
+        arrow::Status status;
+        for (auto& [key, file] : files_) {
+            auto close_status = CloseFile(&file);
+            if (status.ok())
+                status = close_status;
+        }
+        return status;
+    }
+
+   private:
+    struct File {
+        std::unique_ptr<BatchWriter> writer;
+        int64_t rows = 0;
+        double bytes = 0;
+        uint64_t last_write = 0;
+    };
+
+    // Rows of `batch` in `runs`, as (offset, length) pairs, without a copy
+    // when they are all in one run
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Gather(
+        const arrow::RecordBatch& batch,
+        const std::vector<std::pair<int64_t, int64_t>>& runs) {
+        if (runs.size() == 1)
+            return batch.Slice(runs[0].first, runs[0].second);
+
+        int64_t num_rows = 0;
+        std::vector<std::shared_ptr<arrow::Array>> columns;
+        for (int i = 0; i < batch.num_columns(); i++) {
+            arrow::ArrayVector slices;
+            for (auto& [offset, length] : runs)
+                slices.push_back(batch.column(i)->Slice(offset, length));
+            ARROW_ASSIGN_OR_RAISE(
+                auto column, arrow::Concatenate(slices, options_.memory_pool));
+            columns.push_back(std::move(column));
+        }
+        for (auto& run : runs)
+            num_rows += run.second;
+        return arrow::RecordBatch::Make(batch.schema(), num_rows, std::move(columns));
+    }
+
+    arrow::Status WriteRows(
+        const std::string& key,
+        std::shared_ptr<arrow::RecordBatch> batch,
+        double row_bytes) {
+        auto& file = files_[key];
+        int64_t offset = 0;
+        while (offset < batch->num_rows()) {
+            if (file.writer == nullptr)
+                ARROW_RETURN_NOT_OK(OpenFile(key, &file));
+            file.last_write = ++clock_;
+
+            int64_t num_rows = batch->num_rows() - offset;
+            if (options_.max_file_rows > 0)
+                num_rows = std::min(num_rows, options_.max_file_rows - file.rows);
+            ARROW_RETURN_NOT_OK(file.writer->Write(
+                num_rows == batch->num_rows() ? batch
+                                              : batch->Slice(offset, num_rows)));
+            file.rows += num_rows;
+            file.bytes += num_rows * row_bytes;
+            offset += num_rows;
+
+            bool full =
+                (options_.max_file_rows > 0 && file.rows >= options_.max_file_rows) ||
+                (options_.max_file_bytes > 0 && file.bytes >= options_.max_file_bytes);
+            if (full)
+                ARROW_RETURN_NOT_OK(CloseFile(&file));
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status OpenFile(const std::string& key, File* file) {
+        if (options_.max_open_files > 0 && open_files_ >= options_.max_open_files) {
+            File* oldest = nullptr;
+            for (auto& [other_key, other] : files_) {
+                if (other.writer != nullptr &&
+                    (oldest == nullptr || other.last_write < oldest->last_write))
+                    oldest = &other;
+            }
+            ARROW_RETURN_NOT_OK(CloseFile(oldest));
+        }
+
+        auto directory = std::filesystem::path(options_.filename) / key;
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error)
+            return arrow::Status::IOError(
+                "unable to create ", directory.string(), ": ", error.message());
+
+        char name[32];
+        snprintf(name, sizeof(name), "part-%05d", next_file_++);
+        auto options = file_options_;
+        options.filename = (directory / (name + extension_)).string();
+        ARROW_ASSIGN_OR_RAISE(file->writer, MakeBatchWriter(options));
+        ARROW_RETURN_NOT_OK(file->writer->Open(file_schema_));
+        file->rows = 0;
+        file->bytes = 0;
+        open_files_++;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status CloseFile(File* file) {
+        if (file->writer == nullptr)
+            return arrow::Status::OK();
+        auto writer = std::move(file->writer);
+        open_files_--;
+        return writer->Close();
+    }
+
+    WriterOptions options_;
+    WriterOptions file_options_;
+    std::string extension_;
+    std::shared_ptr<arrow::Schema> file_schema_;
+    std::optional<Partitioning> partitioning_;
+    std::unordered_map<std::string, File> files_;
+    int open_files_ = 0;
+    int next_file_ = 0;
+    uint64_t clock_ = 0;
+};
+
+arrow::Result<std::unique_ptr<BatchWriter>> MakeDatasetWriter(
+    const WriterOptions& options) {
+    return std::make_unique<DatasetBatchWriter>(options);
+}
+
+}  // namespace Pg2Arrow
@@ -1,5 +1,7 @@
 // taken from https://github.com/MagicStack/py-pgproto/blob/master/hton.h
 
+#pragma once
+
 #include <stdint.h>
 #include <string.h>
 
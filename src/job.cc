@@ -0,0 +1,291 @@
+#include "./job.h"
+
+#include <poll.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+namespace Pg2Arrow {
+
+// Failed entries roll back to it, which keeps the shared snapshot transaction
+// usable
+static const char kSavepoint[] = "pg2arrow_entry";
+
+arrow::Result<std::vector<JobEntry>> ReadManifest(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file)
+        return arrow::Status::IOError("unable to open manifest ", filename);
+
+    std::vector<JobEntry> entries;
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        auto tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0 || tab + 1 == line.size())
+            return arrow::Status::Invalid(
+                filename, ":", number, ": expected output<TAB>query");
+        entries.push_back({line.substr(tab + 1), line.substr(0, tab)});
+    }
+    return entries;
+}
+
+static arrow::Status Exec(PGconn* conn, const std::string& query) {
+    auto res = PQexec(conn, query.c_str());
+    auto status = PQresultStatus(res) == PGRES_COMMAND_OK
+                      ? arrow::Status::OK()
+                      : arrow::Status::IOError(
+                            "error in '", query, "': ", PQresultErrorMessage(res));
+    PQclear(res);
+    return status;
+}
+
+// A connection of the pool and the entry it is exporting, if any
+struct JobSlot {
+    PGconn* conn = nullptr;
+    const JobEntry* entry = nullptr;
+    std::unique_ptr<AsyncCopyStream> stream;
+    std::unique_ptr<PgBuilder> builder;
+    std::unique_ptr<BatchWriter> writer;
+    bool writer_open = false;
+    // First error of the entry, the stream being drained past it
+    arrow::Status status;
+};
+
+class JobRunner {
+   public:
+    JobRunner(const std::vector<JobEntry>& entries, const JobOptions& options)
+        : entries_(entries), options_(options), slots_(options.connections) {}
+
+    ~JobRunner() {
+        for (auto& slot : slots_) {
+            if (slot.conn != nullptr) {
+                if (PQtransactionStatus(slot.conn) != PQTRANS_IDLE)
+                    PQclear(PQexec(slot.conn, "END"));
+                PQfinish(slot.conn);
+            }
+        }
+    }
+
+    arrow::Status Connect() {
+        for (size_t i = 0; i < slots_.size(); i++) {
+            auto& conn = slots_[i].conn;
+            conn = PQconnectdb(options_.conninfo.c_str());
+            if (PQstatus(conn) != CONNECTION_OK)
+                return arrow::Status::IOError(
+                    "failed on PostgreSQL connection: ", PQerrorMessage(conn));
+            if (!options_.shared_snapshot)
+                continue;
+
+            // The first connection exports the snapshot, which stays valid as
+            // long as its transaction, that is the whole job
+            if (i == 0) {
+                ARROW_ASSIGN_OR_RAISE(snapshot_, ExportSnapshot(conn));
+            } else {
+                ARROW_RETURN_NOT_OK(ImportSnapshot(conn, snapshot_));
+            }
+            ARROW_RETURN_NOT_OK(Exec(conn, std::string("SAVEPOINT ") + kSavepoint));
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Run() {
+        int num_threads = std::max(1, std::min<int>(options_.threads, slots_.size()));
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([this, t, num_threads]() {
+                std::vector<JobSlot*> slots;
+                for (size_t i = t; i < slots_.size(); i += num_threads)
+                    slots.push_back(&slots_[i]);
+                Drive(slots);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        // Left over when the whole pool was lost
+        for (size_t i = next_entry_; i < entries_.size(); i++)
+            Fail(entries_[i].output, arrow::Status::IOError("no connection left"));
+
+        if (failed_ > 0)
+            return arrow::Status::IOError(
+                failed_.load(), " of ", entries_.size(), " exports failed");
+        return arrow::Status::OK();
+    }
+
+   private:
+    // Keeps every connection of `slots` busy with the next entries, reading
+    // from all of their streams as data comes in
+    void Drive(const std::vector<JobSlot*>& slots) {
+        std::vector<struct pollfd> fds;
+        while (true) {
+            for (auto slot : slots) {
+                size_t i;
+                while (slot->conn != nullptr && slot->entry == nullptr &&
+                       (i = next_entry_++) < entries_.size())
+                    Start(*slot, entries_[i]);
+            }
+
+            fds.clear();
+            for (auto slot : slots) {
+                if (slot->entry != nullptr && Step(*slot))
+                    fds.push_back({slot->stream->socket(), POLLIN, 0});
+            }
+
+            bool active = false;
+            for (auto slot : slots)
+                active |= slot->entry != nullptr;
+            if (!active)
+                return;
+            if (!fds.empty() && poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+                return;
+        }
+    }
+
+    void Fail(const std::string& output, const arrow::Status& status) {
+        failed_++;
+        fprintf(stderr, "%s: %s\n", output.c_str(), status.ToString().c_str());
+    }
+
+    // Connections going back into the snapshot import it again, which only
+    // works as long as the first connection is alive. Connections that cannot
+    // be brought back are dropped from the pool.
+    void Reconnect(JobSlot& slot) {
+        PQreset(slot.conn);
+        auto status = PQstatus(slot.conn) == CONNECTION_OK
+                          ? arrow::Status::OK()
+                          : arrow::Status::IOError(
+                                "failed on PostgreSQL connection: ",
+                                PQerrorMessage(slot.conn));
+        if (status.ok() && options_.shared_snapshot) {
+            status = ImportSnapshot(slot.conn, snapshot_);
+            if (status.ok())
+                status = Exec(slot.conn, std::string("SAVEPOINT ") + kSavepoint);
+        }
+        if (!status.ok()) {
+            fprintf(stderr, "dropping connection: %s\n", status.ToString().c_str());
+            PQfinish(slot.conn);
+            slot.conn = nullptr;
+        }
+    }
+
+    // Looks up the schema, which blocks the thread for a round trip or two,
+    // then sends the COPY command
+    void Start(JobSlot& slot, const JobEntry& entry) {
+        slot.entry = &entry;
+        slot.status = arrow::Status::OK();
+        slot.writer_open = false;
+
+        auto query = entry.query.c_str();
+        auto schema = GetQuerySchema(slot.conn, query, options_.user_options);
+        if (!schema.ok())
+            return Finish(slot, schema.status());
+        slot.builder = std::make_unique<PgBuilder>(*schema, options_.user_options);
+
+        auto writer_options = options_.writer_options;
+        writer_options.filename = entry.output;
+        auto writer = MakeBatchWriter(writer_options);
+        if (!writer.ok())
+            return Finish(slot, writer.status());
+        slot.writer = std::move(*writer);
+
+        auto stream = StartCopyStream(slot.conn, query);
+        if (!stream.ok())
+            return Finish(slot, stream.status());
+        slot.stream = std::move(*stream);
+    }
+
+    // Decodes the rows received so far, returning whether the stream now
+    // waits for more
+    bool Step(JobSlot& slot) {
+        auto callback = [&slot](std::shared_ptr<arrow::RecordBatch> batch) {
+            if (!slot.writer_open)
+                ARROW_RETURN_NOT_OK(slot.writer->Open(batch->schema()));
+            slot.writer_open = true;
+            return slot.writer->Write(std::move(batch));
+        };
+
+        std::vector<const char*> rows;
+        while (true) {
+            auto status = slot.stream->Next(&rows);
+            if (!status.ok()) {
+                Finish(slot, status);
+                return false;
+            }
+            if (rows.empty())
+                break;
+            slot.builder->SetBuffer(slot.stream->buffer());
+            if (slot.status.ok())
+                slot.status = CopyRun(
+                    rows, *slot.builder, options_.user_options, callback);
+        }
+        if (!slot.stream->done())
+            return true;
+
+        if (slot.status.ok() && slot.builder->num_rows() > 0) {
+            std::shared_ptr<arrow::RecordBatch> batch;
+            slot.status = slot.builder->Flush(&batch);
+            if (slot.status.ok())
+                slot.status = callback(batch);
+        }
+        Finish(slot, slot.status);
+        return false;
+    }
+
+    // Closes the output of the entry, or removes it when the export failed, and
+    // makes the connection ready for the next entry
+    void Finish(JobSlot& slot, arrow::Status status) {
+        if (status.ok() && !slot.writer_open) {
+            status = slot.writer->Open(slot.builder->schema());
+            slot.writer_open = status.ok();
+        }
+        if (slot.writer_open) {
+            auto close_status = slot.writer->Close();
+            if (status.ok())
+                status = close_status;
+        }
+
+        // The stream leaves the connection blocking once done, but not when
+        // the entry failed before or while starting it
+        if (PQstatus(slot.conn) == CONNECTION_OK)
+            PQsetnonblocking(slot.conn, 0);
+
+        // Whatever failed, the savepoint is rolled back to, the transaction
+        // being aborted or not
+        if (!status.ok()) {
+            Fail(slot.entry->output, status);
+            std::remove(slot.entry->output.c_str());
+            if (PQstatus(slot.conn) != CONNECTION_OK) {
+                Reconnect(slot);
+            } else if (options_.shared_snapshot) {
+                auto rollback_status = Exec(
+                    slot.conn, std::string("ROLLBACK TO SAVEPOINT ") + kSavepoint);
+                if (!rollback_status.ok())
+                    Reconnect(slot);
+            }
+        }
+
+        slot.entry = nullptr;
+        slot.stream.reset();
+        slot.builder.reset();
+        slot.writer.reset();
+    }
+
+    const std::vector<JobEntry>& entries_;
+    const JobOptions& options_;
+    std::vector<JobSlot> slots_;
+    std::string snapshot_;
+    std::atomic<size_t> next_entry_{0};
+    std::atomic<int64_t> failed_{0};
+};
+
+arrow::Status RunJob(const std::vector<JobEntry>& entries, const JobOptions& options) {
+    JobRunner runner(entries, options);
+    ARROW_RETURN_NOT_OK(runner.Connect());
+    return runner.Run();
+}
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "./pg2arrow.h"
+#include "./writer.h"
+
+#include <string>
+#include <vector>
+
+namespace Pg2Arrow {
+
+// One export of a job: the results of `query` go to `output`
+struct JobEntry {
+    std::string query;
+    std::string output;
+};
+
+struct JobOptions {
+    std::string conninfo;
+    // Connections of the pool, shared by the threads driving them
+    int connections = 4;
+    int threads = 1;
+    // Export every entry from the same snapshot of the database
+    bool shared_snapshot = false;
+    UserOptions user_options;
+    // Output options of every entry, but for the file name
+    WriterOptions writer_options;
+};
+
+// Reads a manifest with one `output<TAB>query` entry per line, skipping empty
+// lines and lines starting with #
+arrow::Result<std::vector<JobEntry>> ReadManifest(const std::string& filename);
+
+// Exports all `entries` over a pool of connections opened once, each thread
+// driving several COPY streams at once. Failed entries are reported on stderr
+// and their output removed, the others still run.
+arrow::Status RunJob(const std::vector<JobEntry>& entries, const JobOptions& options);
+
+}  // namespace Pg2Arrow
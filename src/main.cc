@@ -1,76 +1,665 @@
+#include "./job.h"
 #include "./pg2arrow.h"
+#include "./writer.h"
 
 #include <arrow/io/api.h>
-#include <parquet/arrow/writer.h>
+#include <arrow/ipc/api.h>
+#include <parquet/exception.h>
 
 #include <getopt.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 static const char* conninfo = "postgresql://localhost/mytests";
 static const char* query = "select * from minute_bars";
-static const char* output_filename = "test.parquet";
+static Pg2Arrow::WriterOptions writer_options;
+static const char* input_filename = nullptr;
+static Pg2Arrow::UserOptions user_options;
+static int jobs = 1;
+static const char* relation = nullptr;
+static const char* partition_key = nullptr;
+static std::vector<std::string> partition_bounds;
+static std::string relation_query;
+static std::string stats_filename;
+static double progress_interval = 0;
+static std::string memory_pool_name = "default";
+static const char* manifest_filename = nullptr;
+static int job_threads = 1;
+static bool shared_snapshot = false;
 
 static void parse_options(int argc, char* const argv[]) {
     static struct option options[] = {
         {"conninfo", 1, NULL, 'd'},
         {"table", 1, NULL, 'q'},
         {"output_file", 1, NULL, 'o'},
+        {"input", 1, NULL, 'i'},
+        {"batch-rows", 1, NULL, 'b'},
+        {"batch-bytes", 1, NULL, 'B'},
+        {"jobs", 1, NULL, 'j'},
+        {"relation", 1, NULL, 'T'},
+        {"partition-key", 1, NULL, 'k'},
+        {"partition-bound", 1, NULL, 'K'},
+        {"raw-socket", 0, NULL, 1000},
+        {"numeric-precision", 1, NULL, 1001},
+        {"numeric-scale", 1, NULL, 1002},
+        {"dictionary", 1, NULL, 1003},
+        {"auto-dictionary", 0, NULL, 1004},
+        {"tee", 1, NULL, 1005},
+        {"format", 1, NULL, 1006},
+        {"compression", 1, NULL, 1007},
+        {"type-cache", 1, NULL, 1008},
+        {"no-type-cache", 0, NULL, 1009},
+        {"stats-json", 1, NULL, 1010},
+        {"progress", 1, NULL, 1011},
+        {"memory-pool", 1, NULL, 1012},
+        {"memory-limit", 1, NULL, 1013},
+        {"write-queue", 1, NULL, 1014},
+        {"no-write-threads", 0, NULL, 1015},
+        {"manifest", 1, NULL, 1016},
+        {"job-threads", 1, NULL, 1017},
+        {"shared-snapshot", 0, NULL, 1018},
+        {"max-file-rows", 1, NULL, 1019},
+        {"max-file-bytes", 1, NULL, 1020},
+        {"partition-by", 1, NULL, 1021},
+        {"max-open-files", 1, NULL, 1022},
+        {"string-views", 0, NULL, 1023},
+        {"array-shape", 1, NULL, 1024},
+        {"decode-threads", 1, NULL, 1025},
+        {"unordered", 0, NULL, 1026},
+        {"auto-encoding", 0, NULL, 1027},
+        {"page-index", 0, NULL, 1028},
+        {"bloom-filter", 1, NULL, 1029},
         {"help", 0, NULL, 9999},
         {NULL, 0, NULL, 0},
     };
+    // Row groups of 1M rows or 256MB of COPY data, whichever comes first
+    user_options.batch_rows = 1 << 20;
+    user_options.batch_bytes = 256 << 20;
+    writer_options.filename = "test.parquet";
+    // Encode batch N on all cores while batch N + 1 is decoded
+    writer_options.max_queued_batches = 1;
+    writer_options.use_threads = true;
+    if (getenv("XDG_CACHE_HOME"))
+        user_options.type_cache_filename =
+            std::string(getenv("XDG_CACHE_HOME")) + "/pg2arrow/types";
+    else if (getenv("HOME"))
+        user_options.type_cache_filename =
+            std::string(getenv("HOME")) + "/.cache/pg2arrow/types";
+
     int c;
-    while ((c = getopt_long(argc, argv, "d:q:o:", options, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "d:q:o:i:b:B:j:T:k:K:", options, NULL)) >= 0) {
         if (c == 'd')
             conninfo = optarg;
         else if (c == 'q')
             query = optarg;
         else if (c == 'o')
-            output_filename = optarg;
-        else {
-            printf("usage: pg2arrow -d conninfo -q query -o output_file");
+            writer_options.filename = optarg;
+        else if (c == 'i')
+            input_filename = optarg;
+        else if (c == 'b')
+            user_options.batch_rows = atoll(optarg);
+        else if (c == 'B')
+            user_options.batch_bytes = atoll(optarg);
+        else if (c == 'j')
+            jobs = std::max(1, atoi(optarg));
+        else if (c == 'T')
+            relation = optarg;
+        else if (c == 'k')
+            partition_key = optarg;
+        else if (c == 'K')
+            partition_bounds.push_back(optarg);
+        else if (c == 1000)
+            user_options.raw_socket = true;
+        else if (c == 1001)
+            user_options.numeric_precision = atoi(optarg);
+        else if (c == 1002)
+            user_options.numeric_scale = atoi(optarg);
+        else if (c == 1003)
+            user_options.dictionary_columns.push_back(optarg);
+        else if (c == 1004)
+            user_options.auto_dictionary = true;
+        else if (c == 1005)
+            user_options.tee_filename = optarg;
+        else if (c == 1006)
+            writer_options.format = optarg;
+        else if (c == 1007)
+            writer_options.compression = optarg;
+        else if (c == 1008)
+            user_options.type_cache_filename = optarg;
+        else if (c == 1009)
+            user_options.type_cache_filename.clear();
+        else if (c == 1010)
+            stats_filename = optarg;
+        else if (c == 1011)
+            progress_interval = atof(optarg);
+        else if (c == 1012)
+            memory_pool_name = optarg;
+        else if (c == 1013)
+            user_options.memory_limit = atoll(optarg);
+        else if (c == 1014)
+            writer_options.max_queued_batches = std::max(0, atoi(optarg));
+        else if (c == 1015)
+            writer_options.use_threads = false;
+        else if (c == 1016)
+            manifest_filename = optarg;
+        else if (c == 1017)
+            job_threads = std::max(1, atoi(optarg));
+        else if (c == 1018)
+            shared_snapshot = true;
+        else if (c == 1019)
+            writer_options.max_file_rows = atoll(optarg);
+        else if (c == 1020)
+            writer_options.max_file_bytes = atoll(optarg);
+        else if (c == 1021) {
+            // column or column:unit
+            std::string spec = optarg;
+            auto colon = spec.rfind(':');
+            writer_options.partition_column = spec.substr(0, colon);
+            if (colon != std::string::npos)
+                writer_options.partition_unit = spec.substr(colon + 1);
+        } else if (c == 1022)
+            writer_options.max_open_files = std::max(1, atoi(optarg));
+        else if (c == 1023)
+            user_options.string_views = true;
+        else if (c == 1024) {
+            // column=d1xd2x..., * for a variable dimension
+            std::string spec = optarg;
+            auto equal = spec.rfind('=');
+            std::vector<int32_t> sizes;
+            for (size_t start = equal + 1; equal != std::string::npos;) {
+                auto end = spec.find('x', start);
+                auto dim = spec.substr(start, end - start);
+                sizes.push_back(dim == "*" ? -1 : atoi(dim.c_str()));
+                if (sizes.back() == 0 || end == std::string::npos)
+                    break;
+                start = end + 1;
+            }
+            if (sizes.empty() || sizes.back() == 0 || sizes.size() > 6) {
+                std::cerr << "invalid array shape: " << spec << std::endl;
+                exit(1);
+            }
+            user_options.array_shapes[spec.substr(0, equal)] = sizes;
+        } else if (c == 1025)
+            user_options.decode_threads = std::max(1, atoi(optarg));
+        else if (c == 1026)
+            user_options.ordered_batches = false;
+        else if (c == 1027)
+            writer_options.auto_encodings = true;
+        else if (c == 1028)
+            writer_options.page_index = true;
+        else if (c == 1029) {
+#if ARROW_VERSION_MAJOR < 22
+            std::cerr << "--bloom-filter needs Arrow 22 or later" << std::endl;
+            exit(1);
+#endif
+            writer_options.bloom_filter_columns.push_back(optarg);
+        } else {
+            fprintf(
+                stderr,
+                "usage: pg2arrow -d conninfo (-q query | -T relation | -i copy_file) "
+                "-o output_file [--format parquet|ipc-stream|ipc-file|feather] "
+                "[--compression none|lz4|zstd] "
+                "[-b batch_rows] [-B batch_bytes] [-j jobs] "
+                "[-k partition_key -K bound [-K bound ...]] [--raw-socket] "
+                "[--numeric-precision p] [--numeric-scale s] "
+                "[--dictionary column ...] [--auto-dictionary] [--tee copy_file] "
+                "[--type-cache file | --no-type-cache] [--stats-json file] "
+                "[--progress seconds] [--memory-pool default|arena] "
+                "[--memory-limit bytes] [--write-queue batches] "
+                "[--no-write-threads] "
+                "[--manifest file [--job-threads n] [--shared-snapshot]] "
+                "[--max-file-rows n] [--max-file-bytes n] "
+                "[--partition-by column[:hour|day|month|year]] "
+                "[--max-open-files n] [--string-views] "
+                "[--array-shape column=d1[xd2...] ...] "
+                "[--decode-threads n [--unordered]] [--auto-encoding] "
+                "[--page-index] [--bloom-filter column ...]");
             exit(0);
         }
     }
+
+    user_options.column_stats = !stats_filename.empty();
+
+    if (relation != nullptr) {
+        relation_query = std::string("select * from ") + relation;
+        query = relation_query.c_str();
+    }
+
+    // Workers must agree on the output schema, which automatic dictionaries
+    // only settle on their own first batch
+    if (jobs > 1 && user_options.auto_dictionary) {
+        std::cerr << "--auto-dictionary is ignored with parallel jobs" << std::endl;
+        user_options.auto_dictionary = false;
+    }
+    if (user_options.decode_threads > 1 && user_options.auto_dictionary) {
+        std::cerr << "--auto-dictionary is ignored with decode threads" << std::endl;
+        user_options.auto_dictionary = false;
+    }
+    // Parallel jobs already decode on as many threads
+    if (jobs > 1 && user_options.decode_threads > 1) {
+        std::cerr << "--decode-threads is ignored with parallel jobs" << std::endl;
+        user_options.decode_threads = 1;
+    }
+    if (memory_pool_name != "default" && memory_pool_name != "arena") {
+        std::cerr << "unknown memory pool: " << memory_pool_name << std::endl;
+        exit(1);
+    }
+    if (jobs > 1 && !user_options.tee_filename.empty()) {
+        std::cerr << "--tee is ignored with parallel jobs" << std::endl;
+        user_options.tee_filename.clear();
+    }
+}
+
+// The schema of a COPY file saved with --tee goes next to it, serialized as an
+// Arrow IPC schema message
+static std::string SchemaFilename(const std::string& copy_filename) {
+    return copy_filename + ".schema";
+}
+
+static arrow::Status WriteSchema(
+    const arrow::Schema& schema,
+    const std::string& filename) {
+    ARROW_ASSIGN_OR_RAISE(auto buffer, arrow::ipc::SerializeSchema(schema));
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::FileOutputStream::Open(filename));
+    ARROW_RETURN_NOT_OK(file->Write(buffer));
+    return file->Close();
+}
+
+static arrow::Result<std::shared_ptr<arrow::Schema>> ReadSchema(
+    const std::string& filename) {
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::ReadableFile::Open(filename));
+    arrow::ipc::DictionaryMemo dictionary_memo;
+    return arrow::ipc::ReadSchema(file.get(), &dictionary_memo);
+}
+
+// Splits the export into slices that parallel workers can COPY independently
+static arrow::Result<std::vector<std::string>> GetSlices(PGconn* conn) {
+    if (partition_key != nullptr)
+        return Pg2Arrow::SplitQueryByKey(query, partition_key, partition_bounds);
+    if (relation != nullptr)
+        return Pg2Arrow::SplitTableQuery(conn, relation, jobs);
+    return arrow::Status::Invalid(
+        "parallel export needs either a relation or a partition key");
+}
+
+// Runs `jobs` worker connections sharing `snapshot`, each one COPYing the
+// next unclaimed slice with its own PgBuilder
+static arrow::Status CopySlices(
+    const std::string& snapshot,
+    const std::vector<std::string>& slices,
+    std::shared_ptr<arrow::Schema> schema,
+    const Pg2Arrow::BatchCallback& callback,
+    Pg2Arrow::CopyStats* stats) {
+    std::atomic<size_t> next_slice(0);
+    std::vector<arrow::Status> statuses(jobs);
+    std::vector<std::thread> workers;
+
+    for (int i = 0; i < jobs; i++) {
+        workers.emplace_back([&, i]() {
+            auto conn = PQconnectdb(conninfo);
+            if (PQstatus(conn) != CONNECTION_OK) {
+                statuses[i] = arrow::Status::IOError(
+                    "failed on PostgreSQL connection: ", PQerrorMessage(conn));
+                PQfinish(conn);
+                return;
+            }
+
+            statuses[i] = Pg2Arrow::ImportSnapshot(conn, snapshot);
+            Pg2Arrow::PgBuilder builder(schema, user_options);
+            for (size_t k; statuses[i].ok() && (k = next_slice++) < slices.size();)
+                statuses[i] = Pg2Arrow::CopyQuery(
+                    conn, slices[k].c_str(), builder, user_options, callback,
+                    stats ? &stats[i] : nullptr);
+
+            PQclear(PQexec(conn, "END"));
+            PQfinish(conn);
+        });
+    }
+
+    arrow::Status status;
+    for (int i = 0; i < jobs; i++) {
+        workers[i].join();
+        if (status.ok())
+            status = statuses[i];
+    }
+    return status;
+}
+
+static double Seconds(int64_t ns) { return ns / 1e9; }
+
+// Sums the counters of the workers, but for the wall time of the phases, the
+// longest of any worker as they run side by side
+static void SumStats(
+    const std::vector<Pg2Arrow::CopyStats>& stats,
+    Pg2Arrow::CopyStats* total) {
+    auto add = [](Pg2Arrow::PhaseTime& to, const Pg2Arrow::PhaseTime& from) {
+        to.wall_ns = std::max<int64_t>(to.wall_ns, from.wall_ns);
+        to.cpu_ns += from.cpu_ns;
+    };
+    auto add_columns = [](std::vector<int64_t>& to, const std::vector<int64_t>& from) {
+        to.resize(std::max(to.size(), from.size()), 0);
+        for (size_t i = 0; i < from.size(); i++)
+            to[i] += from[i];
+    };
+    for (auto& s : stats) {
+        add(total->receive, s.receive);
+        add(total->decode, s.decode);
+        add(total->flush, s.flush);
+        add(total->write, s.write);
+        total->rows += s.rows;
+        total->bytes += s.bytes;
+        total->batches += s.batches;
+        add_columns(total->column_bytes, s.column_bytes);
+        add_columns(total->column_memory, s.column_memory);
+    }
+}
+
+// Prints the number of rows and bytes exported so far every
+// `progress_interval` seconds until `done`
+static void PrintProgress(
+    const std::vector<Pg2Arrow::CopyStats>& stats,
+    std::mutex& mutex,
+    std::condition_variable& cv,
+    const bool& done) {
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration<double>(progress_interval);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!cv.wait_for(lock, interval, [&]() { return done; })) {
+        int64_t rows = 0, bytes = 0;
+        for (auto& s : stats) {
+            rows += s.rows;
+            bytes += s.bytes;
+        }
+        double elapsed =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                .count();
+        fprintf(
+            stderr, "progress: %.1fs %lld rows %.1f MB, %.0f rows/s %.1f MB/s\n",
+            elapsed, (long long)rows, bytes / 1e6, rows / elapsed,
+            bytes / 1e6 / elapsed);
+    }
+}
+
+static std::string JsonString(const std::string& value) {
+    std::string json = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        } else {
+            json += c;
+        }
+    }
+    return json + "\"";
+}
+
+static std::string PhaseJson(double wall, double cpu) {
+    std::ostringstream json;
+    json << "{\"wall_seconds\": " << wall << ", \"cpu_seconds\": " << cpu << "}";
+    return json.str();
+}
+
+// Run report: time per phase, throughput, per column bytes and memory, and
+// memory pool usage
+static arrow::Status WriteStats(
+    const Pg2Arrow::CopyStats& stats,
+    const arrow::Schema& schema,
+    double schema_seconds,
+    double wall_seconds) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    auto phase = [](const Pg2Arrow::PhaseTime& time) {
+        return PhaseJson(Seconds(time.wall_ns), Seconds(time.cpu_ns));
+    };
+    auto pool = user_options.memory_pool;
+
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"wall_seconds\": " << wall_seconds << ",\n";
+    json << "  \"cpu_seconds\": " << cpu_seconds << ",\n";
+    json << "  \"phases\": {\n";
+    json << "    \"schema\": " << PhaseJson(schema_seconds, 0) << ",\n";
+    json << "    \"receive\": " << phase(stats.receive) << ",\n";
+    json << "    \"decode\": " << phase(stats.decode) << ",\n";
+    json << "    \"flush\": " << phase(stats.flush) << ",\n";
+    json << "    \"write\": " << phase(stats.write) << "\n";
+    json << "  },\n";
+    json << "  \"rows\": " << stats.rows << ",\n";
+    json << "  \"bytes\": " << stats.bytes << ",\n";
+    json << "  \"batches\": " << stats.batches << ",\n";
+    json << "  \"rows_per_second\": " << stats.rows / wall_seconds << ",\n";
+    json << "  \"bytes_per_second\": " << stats.bytes / wall_seconds << ",\n";
+    json << "  \"columns\": [";
+    for (int i = 0; i < schema.num_fields(); i++) {
+        auto& field = schema.field(i);
+        json << (i > 0 ? "," : "") << "\n    {\"name\": " << JsonString(field->name())
+             << ", \"type\": " << JsonString(field->type()->ToString())
+             << ", \"bytes\": "
+             << (i < stats.column_bytes.size() ? stats.column_bytes[i] : 0)
+             << ", \"memory\": "
+             << (i < stats.column_memory.size() ? stats.column_memory[i] : 0) << "}";
+    }
+    json << "\n  ],\n";
+    json << "  \"memory_pool\": {\"backend\": " << JsonString(pool->backend_name())
+         << ", \"peak_bytes\": " << pool->max_memory()
+         << ", \"allocated_bytes\": " << pool->total_bytes_allocated() << "}\n";
+    json << "}\n";
+
+    if (stats_filename == "-") {
+        std::cerr << json.str();
+        return arrow::Status::OK();
+    }
+    std::ofstream file(stats_filename);
+    file << json.str();
+    file.close();
+    return file.fail() ? arrow::Status::IOError("unable to write ", stats_filename)
+                       : arrow::Status::OK();
+}
+
+// Runs the exports listed in the manifest over a pool of `jobs` connections
+static int RunManifest() {
+    auto entries = Pg2Arrow::ReadManifest(manifest_filename);
+    if (!entries.ok()) {
+        std::cerr << entries.status().message() << std::endl;
+        return 1;
+    }
+
+    Pg2Arrow::JobOptions job_options;
+    job_options.conninfo = conninfo;
+    job_options.connections = jobs;
+    job_options.threads = job_threads;
+    job_options.shared_snapshot = shared_snapshot;
+    job_options.user_options = user_options;
+    job_options.writer_options = writer_options;
+    auto status = Pg2Arrow::RunJob(*entries, job_options);
+    if (!status.ok()) {
+        std::cerr << status.message() << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv) {
     parse_options(argc, argv);
+    auto start_time = std::chrono::steady_clock::now();
 
-    auto conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK)
-        std::cout << "failed on PostgreSQL connection: " << PQerrorMessage(conn)
-                  << std::endl;
+    // Everything goes through one pool, whose cache the memory limit bounds
+    std::unique_ptr<arrow::MemoryPool> arena_pool;
+    if (memory_pool_name == "arena") {
+        arena_pool = Pg2Arrow::MakeArenaMemoryPool(
+            arrow::default_memory_pool(), user_options.memory_limit);
+        user_options.memory_pool = arena_pool.get();
+    } else {
+        user_options.memory_pool = arrow::default_memory_pool();
+    }
+    writer_options.memory_pool = user_options.memory_pool;
 
-    auto res = PQexec(conn, "BEGIN READ ONLY");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        std::cout << "unable to begin transaction: " << PQresultErrorMessage(res)
-                  << std::endl;
-    PQclear(res);
+    writer_options.max_row_group_length = user_options.batch_rows;
 
-    auto schema = Pg2Arrow::GetQuerySchema(conn, query);
-    Pg2Arrow::PgBuilder builder(schema);
+    if (manifest_filename != nullptr)
+        return RunManifest();
 
-    CopyQuery(conn, query, builder);
+    // Offline decoding only needs the database for files without their schema
+    std::shared_ptr<arrow::Schema> schema;
+    if (input_filename != nullptr) {
+        auto file_schema = ReadSchema(SchemaFilename(input_filename));
+        if (file_schema.ok())
+            schema = *file_schema;
+    }
 
-    res = PQexec(conn, "END");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        std::cout << "unable to end transaction: " << PQresultErrorMessage(res)
-                  << std::endl;
-    PQclear(res);
+    PGconn* conn = nullptr;
+    std::string snapshot;
+    if (!schema) {
+        conn = PQconnectdb(conninfo);
+        if (PQstatus(conn) != CONNECTION_OK)
+            std::cerr << "failed on PostgreSQL connection: " << PQerrorMessage(conn)
+                      << std::endl;
 
-    PQfinish(conn);
+        // Parallel workers all import the leader's snapshot so that together
+        // they see a single consistent state of the database
+        if (jobs > 1 && input_filename == nullptr) {
+            PARQUET_ASSIGN_OR_THROW(snapshot, Pg2Arrow::ExportSnapshot(conn));
+        } else {
+            auto res = PQexec(conn, "BEGIN READ ONLY");
+            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                std::cerr << "unable to begin transaction: "
+                          << PQresultErrorMessage(res) << std::endl;
+            PQclear(res);
+        }
 
-    std::shared_ptr<arrow::RecordBatch> batch;
-    auto status = builder.Flush(&batch);
-    auto table = arrow::Table::FromRecordBatches({batch}).ValueOrDie();
+        PARQUET_ASSIGN_OR_THROW(
+            schema, Pg2Arrow::GetQuerySchema(conn, query, user_options));
 
-    std::shared_ptr<arrow::io::FileOutputStream> output_file;
-    PARQUET_ASSIGN_OR_THROW(
-        output_file, arrow::io::FileOutputStream::Open(output_filename));
+        // Size the builders from what the planner knows, which in turn comes
+        // from pg_class.reltuples and the column average widths
+        int64_t rows, width;
+        if (Pg2Arrow::EstimateQuerySize(conn, query, &rows, &width).ok()) {
+            user_options.expected_rows = rows;
+            user_options.expected_width = width;
+        }
+    }
 
-    PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(
-        *table, arrow::default_memory_pool(), output_file, table->num_rows()));
+    if (!user_options.tee_filename.empty() && input_filename == nullptr)
+        PARQUET_THROW_NOT_OK(
+            WriteSchema(*schema, SchemaFilename(user_options.tee_filename)));
 
-    return 0;
+    double schema_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time)
+            .count();
+
+    std::unique_ptr<Pg2Arrow::BatchWriter> writer;
+    PARQUET_ASSIGN_OR_THROW(writer, Pg2Arrow::MakeBatchWriter(writer_options));
+
+    // Each flushed batch goes straight to the output. The writer is opened with
+    // the schema of the first batch, as dictionary encoded columns may have
+    // gone back to plain strings by then.
+    std::shared_ptr<arrow::Schema> output_schema;
+    std::mutex writer_mutex;
+    auto write_batch = [&](std::shared_ptr<arrow::RecordBatch> batch) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        if (!output_schema)
+            ARROW_RETURN_NOT_OK(writer->Open(batch->schema()));
+        output_schema = batch->schema();
+        return writer->Write(std::move(batch));
+    };
+
+    // One set of counters per worker, read by the progress thread as they go
+    std::vector<Pg2Arrow::CopyStats> stats(jobs);
+    bool collect_stats = !stats_filename.empty() || progress_interval > 0;
+
+    std::mutex progress_mutex;
+    std::condition_variable progress_cv;
+    bool done = false;
+    std::thread progress_thread;
+    if (progress_interval > 0)
+        progress_thread = std::thread(
+            PrintProgress, std::cref(stats), std::ref(progress_mutex),
+            std::ref(progress_cv), std::cref(done));
+
+    arrow::Status status;
+    if (input_filename != nullptr && user_options.decode_threads > 1) {
+        auto stream = Pg2Arrow::OpenCopyFile(input_filename);
+        status = stream.ok() ? Pg2Arrow::ParallelCopyRows(
+                                   **stream, schema, user_options, write_batch,
+                                   collect_stats ? &stats[0] : nullptr)
+                             : stream.status();
+    } else if (input_filename != nullptr) {
+        Pg2Arrow::PgBuilder builder(schema, user_options);
+        auto stream = Pg2Arrow::OpenCopyFile(input_filename);
+        status = stream.ok() ? Pg2Arrow::CopyRows(
+                                   **stream, builder, user_options, write_batch,
+                                   collect_stats ? &stats[0] : nullptr)
+                             : stream.status();
+    } else if (jobs > 1) {
+        auto slices = GetSlices(conn);
+        status = slices.ok()
+                     ? CopySlices(
+                           snapshot, *slices, schema, write_batch,
+                           collect_stats ? stats.data() : nullptr)
+                     : slices.status();
+    } else if (user_options.decode_threads > 1) {
+        status = Pg2Arrow::ParallelCopyQuery(
+            conn, query, schema, user_options, write_batch,
+            collect_stats ? &stats[0] : nullptr);
+    } else {
+        Pg2Arrow::PgBuilder builder(schema, user_options);
+        status = Pg2Arrow::CopyQuery(
+            conn, query, builder, user_options, write_batch,
+            collect_stats ? &stats[0] : nullptr);
+    }
+    if (!status.ok())
+        std::cerr << status.message() << std::endl;
+
+    if (conn != nullptr) {
+        auto res = PQexec(conn, "END");
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            std::cerr << "unable to end transaction: " << PQresultErrorMessage(res)
+                      << std::endl;
+        PQclear(res);
+
+        PQfinish(conn);
+    }
+
+    if (!output_schema) {
+        output_schema = Pg2Arrow::PgBuilder(schema, user_options).schema();
+        PARQUET_THROW_NOT_OK(writer->Open(output_schema));
+    }
+    PARQUET_THROW_NOT_OK(writer->Close());
+
+    if (progress_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            done = true;
+        }
+        progress_cv.notify_one();
+        progress_thread.join();
+    }
+
+    if (!stats_filename.empty()) {
+        Pg2Arrow::CopyStats total;
+        SumStats(stats, &total);
+        double wall_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time)
+                .count();
+        auto stats_status = WriteStats(
+            total, *output_schema, schema_seconds, wall_seconds);
+        if (!stats_status.ok())
+            std::cerr << stats_status.message() << std::endl;
+    }
+
+    return status.ok() ? 0 : 1;
 }
@@ -0,0 +1,99 @@
+// Open addressing hash table giving strings a dense index in insertion order,
+// used to dictionary encode string columns while decoding
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+namespace Pg2Arrow {
+
+class StringMemoTable {
+   public:
+    StringMemoTable() { Reset(); }
+
+    // Index of `value`, inserting it if needed
+    int32_t GetOrInsert(const char* value, int32_t length) {
+        uint64_t hash = Hash(value, length);
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            auto& slot = slots_[i];
+            if (slot.index < 0) {
+                slot = {hash, size()};
+                offsets_.push_back(offsets_.back() + length);
+                data_.append(value, length);
+                if (2 * offsets_.size() > slots_.size())
+                    Grow();
+                return size() - 1;
+            }
+            if (slot.hash == hash && Equals(slot.index, value, length))
+                return slot.index;
+        }
+    }
+
+    int32_t size() const { return offsets_.size() - 1; }
+    int64_t value_bytes() const { return data_.size(); }
+
+    // Values laid out like an Arrow string array
+    const std::vector<int32_t>& offsets() const { return offsets_; }
+    const std::string& data() const { return data_; }
+
+    void Reset() {
+        slots_.assign(kInitialSlots, {0, -1});
+        offsets_.assign(1, 0);
+        data_.clear();
+    }
+
+   private:
+    static const size_t kInitialSlots = 1024;
+
+    struct Slot {
+        uint64_t hash;
+        int32_t index;
+    };
+
+    static inline uint64_t Mix(uint64_t h, uint64_t word) {
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+    }
+
+    static inline uint64_t Hash(const char* value, int32_t length) {
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ length;
+        for (; length >= 8; value += 8, length -= 8) {
+            uint64_t word;
+            memcpy(&word, value, 8);
+            h = Mix(h, word);
+        }
+        uint64_t word = 0;
+        memcpy(&word, value, length);
+        return Mix(h, word);
+    }
+
+    bool Equals(int32_t index, const char* value, int32_t length) const {
+        return offsets_[index + 1] - offsets_[index] == length &&
+               memcmp(data_.data() + offsets_[index], value, length) == 0;
+    }
+
+    void Grow() {
+        std::vector<Slot> slots(2 * slots_.size(), {0, -1});
+        size_t mask = slots.size() - 1;
+        for (auto& slot : slots_) {
+            if (slot.index < 0)
+                continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].index >= 0)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+        slots_.swap(slots);
+    }
+
+    std::vector<Slot> slots_;
+    std::vector<int32_t> offsets_;
+    std::string data_;
+};
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,194 @@
+#include "pg2arrow.h"
+
+#include <cstring>
+#include <mutex>
+
+namespace Pg2Arrow {
+
+// Builders grow their buffers batch after batch to about the same sizes, then
+// hand them over to the flushed arrays, which free them once written. Keeping
+// freed buffers in size classes lets the next batch pick them up again instead
+// of going back to the system allocator, which is what makes large buffers
+// expensive: page faults and fragmentation.
+class ArenaMemoryPool : public arrow::MemoryPool {
+   public:
+    ArenaMemoryPool(arrow::MemoryPool* parent, int64_t limit)
+        : parent_(parent), limit_(limit), free_(kNumClasses) {}
+
+    ~ArenaMemoryPool() override { Trim(-1); }
+
+    arrow::Status Allocate(int64_t size, int64_t alignment, uint8_t** out) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return DoAllocate(size, alignment, out);
+    }
+
+    arrow::Status Reallocate(
+        int64_t old_size,
+        int64_t new_size,
+        int64_t alignment,
+        uint8_t** ptr) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (IsCached(old_size, alignment) && IsCached(new_size, alignment)) {
+            int64_t old_class_size, new_class_size;
+            if (SizeClass(old_size, &old_class_size) ==
+                SizeClass(new_size, &new_class_size)) {
+                total_bytes_ += std::max<int64_t>(new_size - old_size, 0);
+                num_allocations_++;
+                return arrow::Status::OK();
+            }
+        }
+
+        uint8_t* out;
+        ARROW_RETURN_NOT_OK(DoAllocate(new_size, alignment, &out));
+        memcpy(out, *ptr, std::min(old_size, new_size));
+        DoFree(*ptr, old_size, alignment);
+        *ptr = out;
+        return arrow::Status::OK();
+    }
+
+    void Free(uint8_t* buffer, int64_t size, int64_t alignment) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        DoFree(buffer, size, alignment);
+    }
+
+    void ReleaseUnused() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Trim(-1);
+        }
+        parent_->ReleaseUnused();
+    }
+
+    int64_t bytes_allocated() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+
+    int64_t max_memory() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_bytes_;
+    }
+
+    int64_t total_bytes_allocated() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return total_bytes_;
+    }
+
+    int64_t num_allocations() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return num_allocations_;
+    }
+
+    std::string backend_name() const override {
+        return "arena(" + parent_->backend_name() + ")";
+    }
+
+   private:
+    static const int kNumClasses = 4 * 57 + 1;
+    static const int64_t kAlignment = arrow::kDefaultBufferAlignment;
+
+    // Sizes are rounded up to 64 bytes, then to a quarter of their power of
+    // two, so that at most a fifth of a buffer is lost to rounding
+    static int SizeClass(int64_t size, int64_t* class_size) {
+        if (size <= 64) {
+            *class_size = 64;
+            return 0;
+        }
+        int shift = 61 - __builtin_clzll(size - 1);
+        int64_t steps = (size - 1) >> shift;
+        *class_size = (steps + 1) << shift;
+        return 4 * (shift - 4) + steps - 3;
+    }
+
+    // Inverse of SizeClass
+    static int64_t ClassSize(int size_class) {
+        if (size_class == 0)
+            return 64;
+        int shift = (size_class - 1) / 4 + 4;
+        int64_t steps = (size_class - 1) % 4 + 4;
+        return (steps + 1) << shift;
+    }
+
+    // Empty and over aligned buffers go straight to the parent pool
+    static bool IsCached(int64_t size, int64_t alignment) {
+        return size > 0 && alignment <= kAlignment;
+    }
+
+    // Cached buffers are only kept up to the limit, or up to the peak usage
+    // without one
+    int64_t Capacity() const { return limit_ > 0 ? limit_ : max_bytes_; }
+
+    arrow::Status DoAllocate(int64_t size, int64_t alignment, uint8_t** out) {
+        int64_t class_size = size;
+        if (IsCached(size, alignment)) {
+            auto& buffers = free_[SizeClass(size, &class_size)];
+            if (!buffers.empty()) {
+                *out = buffers.back();
+                buffers.pop_back();
+                cached_bytes_ -= class_size;
+            } else {
+                Trim(class_size);
+                ARROW_RETURN_NOT_OK(parent_->Allocate(class_size, kAlignment, out));
+            }
+        } else {
+            ARROW_RETURN_NOT_OK(parent_->Allocate(size, alignment, out));
+        }
+
+        bytes_ += class_size;
+        max_bytes_ = std::max(max_bytes_, bytes_);
+        total_bytes_ += size;
+        num_allocations_++;
+        return arrow::Status::OK();
+    }
+
+    void DoFree(uint8_t* buffer, int64_t size, int64_t alignment) {
+        if (!IsCached(size, alignment)) {
+            bytes_ -= size;
+            parent_->Free(buffer, size, alignment);
+            return;
+        }
+
+        int64_t class_size;
+        int size_class = SizeClass(size, &class_size);
+        bytes_ -= class_size;
+        if (bytes_ + cached_bytes_ + class_size > Capacity()) {
+            parent_->Free(buffer, class_size, kAlignment);
+            return;
+        }
+        free_[size_class].push_back(buffer);
+        cached_bytes_ += class_size;
+    }
+
+    // Gives cached buffers back to the parent pool, largest first, until
+    // `size` more bytes fit below the capacity (all of them when negative)
+    void Trim(int64_t size) {
+        for (int i = kNumClasses - 1; i >= 0 && cached_bytes_ > 0; i--) {
+            auto& buffers = free_[i];
+            while (!buffers.empty() &&
+                   (size < 0 || bytes_ + cached_bytes_ + size > Capacity())) {
+                int64_t class_size = ClassSize(i);
+                parent_->Free(buffers.back(), class_size, kAlignment);
+                buffers.pop_back();
+                cached_bytes_ -= class_size;
+            }
+        }
+    }
+
+    arrow::MemoryPool* parent_;
+    int64_t limit_;
+    mutable std::mutex mutex_;
+    std::vector<std::vector<uint8_t*>> free_;
+    int64_t cached_bytes_ = 0;
+    int64_t bytes_ = 0;
+    int64_t max_bytes_ = 0;
+    int64_t total_bytes_ = 0;
+    int64_t num_allocations_ = 0;
+};
+
+std::unique_ptr<arrow::MemoryPool> MakeArenaMemoryPool(
+    arrow::MemoryPool* parent,
+    int64_t limit) {
+    return std::make_unique<ArenaMemoryPool>(parent, limit);
+}
+
+}  // namespace Pg2Arrow
@@ -3,29 +3,484 @@
 #include <arrow/api.h>
 #include <libpq-fe.h>
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ArrowArrayStream;
 
 namespace Pg2Arrow {
 
-class DecoderMap;
-typedef int32_t (*FieldDecoder)(DecoderMap&, arrow::ArrayBuilder*, const char*);
+struct DecodeNode;
+typedef int32_t (*FieldDecoder)(const DecodeNode&, const char*);
+
+// Field metadata of enums holding their labels in sort order, null separated.
+// Their dictionary is made of these labels in every batch.
+inline constexpr char kEnumLabelsKey[] = "pg2arrow.enum_labels";
+
+// Type specific data of a decoder, like the scale of a numeric
+struct DecoderState {
+    virtual ~DecoderState() = default;
+};
+
+// A builder of the decode plan along with its decoder and child nodes (the list
+// element or the struct fields), which are stored contiguously
+struct DecodeNode {
+    FieldDecoder decoder;
+    arrow::ArrayBuilder* builder;
+    const DecodeNode* children;
+    int32_t num_children;
+    DecoderState* state;
+};
+
+// Decodes one top level field for a block of rows, the field of row `i`
+// starting at `rows[i] + offsets[i * step]`. `values` and `valid` are scratch
+// space for one 8 bytes word and one byte per row.
+typedef void (*ColumnDecoder)(
+    const DecodeNode& node,
+    const char* const* rows,
+    const int32_t* offsets,
+    int64_t step,
+    int64_t num_rows,
+    void* values,
+    uint8_t* valid);
 
-class DecoderMap : public std::map<arrow::ArrayBuilder*, FieldDecoder> {};
+struct UserOptions {
+    // Flush a record batch once it holds that many rows (0 means no limit)
+    int64_t batch_rows = 0;
+    // Flush a record batch once that many bytes of COPY data went into it
+    // (0 means no limit)
+    int64_t batch_bytes = 0;
+    // Read the COPY stream straight from the connection socket instead of going
+    // through PQgetCopyData. Ignored on SSL or GSS encrypted connections.
+    bool raw_socket = false;
+    // Planner estimates of the number of rows and of their size in bytes, used
+    // to reserve builder capacity up front (0 means unknown)
+    int64_t expected_rows = 0;
+    int64_t expected_width = 0;
+    // Decimal precision and scale of numerics declared without a typmod
+    int32_t numeric_precision = 38;
+    int32_t numeric_scale = 9;
+    // Top level string columns to dictionary encode
+    std::vector<std::string> dictionary_columns;
+    // Dictionary encode every top level string column, going back to plain
+    // strings for those crossing one of the limits below before the first batch
+    bool auto_dictionary = false;
+    // Limits on the number of distinct values and on their total size past
+    // which a dictionary is dropped. Dictionaries of columns that already went
+    // out as such are only reset, at the next flush.
+    int64_t dictionary_max_size = 1 << 16;
+    int64_t dictionary_max_bytes = 16 << 20;
+    // Also save the COPY stream of CopyQuery to this binary COPY file
+    std::string tee_filename;
+    // File caching the catalog description of the types met by GetQuerySchema
+    // (empty means no cache)
+    std::string type_cache_filename;
+    // Count the COPY bytes and the memory of every column in PgBuilder
+    bool column_stats = false;
+    // Pool of the builders and of the batches they flush (null means
+    // arrow::default_memory_pool())
+    arrow::MemoryPool* memory_pool = nullptr;
+    // Flush a record batch early once its builders hold that many bytes, rather
+    // than running out of memory (0 means no limit)
+    int64_t memory_limit = 0;
+    // Decode the top level string and binary columns that are not dictionary
+    // encoded into utf8_view and binary_view arrays. Long values point into
+    // the COPY data instead of being copied, when the stream hands it over
+    // (see CopyStream::buffer). Needs Arrow 15 or later.
+    bool string_views = false;
+    // Dimensions of the arrays of top level columns, -1 for a variable one:
+    // their lists nest that many times, with a fixed size where given. Arrays
+    // of another shape are decoded as nulls.
+    std::map<std::string, std::vector<int32_t>> array_shapes;
+    // Threads decoding a single COPY stream in ParallelCopyRows, each with a
+    // PgBuilder of its own
+    int decode_threads = 1;
+    // Hand the batches of ParallelCopyRows over in stream order rather than as
+    // soon as they are decoded
+    bool ordered_batches = true;
+};
+
+// Time spent in a phase, in nanoseconds: wall time during which any thread
+// was in it, so that threads in it together count once, and the CPU time of
+// all of them
+struct PhaseTime {
+    std::atomic<int64_t> wall_ns{0};
+    std::atomic<int64_t> cpu_ns{0};
+
+    // Threads in the phase, and since when one was
+    std::mutex mutex;
+    int active = 0;
+    int64_t start_ns = 0;
+};
+
+// Counters updated by CopyRows as it goes, which other threads may read while
+// it runs. The column counters are only filled in at the end of the stream.
+struct CopyStats {
+    // Waiting for COPY data (PQgetCopyData or recv), decoding rows, flushing
+    // builders and handing batches over to the callback
+    PhaseTime receive;
+    PhaseTime decode;
+    PhaseTime flush;
+    PhaseTime write;
+
+    std::atomic<int64_t> rows{0};
+    std::atomic<int64_t> bytes{0};
+    std::atomic<int64_t> batches{0};
+
+    // COPY bytes decoded and size of the largest flushed array of every top
+    // level column, with UserOptions::column_stats
+    std::vector<int64_t> column_bytes;
+    std::vector<int64_t> column_memory;
+};
+
+typedef std::function<arrow::Status(std::shared_ptr<arrow::RecordBatch>)>
+    BatchCallback;
 
 class PgBuilder {
    public:
-    PgBuilder(std::shared_ptr<arrow::Schema> schema);
+    PgBuilder(
+        std::shared_ptr<arrow::Schema> schema,
+        const UserOptions& options = UserOptions());
     int32_t Append(const char* cursor);
+
+    // Decodes a block of rows column by column rather than row by row and
+    // returns the number of rows appended
+    int64_t AppendRows(const char* const* rows, int64_t num_rows);
+
     arrow::Status Flush(std::shared_ptr<arrow::RecordBatch>* batch);
 
+    // Schema of the flushed batches, where dictionary encoded columns differ
+    // from the input schema. Fixed once the first batch is flushed.
+    std::shared_ptr<arrow::Schema> schema() const { return schema_; }
+
+    // Rows and COPY bytes appended since the last flush
+    int64_t num_rows() const { return num_rows_; }
+    int64_t num_bytes() const { return num_bytes_; }
+    // Memory reserved by the builders and dictionaries for those rows, which
+    // UserOptions::memory_limit applies to
+    int64_t memory_size() const;
+
+    // Per column COPY bytes appended and largest flushed array size, counted
+    // with UserOptions::column_stats
+    const std::vector<int64_t>& column_bytes() const { return column_bytes_; }
+    const std::vector<int64_t>& column_memory() const { return column_memory_; }
+
+    arrow::MemoryPool* memory_pool() const { return pool_; }
+
+    // Buffer holding the rows appended next, which view columns keep and point
+    // into. Values outside of it, or all of them when it is null, are copied.
+    void SetBuffer(const std::shared_ptr<arrow::Buffer>& buffer);
+
+    // Makes room for `num_rows` more rows in the builders of the fields that
+    // get exactly one value per row, which can then be appended unchecked
+    void Reserve(int64_t num_rows);
+
    protected:
-    std::unique_ptr<arrow::RecordBatchBuilder> builder_;
-    std::vector<std::pair<FieldDecoder, arrow::ArrayBuilder*>> field_builders_;
-    DecoderMap decoders_;
+    static const int64_t kDefaultReserveRows = 1 << 16;
+
+    void CompilePlan();
+    void SetupDictionaries(const UserOptions& options);
+    void SetupViews(const UserOptions& options);
+    // Switches the dictionary columns over their limits to plain strings
+    void CheckDictionaries();
+    arrow::Result<std::shared_ptr<arrow::Array>> FinishColumn(int32_t i);
+
+    arrow::MemoryPool* pool_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::vector<std::unique_ptr<arrow::ArrayBuilder>> builders_;
+    // Flat decode plan, starting with one node per top level field
+    std::vector<DecodeNode> plan_;
+    std::vector<int32_t> reserved_nodes_;
+    std::vector<std::unique_ptr<DecoderState>> states_;
+    // Average value size of variable width nodes
+    std::vector<int64_t> value_sizes_;
+    int64_t reserve_rows_;
+
+    std::vector<ColumnDecoder> column_decoders_;
+    // Layout of rows without nulls when all fields have a fixed width, in which
+    // case fixed_row_size_ is not 0
+    std::vector<int32_t> fixed_offsets_;
+    std::vector<int32_t> fixed_sizes_;
+    int32_t fixed_row_size_;
+    // Scratch space of AppendRows
+    std::vector<int32_t> offsets_;
+    std::vector<uint64_t> values_;
+    std::vector<uint8_t> valid_;
+
+    // Top level nodes holding enum indices, their own or those of their children
+    std::vector<int32_t> enum_columns_;
+    // Top level nodes appending dictionary indices, and whether some of them
+    // may still go back to plain strings
+    std::vector<int32_t> dictionary_nodes_;
+    bool adaptive_dictionaries_ = false;
+    // Top level nodes appending views, which dictionaries going back to
+    // strings join, and the buffer they point into
+    std::vector<int32_t> view_nodes_;
+    bool string_views_ = false;
+    std::weak_ptr<arrow::Buffer> buffer_;
+
+    bool column_stats_ = false;
+    std::vector<int64_t> column_bytes_;
+    std::vector<int64_t> column_memory_;
+
+    int64_t capacity_ = 0;
+    int64_t num_rows_ = 0;
+    int64_t num_bytes_ = 0;
 };
 
-std::shared_ptr<arrow::Schema> GetQuerySchema(PGconn* conn, const char* query);
+// Fails when the query cannot be prepared, leaving a transaction it runs in
+// aborted
+arrow::Result<std::shared_ptr<arrow::Schema>> GetQuerySchema(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options = UserOptions());
+
+// Gets the planner estimates of the number of rows of `query` and of their
+// average width in bytes
+arrow::Status EstimateQuerySize(
+    PGconn* conn,
+    const char* query,
+    int64_t* rows,
+    int64_t* width);
+
+// Rows of a binary COPY, without the file header, handed out in runs
+class CopyStream {
+   public:
+    virtual ~CopyStream() = default;
+
+    // Fills `rows` with the next run of rows, which stay valid until the next
+    // call. `rows` is left empty once the stream is over.
+    virtual arrow::Status Next(std::vector<const char*>* rows) = 0;
+
+    // Buffer holding the rows of the last call to Next, when the stream can
+    // hand it over. It is never written to again while referenced, so that
+    // values can point into it past the next call.
+    virtual std::shared_ptr<arrow::Buffer> buffer() const { return nullptr; }
+};
+
+// Size of the binary COPY row starting at `row`, or -1 when it runs past `end`
+// (unchecked when `end` is null)
+int64_t CopyRowSize(const char* row, const char* end);
+
+// Starts `COPY (query) TO STDOUT (FORMAT binary)` on `conn`
+arrow::Result<std::unique_ptr<CopyStream>> OpenCopyStream(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options);
+
+// COPY stream of a connection in non-blocking mode, for one thread to drive
+// several of them. Next hands out the rows received so far without waiting
+// for more: once it hands out none, wait for socket() to be readable before
+// calling it again, unless the stream is done.
+class AsyncCopyStream : public CopyStream {
+   public:
+    virtual int socket() const = 0;
+    virtual bool done() const = 0;
+};
+
+// Sends `COPY (query) TO STDOUT (FORMAT binary)` on `conn` without waiting for
+// the response. The connection is back in blocking mode once the stream is
+// done.
+arrow::Result<std::unique_ptr<AsyncCopyStream>> StartCopyStream(
+    PGconn* conn,
+    const char* query);
+
+// Maps a file written by `COPY ... TO 'file' (FORMAT binary)`, whose rows are
+// then decoded in place
+arrow::Result<std::unique_ptr<CopyStream>> OpenCopyFile(const char* filename);
+
+// Writes the rows read from `stream` to a new binary COPY file
+arrow::Result<std::unique_ptr<CopyStream>> TeeCopyStream(
+    std::unique_ptr<CopyStream> stream,
+    const char* filename,
+    arrow::MemoryPool* pool = arrow::default_memory_pool());
+
+// Decodes the whole `stream`, handing a record batch to `callback` every time
+// one of the batch or memory limits in `options` is hit, and once more for the
+// remaining rows
+arrow::Status CopyRows(
+    CopyStream& stream,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats = nullptr);
+
+// Decodes one run of rows handed out by a CopyStream, handing a record batch
+// to `callback` every time one of the batch or memory limits in `options` is
+// hit. CopyRows goes through a whole stream this way.
+arrow::Status CopyRun(
+    const std::vector<const char*>& rows,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats = nullptr);
+
+// Decodes the whole `stream` on options.decode_threads threads, each with a
+// PgBuilder of its own over `schema`. The stream is cut at row boundaries into
+// chunks of about one batch, copied out of it unless it hands its buffer over,
+// which the threads take as they become idle. Every chunk makes one batch, or
+// more under a memory limit, handed to `callback` one at a time. Automatic
+// dictionaries are turned off, as chunks decoded apart would not agree on the
+// schema.
+arrow::Status ParallelCopyRows(
+    CopyStream& stream,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats = nullptr);
+
+// Pulls record batches out of a COPY stream, reading no more rows than needed
+// to fill the next batch, which one of the batch or memory limits in the
+// options ends
+class PgRecordBatchReader : public arrow::RecordBatchReader {
+   public:
+    // Reader over the results of `query`, `conn` staying open and idle for
+    // as long as the reader is
+    static arrow::Result<std::shared_ptr<PgRecordBatchReader>> Open(
+        PGconn* conn,
+        const char* query,
+        const UserOptions& options);
+
+    // Reader over a stream of rows of `schema`, like the one of a COPY file
+    static arrow::Result<std::shared_ptr<PgRecordBatchReader>> Open(
+        std::unique_ptr<CopyStream> stream,
+        std::shared_ptr<arrow::Schema> schema,
+        const UserOptions& options);
+
+    ~PgRecordBatchReader() override;
+
+    // Known before the first batch is read, which the reader does on opening
+    // when dictionary columns may still go back to plain strings
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override;
+
+    // Cancels the query if its results were not all read, so that the
+    // connection can be used again right away. This aborts the transaction
+    // the query runs in, if any.
+    arrow::Status Close() override;
+
+   private:
+    PgRecordBatchReader(
+        PGconn* conn,
+        std::unique_ptr<CopyStream> stream,
+        std::shared_ptr<arrow::Schema> schema,
+        const UserOptions& options);
+
+    arrow::Status Init();
+
+    PGconn* conn_;
+    std::unique_ptr<CopyStream> stream_;
+    PgBuilder builder_;
+    UserOptions options_;
+    std::shared_ptr<arrow::Schema> schema_;
+    // Run of rows from the stream, of which the first next_row_ are decoded
+    std::vector<const char*> rows_;
+    size_t next_row_ = 0;
+    std::shared_ptr<arrow::RecordBatch> first_batch_;
+    bool done_ = false;
+};
+
+// Exports a PgRecordBatchReader over the results of `query` through the Arrow
+// C stream interface, for consumers that do not link against Arrow C++
+arrow::Status ExportQueryStream(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options,
+    struct ArrowArrayStream* out);
 
 void CopyQuery(PGconn* conn, const char* query, PgBuilder& builder);
 
+// Same as above but hands a record batch to `callback` every time one of the
+// batch limits in `options` is hit, and once more for the remaining rows.
+arrow::Status CopyQuery(
+    PGconn* conn,
+    const char* query,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats = nullptr);
+
+// Same as above, the rows being decoded by ParallelCopyRows
+arrow::Status ParallelCopyQuery(
+    PGconn* conn,
+    const char* query,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats = nullptr);
+
+// Memory pool keeping the buffers freed by flushed batches in size classes, for
+// the builders of the next batches to reuse rather than going back to
+// `parent`. Cached buffers are given back to `parent` whenever keeping them
+// would bring the pool over `limit` bytes, or over its peak usage when `limit`
+// is 0. Thread safe.
+std::unique_ptr<arrow::MemoryPool> MakeArenaMemoryPool(
+    arrow::MemoryPool* parent = arrow::default_memory_pool(),
+    int64_t limit = 0);
+
+// Opens a read only repeatable read transaction and exports its snapshot
+arrow::Result<std::string> ExportSnapshot(PGconn* conn);
+
+// Opens a read only transaction seeing the same data as an exported snapshot
+arrow::Status ImportSnapshot(PGconn* conn, const std::string& snapshot);
+
+// Splits a full scan of `table` into queries over disjoint ctid block ranges
+arrow::Result<std::vector<std::string>> SplitTableQuery(
+    PGconn* conn,
+    const char* table,
+    int num_slices);
+
+// Splits `query` into queries over the disjoint ranges of `key` delimited by
+// the SQL literals in `bounds`
+std::vector<std::string> SplitQueryByKey(
+    const char* query,
+    const char* key,
+    const std::vector<std::string>& bounds);
+
+class ValueEncoder;
+
+// Encodes record batches into binary COPY rows for the columns of a table, in
+// the reverse of the mapping of GetQuerySchema
+class CopyEncoder {
+   public:
+    ~CopyEncoder();
+
+    // `target` is the schema GetQuerySchema gives for the columns to load, all
+    // of which `source` must have, and `element_types` the element type of the
+    // array columns. Only conversions that cannot lose values are supported.
+    static arrow::Result<std::unique_ptr<CopyEncoder>> Make(
+        const arrow::Schema& source,
+        const arrow::Schema& target,
+        const std::map<std::string, Oid>& element_types,
+        arrow::MemoryPool* pool = arrow::default_memory_pool());
+
+    // Rows of `batch`, without the header or trailer of the COPY data
+    arrow::Result<std::shared_ptr<arrow::Buffer>> Encode(
+        const arrow::RecordBatch& batch);
+
+   private:
+    explicit CopyEncoder(arrow::MemoryPool* pool);
+
+    arrow::MemoryPool* pool_;
+    // Column of the batches encoded by every encoder
+    std::vector<int> columns_;
+    std::vector<std::unique_ptr<ValueEncoder>> encoders_;
+    std::vector<int64_t> sizes_;
+    std::vector<char*> cursors_;
+};
+
+// Loads the batches of `reader` into the columns of `table` of the same names
+// with COPY FROM STDIN. The rows are either all loaded or none is.
+arrow::Status CopyIntoTable(
+    PGconn* conn,
+    const char* table,
+    arrow::RecordBatchReader& reader,
+    const UserOptions& options,
+    CopyStats* stats = nullptr);
+
 };  // namespace Pg2Arrow
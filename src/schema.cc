@@ -1,44 +1,212 @@
 #include "pg2arrow.h"
 
+#include "./type_cache.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <thread>
 
 namespace Pg2Arrow {
 
-std::vector<std::tuple<std::string, Oid>> GetCompositeInfo(PGconn* conn, Oid typid) {
-    char query[4096];
-    snprintf(
-        query, sizeof(query), R"(
-        SELECT
-            attnum, attname, atttypid
-        FROM
-            pg_catalog.pg_attribute a,
-            pg_catalog.pg_type t,
-            pg_catalog.pg_namespace n
-        WHERE
-            t.typnamespace = n.oid
-            AND a.atttypid = t.oid
-            AND a.attrelid = %u
-        )",
-        typid);
-
-    auto res = PQexec(conn, query);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK)
-        std::cout << "get composite descr failed: " << PQresultErrorMessage(res)
-                  << std::endl;
-
-    int nfields = PQntuples(res);
-    std::vector<std::tuple<std::string, Oid>> fields(nfields);
-
-    for (size_t i = 0; i < nfields; i++) {
-        int attnum = atoi(PQgetvalue(res, i, 0));
-        const char* attname = PQgetvalue(res, i, 1);
-        Oid atttypid = atooid(PQgetvalue(res, i, 2));
-
-        fields[attnum - 1] = {attname, atttypid};
+// Catalog xmins of a type `t`, its attributes and its enum labels
+static const std::string kTypeVersion = R"(concat_ws(':', t.xmin,
+            (SELECT string_agg(a.xmin::text, ',' ORDER BY a.attnum)
+             FROM pg_catalog.pg_attribute a
+             WHERE a.attrelid = t.typrelid AND a.attnum > 0),
+            (SELECT string_agg(e.xmin::text, ',' ORDER BY e.oid)
+             FROM pg_catalog.pg_enum e
+             WHERE e.enumtypid = t.oid)))";
+
+// Resolves a whole type tree at once: the types of $1, their array elements
+// and their composite attributes, recursively. Each type comes with one row per
+// attribute or enum label, in order.
+static const std::string kResolveTypesQuery = R"(
+    WITH RECURSIVE tree(oid) AS (
+        SELECT unnest($1::oid[])
+        UNION
+        SELECT c.oid
+        FROM tree
+        JOIN pg_catalog.pg_type t ON t.oid = tree.oid,
+        LATERAL (
+            SELECT t.typelem WHERE t.typelem <> 0
+            UNION ALL
+            SELECT a.atttypid
+            FROM pg_catalog.pg_attribute a
+            WHERE a.attrelid = t.typrelid AND a.attnum > 0 AND NOT a.attisdropped
+        ) c(oid)
+    )
+    SELECT
+        t.oid, )" + kTypeVersion + R"(, t.typname, t.typtype, t.typelem,
+        m.name, m.typid, m.typmod
+    FROM tree
+    JOIN pg_catalog.pg_type t ON t.oid = tree.oid
+    LEFT JOIN LATERAL (
+        SELECT a.attnum::float8, a.attname::text, a.atttypid, a.atttypmod
+        FROM pg_catalog.pg_attribute a
+        WHERE a.attrelid = t.typrelid AND a.attnum > 0 AND NOT a.attisdropped
+        UNION ALL
+        SELECT e.enumsortorder::float8, e.enumlabel::text, 0::oid, -1
+        FROM pg_catalog.pg_enum e
+        WHERE e.enumtypid = t.oid
+    ) m(pos, name, typid, typmod) ON true
+    ORDER BY t.oid, m.pos
+    )";
+
+// Current versions of the cached types $1, along with the system identifier
+// of the cluster
+static const std::string kTypeVersionsQuery = R"(
+    SELECT s.system_identifier::text, t.oid, )" + kTypeVersion + R"(
+    FROM pg_catalog.pg_control_system() s
+    LEFT JOIN pg_catalog.pg_type t ON t.oid = ANY($1::oid[])
+    )";
+
+static std::string FormatOidArray(const std::vector<Oid>& oids) {
+    std::string array = "{";
+    for (size_t i = 0; i < oids.size(); i++)
+        array += (i > 0 ? "," : "") + std::to_string(oids[i]);
+    return array + "}";
+}
+
+static arrow::Status ResolveTypes(
+    PGconn* conn,
+    const std::vector<Oid>& oids,
+    TypeMap* types) {
+    auto array = FormatOidArray(oids);
+    const char* values[] = {array.c_str()};
+    auto res = PQexecParams(
+        conn, kResolveTypesQuery.c_str(), 1, nullptr, values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        auto status = arrow::Status::IOError(
+            "unable to resolve types: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
     }
 
+    TypeMap resolved;
+    for (int i = 0; i < PQntuples(res); i++) {
+        auto& info = resolved[atooid(PQgetvalue(res, i, 0))];
+        if (info.name.empty()) {
+            info.version = PQgetvalue(res, i, 1);
+            info.name = PQgetvalue(res, i, 2);
+            info.type = *PQgetvalue(res, i, 3);
+            info.elem = atooid(PQgetvalue(res, i, 4));
+        }
+        if (!PQgetisnull(res, i, 5))
+            info.members.push_back(
+                {PQgetvalue(res, i, 5), atooid(PQgetvalue(res, i, 6)),
+                 atoi(PQgetvalue(res, i, 7))});
+    }
+    for (auto& [oid, info] : resolved)
+        (*types)[oid] = std::move(info);
+
     PQclear(res);
-    return fields;
+    return arrow::Status::OK();
+}
+
+// Records of the type cache file are null separated fields: system
+// identifier, database, oid, version, name, type, element and number of
+// members, followed by the name, type and typmod of every member.
+TypeCache LoadTypeCache(const std::string& filename) {
+    TypeCache cache;
+    std::ifstream file(filename, std::ios::binary);
+    // A last field without its terminator is cut short
+    std::vector<std::string> fields;
+    for (std::string field; std::getline(file, field, '\0') && !file.eof();)
+        fields.push_back(field);
+
+    for (size_t i = 0; i + 8 <= fields.size();) {
+        TypeInfo info;
+        info.version = fields[i + 3];
+        info.name = fields[i + 4];
+        info.type = fields[i + 5][0];
+        info.elem = atooid(fields[i + 6].c_str());
+        int num_members = atoi(fields[i + 7].c_str());
+        if (num_members < 0)
+            return {};
+        if ((size_t)num_members > (fields.size() - i - 8) / 3)
+            break;
+        for (int j = 0; j < num_members; j++) {
+            auto member = &fields[i + 8 + 3 * j];
+            info.members.push_back(
+                {member[0], atooid(member[1].c_str()), atoi(member[2].c_str())});
+        }
+        cache[{fields[i], fields[i + 1]}][atooid(fields[i + 2].c_str())] =
+            std::move(info);
+        i += 8 + 3 * num_members;
+    }
+    return cache;
+}
+
+// Written to a temporary file first so that concurrent runs never see a
+// partial cache
+void SaveTypeCache(const std::string& filename, const TypeCache& cache) {
+    std::error_code error;
+    auto path = std::filesystem::path(filename);
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path(), error);
+
+    // Threads of a job may save the cache at the same time
+    auto tmp_filename = filename + "." + std::to_string(getpid()) + "." +
+                        std::to_string(std::hash<std::thread::id>()(
+                            std::this_thread::get_id()));
+    std::ofstream file(tmp_filename, std::ios::binary);
+    auto write = [&](const std::string& field) { file << field << '\0'; };
+    for (auto& [key, types] : cache) {
+        for (auto& [oid, info] : types) {
+            write(key.first);
+            write(key.second);
+            write(std::to_string(oid));
+            write(info.version);
+            write(info.name);
+            write(std::string(1, info.type));
+            write(std::to_string(info.elem));
+            write(std::to_string(info.members.size()));
+            for (auto& member : info.members) {
+                write(member.name);
+                write(std::to_string(member.typid));
+                write(std::to_string(member.typmod));
+            }
+        }
+    }
+    file.close();
+
+    if (file.fail() || rename(tmp_filename.c_str(), filename.c_str()) != 0)
+        std::filesystem::remove(tmp_filename, error);
+}
+
+// Whether `types` holds the whole tree of `typid`
+static bool HasTypeTree(const TypeMap& types, Oid typid) {
+    auto it = types.find(typid);
+    if (it == types.end())
+        return false;
+    auto& info = it->second;
+    if (info.elem != 0 && !HasTypeTree(types, info.elem))
+        return false;
+    if (info.type == 'c') {
+        for (auto& member : info.members) {
+            if (!HasTypeTree(types, member.typid))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Result of the only command of a pipeline segment
+static PGresult* GetPipelineResult(PGconn* conn) {
+    auto res = PQgetResult(conn);
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+        // End of command, then the sync point
+        while (auto next = PQgetResult(conn))
+            PQclear(next);
+        PQclear(PQgetResult(conn));
+    }
+#endif
+    return res;
 }
 
 std::map<std::string, std::shared_ptr<arrow::DataType>> kTypeMap = {
@@ -54,7 +222,6 @@ std::map<std::string, std::shared_ptr<arrow::DataType>> kTypeMap = {
     {"interval", arrow::duration(arrow::TimeUnit::MICRO)},
     {"json", arrow::utf8()},
     {"jsonb", arrow::binary()},
-    // {"numeric", arrow::decimal128(})
     {"serial2", arrow::int16()},
     {"serial4", arrow::int32()},
     {"serial8", arrow::int64()},
@@ -67,77 +234,239 @@ std::map<std::string, std::shared_ptr<arrow::DataType>> kTypeMap = {
     {"varchar", arrow::utf8()},
     {"xml", arrow::utf8()}};
 
-std::shared_ptr<arrow::DataType> GetArrowType(PGconn* conn, Oid typid) {
-    char query[4096];
-    snprintf(
-        query, sizeof(query), R"(
-        SELECT
-            typname, typtype, typelem, typrelid
-        FROM
-            pg_catalog.pg_type t,
-            pg_catalog.pg_namespace n
-        WHERE
-            t.typnamespace = n.oid
-            AND t.oid = %u
-        )",
-        typid);
-
-    auto res = PQexec(conn, query);
-    // auto status = PQresultStatus(res) != PGRES_TUPLES_OK;
-
-    std::string typname = PQgetvalue(res, 0, 0);
-    char typtype = *PQgetvalue(res, 0, 1);
-    Oid typelem = atooid(PQgetvalue(res, 0, 2));
-    Oid typrelid = atooid(PQgetvalue(res, 0, 3));
+// numeric(p, s) typmods are ((p << 16) | s) + 4, with s a signed 11 bits
+// integer. Precisions above 38 digits need a decimal256, and negative scales
+// become trailing integer digits as they are not supported by Parquet.
+std::shared_ptr<arrow::DataType> GetNumericType(
+    int typmod,
+    const UserOptions& options) {
+    int precision = options.numeric_precision;
+    int scale = options.numeric_scale;
+    if (typmod >= 4) {
+        precision = ((typmod - 4) >> 16) & 0xffff;
+        scale = (((typmod - 4) & 0x7ff) ^ 1024) - 1024;
+    }
+    if (scale < 0) {
+        precision -= scale;
+        scale = 0;
+    }
+
+    if (precision <= arrow::Decimal128Type::kMaxPrecision)
+        return arrow::decimal128(precision, scale);
 
-    PQclear(res);
+    precision = std::min(precision, arrow::Decimal256Type::kMaxPrecision);
+    return arrow::decimal256(precision, std::min(scale, precision));
+}
+
+static std::shared_ptr<arrow::Field> GetArrowField(
+    const TypeMap& types,
+    const std::string& name,
+    Oid typid,
+    int typmod,
+    const UserOptions& options);
 
-    switch (typtype) {
+std::shared_ptr<arrow::DataType> GetArrowType(
+    const TypeMap& types,
+    Oid typid,
+    int typmod,
+    const UserOptions& options) {
+    auto it = types.find(typid);
+    if (it == types.end())
+        return arrow::null();
+    auto& info = it->second;
+
+    switch (info.type) {
         case 'b': {
-            if (typelem > 0) {
-                return arrow::list(GetArrowType(conn, typelem));
+            // Arrays share the typmod of their elements
+            if (info.elem > 0) {
+                return arrow::list(
+                    GetArrowField(types, "item", info.elem, typmod, options));
+            } else if (info.name == "numeric") {
+                return GetNumericType(typmod, options);
             } else {
-                return kTypeMap[typname];
+                auto type = kTypeMap.find(info.name);
+                return type != kTypeMap.end() ? type->second : arrow::null();
             }
         } break;
 
         case 'c': {
-            auto fields_info = GetCompositeInfo(conn, typrelid);
             arrow::FieldVector fields;
-            for (size_t i = 0; i < fields_info.size(); i++) {
-                auto [field_name, field_oid] = fields_info[i];
-                fields.push_back(
-                    arrow::field(field_name, GetArrowType(conn, field_oid)));
+            for (auto& member : info.members) {
+                fields.push_back(GetArrowField(
+                    types, member.name, member.typid, member.typmod, options));
             }
             return arrow::struct_(fields);
         } break;
 
+        // Indices into the labels, as few bytes as they need
         case 'e': {
-            return arrow::dictionary(arrow::int32(), arrow::utf8());
+            auto size = info.members.size();
+            auto index_type = size <= 128     ? arrow::int8()
+                              : size <= 32768 ? arrow::int16()
+                                              : arrow::int32();
+            return arrow::dictionary(index_type, arrow::utf8());
         } break;
     }
 
     return arrow::null();
 }
 
-std::shared_ptr<arrow::Schema> GetQuerySchema(PGconn* conn, const char* query) {
-    auto descr_query = std::string(query) + " limit 0";
-    PGresult* res = PQexec(conn, descr_query.c_str());
-    if (PQresultStatus(res) != PGRES_TUPLES_OK)
-        std::cout << "get descr failed: " << PQresultErrorMessage(res) << std::endl;
+// Enum fields carry their labels, which PgBuilder decodes into a dictionary
+// fixed up front
+static std::shared_ptr<arrow::Field> GetArrowField(
+    const TypeMap& types,
+    const std::string& name,
+    Oid typid,
+    int typmod,
+    const UserOptions& options) {
+    auto type = GetArrowType(types, typid, typmod, options);
+    auto it = types.find(typid);
+    if (it == types.end() || it->second.type != 'e')
+        return arrow::field(name, type);
+
+    std::string labels;
+    for (auto& member : it->second.members) {
+        if (!labels.empty())
+            labels.push_back('\0');
+        labels += member.name;
+    }
+    return arrow::field(
+        name, type, arrow::key_value_metadata({kEnumLabelsKey}, {labels}));
+}
+
+// The query is only parsed and described, and the cached types are checked in
+// the same round trip when libpq supports pipelining. The catalog is queried
+// for the types missing from the cache, again in a single round trip.
+arrow::Result<std::shared_ptr<arrow::Schema>> GetQuerySchema(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options) {
+    bool use_cache = !options.type_cache_filename.empty();
+    TypeCache cache;
+    std::vector<Oid> cached_oids;
+    std::string database = PQdb(conn);
+    if (use_cache) {
+        cache = LoadTypeCache(options.type_cache_filename);
+        for (auto& [key, types] : cache) {
+            for (auto& [oid, info] : types) {
+                if (key.second == database)
+                    cached_oids.push_back(oid);
+            }
+        }
+    }
+    auto cached_array = FormatOidArray(cached_oids);
+    const char* values[] = {cached_array.c_str()};
+
+#ifdef LIBPQ_HAS_PIPELINING
+    PQenterPipelineMode(conn);
+    PQsendPrepare(conn, "", query, 0, nullptr);
+    PQpipelineSync(conn);
+    PQsendDescribePrepared(conn, "");
+    PQpipelineSync(conn);
+    if (use_cache) {
+        PQsendQueryParams(
+            conn, kTypeVersionsQuery.c_str(), 1, nullptr, values, nullptr, nullptr,
+            0);
+        PQpipelineSync(conn);
+    }
+    PGresult* prepare = GetPipelineResult(conn);
+    PGresult* res = GetPipelineResult(conn);
+    PGresult* versions = use_cache ? GetPipelineResult(conn) : nullptr;
+    PQexitPipelineMode(conn);
+#else
+    PGresult* prepare = PQprepare(conn, "", query, 0, nullptr);
+    PGresult* res = PQdescribePrepared(conn, "");
+    PGresult* versions = nullptr;
+    if (use_cache)
+        versions = PQexecParams(
+            conn, kTypeVersionsQuery.c_str(), 1, nullptr, values, nullptr, nullptr,
+            0);
+#endif
+    if (PQresultStatus(prepare) != PGRES_COMMAND_OK) {
+        auto status = arrow::Status::IOError(
+            "get descr failed: ", PQresultErrorMessage(prepare));
+        PQclear(prepare);
+        PQclear(res);
+        PQclear(versions);
+        return status;
+    }
+    PQclear(prepare);
+
+    // Cached types still having the same version, pg_control_system() being
+    // restricted on some servers
+    TypeMap types;
+    std::pair<std::string, std::string> key;
+    if (PQresultStatus(versions) == PGRES_TUPLES_OK && PQntuples(versions) > 0) {
+        key = {PQgetvalue(versions, 0, 0), database};
+        auto& cached = cache[key];
+        for (int i = 0; i < PQntuples(versions); i++) {
+            if (PQgetisnull(versions, i, 1))
+                continue;
+            auto it = cached.find(atooid(PQgetvalue(versions, i, 1)));
+            if (it != cached.end() &&
+                it->second.version == PQgetvalue(versions, i, 2))
+                types.insert(*it);
+        }
+    }
+    use_cache = !key.first.empty();
+    PQclear(versions);
 
     int nfields = PQnfields(res);
+    std::vector<Oid> missing;
+    for (int i = 0; i < nfields; i++) {
+        if (!HasTypeTree(types, PQftype(res, i)))
+            missing.push_back(PQftype(res, i));
+    }
+
+    if (!missing.empty()) {
+        auto status = ResolveTypes(conn, missing, &types);
+        if (!status.ok())
+            std::cerr << status.message() << std::endl;
+        else if (use_cache) {
+            cache[key] = types;
+            SaveTypeCache(options.type_cache_filename, cache);
+        }
+    }
+
     arrow::FieldVector fields(nfields);
-    for (size_t i = 0; i < nfields; i++) {
+    for (int i = 0; i < nfields; i++) {
         const char* name = PQfname(res, i);
         Oid oid = PQftype(res, i);
-        fields[i] = arrow::field(name, GetArrowType(conn, oid));
+        int typmod = PQfmod(res, i);
+        fields[i] = GetArrowField(types, name, oid, typmod, options);
     }
 
     PQclear(res);
 
-    auto schema = arrow::schema(fields);
-    return schema;
+    return arrow::schema(fields);
+}
+
+arrow::Status EstimateQuerySize(
+    PGconn* conn,
+    const char* query,
+    int64_t* rows,
+    int64_t* width) {
+    auto explain_query = std::string("EXPLAIN ") + query;
+    PGresult* res = PQexec(conn, explain_query.c_str());
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        auto status = arrow::Status::IOError(
+            "explain failed: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
+
+    // The top plan node reads like "Seq Scan on t  (cost=0.00..1.00 rows=100 width=32)"
+    std::string plan = PQntuples(res) > 0 ? PQgetvalue(res, 0, 0) : "";
+    PQclear(res);
+
+    auto rows_pos = plan.find(" rows=");
+    auto width_pos = plan.find(" width=");
+    if (rows_pos == std::string::npos || width_pos == std::string::npos)
+        return arrow::Status::Invalid("unexpected plan: ", plan);
+
+    *rows = atoll(plan.c_str() + rows_pos + 6);
+    *width = atoll(plan.c_str() + width_pos + 7);
+    return arrow::Status::OK();
 }
 
 }  // namespace Pg2Arrow
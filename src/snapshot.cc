@@ -0,0 +1,97 @@
+#include "pg2arrow.h"
+
+namespace Pg2Arrow {
+
+static arrow::Status Exec(PGconn* conn, const std::string& query) {
+    auto res = PQexec(conn, query.c_str());
+    auto status = PQresultStatus(res) == PGRES_COMMAND_OK
+                      ? arrow::Status::OK()
+                      : arrow::Status::IOError(
+                            "error in '", query, "': ", PQresultErrorMessage(res));
+    PQclear(res);
+    return status;
+}
+
+static std::string QuoteLiteral(PGconn* conn, const std::string& value) {
+    char* quoted = PQescapeLiteral(conn, value.c_str(), value.size());
+    std::string result(quoted);
+    PQfreemem(quoted);
+    return result;
+}
+
+arrow::Result<std::string> ExportSnapshot(PGconn* conn) {
+    ARROW_RETURN_NOT_OK(Exec(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY"));
+
+    auto res = PQexec(conn, "SELECT pg_export_snapshot()");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        auto status = arrow::Status::IOError(
+            "unable to export snapshot: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
+    std::string snapshot = PQgetvalue(res, 0, 0);
+    PQclear(res);
+    return snapshot;
+}
+
+arrow::Status ImportSnapshot(PGconn* conn, const std::string& snapshot) {
+    ARROW_RETURN_NOT_OK(Exec(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY"));
+    return Exec(conn, "SET TRANSACTION SNAPSHOT " + QuoteLiteral(conn, snapshot));
+}
+
+arrow::Result<std::vector<std::string>> SplitTableQuery(
+    PGconn* conn,
+    const char* table,
+    int num_slices) {
+    auto query = "SELECT pg_relation_size(" + QuoteLiteral(conn, table) +
+                 "::regclass) / current_setting('block_size')::int";
+    auto res = PQexec(conn, query.c_str());
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        auto status = arrow::Status::IOError(
+            "unable to get relation size: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
+    int64_t num_blocks = atoll(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    // The last slice is left open ended so that it also picks up pages added
+    // after we looked at the relation size
+    std::vector<std::string> slices;
+    int64_t step = (num_blocks + num_slices - 1) / num_slices;
+    for (int64_t i = 0; i < num_slices; i++) {
+        auto slice = std::string("select * from ") + table + " where ctid >= '(" +
+                     std::to_string(i * step) + ",0)'::tid";
+        if (i + 1 < num_slices)
+            slice += " and ctid < '(" + std::to_string((i + 1) * step) + ",0)'::tid";
+        slices.push_back(slice);
+    }
+    return slices;
+}
+
+std::vector<std::string> SplitQueryByKey(
+    const char* query,
+    const char* key,
+    const std::vector<std::string>& bounds) {
+    if (bounds.empty())
+        return {query};
+
+    // NULL keys go to the first slice
+    auto base = std::string("select * from (") + query + ") _pg2arrow where ";
+    auto column = std::string(key);
+
+    std::vector<std::string> slices;
+    for (size_t i = 0; i <= bounds.size(); i++) {
+        std::string where;
+        if (i == 0)
+            where = column + " is null";
+        else
+            where = column + " >= " + bounds[i - 1];
+        if (i < bounds.size())
+            where += (i == 0 ? " or " : " and ") + column + " < " + bounds[i];
+        slices.push_back(base + where);
+    }
+    return slices;
+}
+
+}  // namespace Pg2Arrow
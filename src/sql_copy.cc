@@ -1,38 +1,927 @@
 #include "pg2arrow.h"
 
+#include "./hton.h"
+
+#include <arrow/c/bridge.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace Pg2Arrow {
 
-void CopyQuery(PGconn* conn, const char* query, PgBuilder& builder) {
+static const int kBinaryHeaderSize = 19;
+
+// Rows decoded at once by PgBuilder::AppendRows, small enough for their offsets
+// and values to stay in cache
+static const int64_t kBlockRows = 1024;
+
+// Rows fetched one CopyData message at a time with PQgetCopyData
+class LibpqCopyStream : public CopyStream {
+   public:
+    LibpqCopyStream(PGconn* conn) : conn_(conn) {}
+    ~LibpqCopyStream() { Release(); }
+
+    arrow::Status Next(std::vector<const char*>* rows) override {
+        Release();
+        rows->clear();
+        if (done_)
+            return arrow::Status::OK();
+
+        // Block for the first row, then take whatever libpq already buffered
+        char* tuple;
+        int async = 0;
+        int len = 0;
+        while (tuples_.size() < kMaxRun &&
+               (len = PQgetCopyData(conn_, &tuple, async)) > 0) {
+            tuples_.push_back(tuple);
+            rows->push_back(header_ ? tuple + kBinaryHeaderSize : tuple);
+            header_ = false;
+            async = 1;
+        }
+
+        if (len < 0) {
+            done_ = true;
+            auto res = PQgetResult(conn_);
+            auto status = PQresultStatus(res) == PGRES_COMMAND_OK
+                              ? arrow::Status::OK()
+                              : arrow::Status::IOError(
+                                    "copy command failed: ", PQresultErrorMessage(res));
+            PQclear(res);
+            return status;
+        }
+        return arrow::Status::OK();
+    }
+
+   private:
+    static const size_t kMaxRun = 1024;
+
+    void Release() {
+        for (auto tuple : tuples_)
+            PQfreemem(tuple);
+        tuples_.clear();
+    }
+
+    PGconn* conn_;
+    std::vector<char*> tuples_;
+    bool header_ = true;
+    bool done_ = false;
+};
+
+// Speaks the COPY part of the frontend/backend protocol directly over the
+// connection socket. CopyData frames are parsed in place from a large reusable
+// buffer, so rows cost neither an allocation nor a copy. libpq is left
+// untouched and sees an idle connection once the stream is over.
+class SocketCopyStream : public CopyStream {
+   public:
+    SocketCopyStream(PGconn* conn, arrow::MemoryPool* pool)
+        : sock_(PQsocket(conn)), pool_(pool) {}
+
+    arrow::Status Start(const std::string& query) {
+        ARROW_ASSIGN_OR_RAISE(
+            buffer_, arrow::AllocateResizableBuffer(kBufferSize, pool_));
+
+        // Query message: 'Q', int32 length, null terminated query string
+        std::string message(5, 'Q');
+        pack_int32(&message[1], 4 + query.size() + 1);
+        message.append(query.c_str(), query.size() + 1);
+
+        size_t sent = 0;
+        while (sent < message.size()) {
+            auto n = send(
+                sock_, message.data() + sent, message.size() - sent, kSendFlags);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    return arrow::Status::IOError("send failed: ", strerror(errno));
+                ARROW_RETURN_NOT_OK(Wait(POLLOUT));
+                continue;
+            }
+            sent += n;
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Next(std::vector<const char*>* rows) override {
+        rows->clear();
+
+        while (!done_) {
+            ParseMessages(rows);
+            if (!rows->empty() || done_)
+                break;
+            ARROW_RETURN_NOT_OK(Fill());
+        }
+        return done_ ? error_ : arrow::Status::OK();
+    }
+
+    std::shared_ptr<arrow::Buffer> buffer() const override { return buffer_; }
+
+   private:
+    static const size_t kBufferSize = 4 << 20;
+#ifdef MSG_NOSIGNAL
+    static const int kSendFlags = MSG_NOSIGNAL;
+#else
+    static const int kSendFlags = 0;
+#endif
+
+    // Walks the complete messages in the buffer, collecting CopyData payloads
+    void ParseMessages(std::vector<const char*>* rows) {
+        wanted_ = 0;
+        while (end_ - begin_ >= 5) {
+            const char* message = (const char*)buffer_->data() + begin_;
+            size_t len = 1 + unpack_uint32(message + 1);
+            if (end_ - begin_ < len) {
+                wanted_ = len;
+                break;
+            }
+            begin_ += len;
+
+            const char* payload = message + 5;
+            switch (*message) {
+                case 'd':
+                    rows->push_back(header_ ? payload + kBinaryHeaderSize : payload);
+                    header_ = false;
+                    break;
+                case 'E':
+                    if (error_.ok())
+                        error_ = arrow::Status::IOError(
+                            "copy command failed: ", ErrorMessage(payload, len - 5));
+                    break;
+                case 'Z':
+                    done_ = true;
+                    return;
+                default:
+                    // CopyOutResponse, CopyDone, CommandComplete and asynchronous
+                    // notice, parameter status or notification messages
+                    break;
+            }
+        }
+    }
+
+    // Reads more data from the socket, after the data already received as long
+    // as the buffer has room for it. Once full, rows handed out by the previous
+    // call are invalidated as the trailing partial message moves to the front,
+    // or to a new buffer while arrays still point into the current one. Either
+    // way a buffer is only given up once filled, so that views into it keep no
+    // unused memory alive.
+    arrow::Status Fill() {
+        auto size = (size_t)buffer_->size();
+        if (end_ == size || begin_ + wanted_ > size) {
+            auto wanted = std::max(kBufferSize, wanted_);
+            if (buffer_.use_count() > 1) {
+                ARROW_ASSIGN_OR_RAISE(
+                    std::shared_ptr<arrow::ResizableBuffer> buffer,
+                    arrow::AllocateResizableBuffer(wanted, pool_));
+                memcpy(buffer->mutable_data(), buffer_->data() + begin_, end_ - begin_);
+                buffer_ = std::move(buffer);
+            } else {
+                auto data = buffer_->mutable_data();
+                memmove(data, data + begin_, end_ - begin_);
+                if (wanted > size)
+                    ARROW_RETURN_NOT_OK(buffer_->Resize(wanted));
+            }
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        auto data = (char*)buffer_->mutable_data();
+
+        while (true) {
+            auto n = recv(sock_, data + end_, buffer_->size() - end_, 0);
+            if (n > 0) {
+                end_ += n;
+                return arrow::Status::OK();
+            }
+            if (n == 0)
+                return arrow::Status::IOError("server closed the connection");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return arrow::Status::IOError("recv failed: ", strerror(errno));
+            ARROW_RETURN_NOT_OK(Wait(POLLIN));
+        }
+    }
+
+    // libpq leaves its socket in non-blocking mode
+    arrow::Status Wait(short events) {
+        struct pollfd fd = {sock_, events, 0};
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+            return arrow::Status::IOError("poll failed: ", strerror(errno));
+        return arrow::Status::OK();
+    }
+
+    // ErrorResponse fields are (code, null terminated string) pairs
+    static std::string ErrorMessage(const char* fields, size_t len) {
+        const char* end = fields + len;
+        while (fields < end && *fields != 0) {
+            std::string value(fields + 1);
+            if (*fields == 'M')
+                return value;
+            fields += 1 + value.size() + 1;
+        }
+        return "unknown error";
+    }
+
+    int sock_;
+    arrow::MemoryPool* pool_;
+    std::shared_ptr<arrow::ResizableBuffer> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    size_t wanted_ = 0;
+    bool header_ = true;
+    bool done_ = false;
+    arrow::Status error_;
+};
+
+// PQgetCopyData in asynchronous mode over a non-blocking connection. The COPY
+// response, the rows and the command status are each picked up as soon as
+// they are fully received.
+class LibpqAsyncCopyStream : public AsyncCopyStream {
+   public:
+    LibpqAsyncCopyStream(PGconn* conn) : conn_(conn) {}
+    ~LibpqAsyncCopyStream() { Release(); }
+
+    arrow::Status Start(const std::string& query) {
+        // The query is short, it goes out at once or nearly so
+        int pending = -1;
+        if (PQsetnonblocking(conn_, 1) == 0 && PQsendQuery(conn_, query.c_str())) {
+            while ((pending = PQflush(conn_)) == 1) {
+                struct pollfd fd = {PQsocket(conn_), POLLOUT, 0};
+                poll(&fd, 1, -1);
+            }
+        }
+        if (pending < 0) {
+            auto status = arrow::Status::IOError(
+                "unable to send copy command: ", PQerrorMessage(conn_));
+            PQsetnonblocking(conn_, 0);
+            return status;
+        }
+        return arrow::Status::OK();
+    }
+
+    int socket() const override { return PQsocket(conn_); }
+    bool done() const override { return done_; }
+
+    arrow::Status Next(std::vector<const char*>* rows) override {
+        Release();
+        rows->clear();
+        if (done_)
+            return status_;
+
+        if (!PQconsumeInput(conn_)) {
+            done_ = true;
+            status_ = arrow::Status::IOError(
+                "connection lost during copy: ", PQerrorMessage(conn_));
+            return status_;
+        }
+
+        if (state_ == kStarting && !PQisBusy(conn_)) {
+            auto res = PQgetResult(conn_);
+            if (PQresultStatus(res) == PGRES_COPY_OUT) {
+                state_ = kCopying;
+            } else {
+                state_ = kFinishing;
+                status_ = arrow::Status::IOError(
+                    "error in copy command: ", PQresultErrorMessage(res));
+            }
+            PQclear(res);
+        }
+
+        if (state_ == kCopying) {
+            char* tuple;
+            int len = 0;
+            while (tuples_.size() < kMaxRun &&
+                   (len = PQgetCopyData(conn_, &tuple, 1)) > 0) {
+                tuples_.push_back(tuple);
+                rows->push_back(header_ ? tuple + kBinaryHeaderSize : tuple);
+                header_ = false;
+            }
+            if (len < 0)
+                state_ = kFinishing;
+        }
+
+        // The command status comes last, followed by a null result
+        while (state_ == kFinishing && !PQisBusy(conn_)) {
+            auto res = PQgetResult(conn_);
+            if (res == nullptr) {
+                done_ = true;
+                PQsetnonblocking(conn_, 0);
+                break;
+            }
+            if (PQresultStatus(res) != PGRES_COMMAND_OK && status_.ok())
+                status_ = arrow::Status::IOError(
+                    "copy command failed: ", PQresultErrorMessage(res));
+            PQclear(res);
+        }
+        // Errors are only reported once every result is in, for the connection
+        // to be usable again
+        return rows->empty() && done_ ? status_ : arrow::Status::OK();
+    }
+
+   private:
+    static const size_t kMaxRun = 1024;
+    enum State { kStarting, kCopying, kFinishing };
+
+    void Release() {
+        for (auto tuple : tuples_)
+            PQfreemem(tuple);
+        tuples_.clear();
+    }
+
+    PGconn* conn_;
+    State state_ = kStarting;
+    std::vector<char*> tuples_;
+    bool header_ = true;
+    bool done_ = false;
+    arrow::Status status_;
+};
+
+arrow::Result<std::unique_ptr<CopyStream>> OpenCopyStream(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options) {
     auto copy_query = std::string("COPY (") + query + ") TO STDOUT (FORMAT binary)";
+
+    // Raw socket access is not possible on encrypted connections, nor while
+    // libpq is still busy with a previous query
+    auto tx_status = PQtransactionStatus(conn);
+    if (options.raw_socket && !PQsslInUse(conn) && !PQgssEncInUse(conn) &&
+        (tx_status == PQTRANS_IDLE || tx_status == PQTRANS_INTRANS)) {
+        auto stream = std::make_unique<SocketCopyStream>(
+            conn, options.memory_pool ? options.memory_pool
+                                      : arrow::default_memory_pool());
+        ARROW_RETURN_NOT_OK(stream->Start(copy_query));
+        return stream;
+    }
+
     auto res = PQexec(conn, copy_query.c_str());
-    if (PQresultStatus(res) != PGRES_COPY_OUT)
-        std::cout << "error in copy command: " << PQresultErrorMessage(res)
-                  << std::endl;
+    if (PQresultStatus(res) != PGRES_COPY_OUT) {
+        auto status = arrow::Status::IOError(
+            "error in copy command: ", PQresultErrorMessage(res));
+        PQclear(res);
+        return status;
+    }
     PQclear(res);
+    return std::make_unique<LibpqCopyStream>(conn);
+}
+
+arrow::Result<std::unique_ptr<AsyncCopyStream>> StartCopyStream(
+    PGconn* conn,
+    const char* query) {
+    auto copy_query = std::string("COPY (") + query + ") TO STDOUT (FORMAT binary)";
+    auto stream = std::make_unique<LibpqAsyncCopyStream>(conn);
+    ARROW_RETURN_NOT_OK(stream->Start(copy_query));
+    return stream;
+}
+
+static int64_t NowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Adds the time elapsed between its construction and its destruction to
+// `phase`, unless it is null. The wall time only runs from the first thread
+// entering the phase to the last one leaving it.
+class PhaseTimer {
+   public:
+    explicit PhaseTimer(PhaseTime* phase) : phase_(phase) {
+        if (phase_) {
+            cpu_ns_ = NowNs(CLOCK_THREAD_CPUTIME_ID);
+            std::lock_guard<std::mutex> lock(phase_->mutex);
+            if (phase_->active++ == 0)
+                phase_->start_ns = NowNs(CLOCK_MONOTONIC);
+        }
+    }
+
+    ~PhaseTimer() {
+        if (phase_) {
+            phase_->cpu_ns += NowNs(CLOCK_THREAD_CPUTIME_ID) - cpu_ns_;
+            std::lock_guard<std::mutex> lock(phase_->mutex);
+            if (--phase_->active == 0)
+                phase_->wall_ns += NowNs(CLOCK_MONOTONIC) - phase_->start_ns;
+        }
+    }
+
+   private:
+    PhaseTime* phase_;
+    int64_t cpu_ns_;
+};
+
+static bool IsBatchFull(const PgBuilder& builder, const UserOptions& options) {
+    if (builder.num_rows() == 0)
+        return false;
+    return (options.batch_rows > 0 && builder.num_rows() >= options.batch_rows) ||
+           (options.batch_bytes > 0 && builder.num_bytes() >= options.batch_bytes) ||
+           (options.memory_limit > 0 && builder.memory_size() >= options.memory_limit);
+}
+
+static arrow::Status FlushBatch(
+    PgBuilder& builder,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    {
+        PhaseTimer timer(stats ? &stats->flush : nullptr);
+        ARROW_RETURN_NOT_OK(builder.Flush(&batch));
+    }
+    PhaseTimer timer(stats ? &stats->write : nullptr);
+    if (stats)
+        stats->batches++;
+    return callback(batch);
+}
+
+arrow::Status CopyRun(
+    const std::vector<const char*>& rows,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    for (size_t i = 0; i < rows.size();) {
+        int64_t count = std::min<int64_t>(rows.size() - i, kBlockRows);
+        if (callback && options.batch_rows > 0)
+            count = std::min(count, options.batch_rows - builder.num_rows());
 
-    char* tuple;
-    auto status = PQgetCopyData(conn, &tuple, 0);
-    if (status > 0) {
-        const int kBinaryHeaderSize = 19;
-        builder.Append(tuple + kBinaryHeaderSize);
-        PQfreemem(tuple);
+        {
+            PhaseTimer timer(stats ? &stats->decode : nullptr);
+            int64_t num_bytes = builder.num_bytes();
+            int64_t num_rows = builder.AppendRows(rows.data() + i, count);
+            if (stats) {
+                stats->rows += num_rows;
+                stats->bytes += builder.num_bytes() - num_bytes;
+            }
+        }
+        i += count;
+        if (callback && IsBatchFull(builder, options))
+            ARROW_RETURN_NOT_OK(FlushBatch(builder, callback, stats));
     }
+    return arrow::Status::OK();
+}
 
+arrow::Status CopyRows(
+    CopyStream& stream,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    arrow::Status status;
+    std::vector<const char*> rows;
     while (true) {
-        status = PQgetCopyData(conn, &tuple, 0);
-        if (status < 0)
+        arrow::Status stream_status;
+        {
+            PhaseTimer timer(stats ? &stats->receive : nullptr);
+            stream_status = stream.Next(&rows);
+        }
+        if (!stream_status.ok())
+            return stream_status;
+        if (rows.empty())
             break;
+        builder.SetBuffer(stream.buffer());
 
-        builder.Append(tuple);
-        PQfreemem(tuple);
+        // Keep draining the stream on error so that the connection stays usable
+        if (status.ok())
+            status = CopyRun(rows, builder, options, callback, stats);
     }
 
-    res = PQgetResult(conn);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        std::cout << "copy command failed: " << PQresultErrorMessage(res) << std::endl;
-    PQclear(res);
+    if (callback && status.ok() && builder.num_rows() > 0)
+        status = FlushBatch(builder, callback, stats);
+
+    if (stats) {
+        stats->column_bytes = builder.column_bytes();
+        stats->column_memory = builder.column_memory();
+    }
+    return status;
+}
+
+arrow::Status CopyQuery(
+    PGconn* conn,
+    const char* query,
+    PgBuilder& builder,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    ARROW_ASSIGN_OR_RAISE(auto stream, OpenCopyStream(conn, query, options));
+    if (!options.tee_filename.empty()) {
+        ARROW_ASSIGN_OR_RAISE(
+            stream, TeeCopyStream(
+                        std::move(stream), options.tee_filename.c_str(),
+                        builder.memory_pool()));
+    }
+    return CopyRows(*stream, builder, options, callback, stats);
+}
+
+// Rows of about one batch cut from a CopyStream at row boundaries, and the
+// batches decoded from them
+struct CopyChunk {
+    int64_t sequence = 0;
+    // Runs of rows along with the buffer keeping them alive, either the one of
+    // the stream or a copy of the rows
+    std::vector<std::pair<std::shared_ptr<arrow::Buffer>, std::vector<const char*>>>
+        runs;
+    int64_t num_rows = 0;
+    int64_t num_bytes = 0;
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+};
+
+class ParallelDecoder {
+   public:
+    ParallelDecoder(
+        std::shared_ptr<arrow::Schema> schema,
+        const UserOptions& options,
+        const BatchCallback& callback,
+        CopyStats* stats)
+        : schema_(std::move(schema)),
+          options_(options),
+          callback_(callback),
+          stats_(stats),
+          copy_(options.memory_pool ? options.memory_pool
+                                    : arrow::default_memory_pool()) {
+        options_.auto_dictionary = false;
+        num_threads_ = std::max(1, options.decode_threads);
+        max_rows_ = options.batch_rows > 0 ? options.batch_rows : kDefaultChunkRows;
+        // Chunks already end at the batch limits, only the memory limit may
+        // still flush a batch early
+        chunk_options_ = options_;
+        chunk_options_.batch_rows = 0;
+        chunk_options_.batch_bytes = 0;
+    }
+
+    arrow::Status Run(CopyStream& stream) {
+        std::vector<std::unique_ptr<PgBuilder>> builders;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_threads_; i++) {
+            builders.push_back(std::make_unique<PgBuilder>(schema_, options_));
+            threads.emplace_back(&ParallelDecoder::Decode, this, builders.back().get());
+        }
+
+        auto status = Read(stream);
+        if (status.ok() && chunk_)
+            status = Push();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_ = false;
+        }
+        cv_.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+
+        if (stats_) {
+            for (auto& builder : builders) {
+                auto& bytes = builder->column_bytes();
+                auto& memory = builder->column_memory();
+                stats_->column_bytes.resize(bytes.size(), 0);
+                stats_->column_memory.resize(memory.size(), 0);
+                for (size_t i = 0; i < bytes.size(); i++) {
+                    stats_->column_bytes[i] += bytes[i];
+                    stats_->column_memory[i] =
+                        std::max(stats_->column_memory[i], memory[i]);
+                }
+            }
+        }
+        return status.ok() ? status_ : status;
+    }
+
+   private:
+    static const int64_t kDefaultChunkRows = 1 << 16;
+
+    // Cuts the stream into chunks, going on to the end of the stream after an
+    // error so that the connection stays usable
+    arrow::Status Read(CopyStream& stream) {
+        std::vector<const char*> rows;
+        while (true) {
+            arrow::Status stream_status;
+            {
+                PhaseTimer timer(stats_ ? &stats_->receive : nullptr);
+                stream_status = stream.Next(&rows);
+            }
+            ARROW_RETURN_NOT_OK(stream_status);
+            if (rows.empty())
+                return arrow::Status::OK();
+            if (failed_)
+                continue;
+
+            // Chunks hold no more rows than a batch
+            for (size_t i = 0; i < rows.size();) {
+                int64_t count = rows.size() - i;
+                if (chunk_)
+                    count = std::min(count, max_rows_ - chunk_->num_rows);
+                ARROW_RETURN_NOT_OK(AddRows(rows.data() + i, count, stream.buffer()));
+                i += count;
+                if (chunk_->num_rows >= max_rows_ ||
+                    (options_.batch_bytes > 0 &&
+                     chunk_->num_bytes >= options_.batch_bytes))
+                    ARROW_RETURN_NOT_OK(Push());
+            }
+        }
+    }
+
+    // Rows in a buffer of the stream are kept in place, the others are copied
+    // as the stream reuses their memory
+    arrow::Status AddRows(
+        const char* const* rows,
+        int64_t num_rows,
+        const std::shared_ptr<arrow::Buffer>& buffer) {
+        if (!chunk_) {
+            chunk_ = std::make_unique<CopyChunk>();
+            chunk_->sequence = next_sequence_++;
+        }
+        chunk_->num_rows += num_rows;
+
+        if (buffer) {
+            ARROW_RETURN_NOT_OK(FinishCopy());
+            // Rows of a run follow each other in the buffer
+            auto last = rows[num_rows - 1];
+            chunk_->num_bytes += last - rows[0] + CopyRowSize(last, nullptr);
+            chunk_->runs.emplace_back(
+                buffer, std::vector<const char*>(rows, rows + num_rows));
+            return arrow::Status::OK();
+        }
+
+        for (int64_t i = 0; i < num_rows; i++) {
+            auto row = rows[i];
+            auto size = CopyRowSize(row, nullptr);
+            copy_offsets_.push_back(copy_.length());
+            ARROW_RETURN_NOT_OK(copy_.Append(row, size));
+            chunk_->num_bytes += size;
+        }
+        return arrow::Status::OK();
+    }
+
+    // Rows copied so far make a run of the chunk once they no longer move
+    arrow::Status FinishCopy() {
+        if (copy_offsets_.empty())
+            return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> copy, copy_.Finish());
+        std::vector<const char*> rows;
+        for (auto offset : copy_offsets_)
+            rows.push_back((const char*)copy->data() + offset);
+        copy_offsets_.clear();
+        chunk_->runs.emplace_back(std::move(copy), std::move(rows));
+        return arrow::Status::OK();
+    }
+
+    // Queues the current chunk, once few enough are waiting to be decoded or
+    // handed over, which bounds the memory they hold
+    arrow::Status Push() {
+        ARROW_RETURN_NOT_OK(FinishCopy());
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return pending_ < 2 * num_threads_ || !status_.ok(); });
+        failed_ = !status_.ok();
+        if (!failed_) {
+            queue_.push_back(std::move(chunk_));
+            pending_++;
+        }
+        chunk_.reset();
+        cv_.notify_all();
+        return arrow::Status::OK();
+    }
+
+    void Decode(PgBuilder* builder) {
+        while (true) {
+            std::unique_ptr<CopyChunk> chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] { return !queue_.empty() || !reading_; });
+                if (queue_.empty())
+                    return;
+                chunk = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            auto status = DecodeChunk(*builder, *chunk);
+            if (!status.ok()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (status_.ok())
+                    status_ = status;
+            }
+            Deliver(std::move(chunk));
+        }
+    }
+
+    arrow::Status DecodeChunk(PgBuilder& builder, CopyChunk& chunk) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!status_.ok())
+                return arrow::Status::OK();
+        }
+        auto collect = [&chunk](std::shared_ptr<arrow::RecordBatch> batch) {
+            chunk.batches.push_back(std::move(batch));
+            return arrow::Status::OK();
+        };
+        for (auto& run : chunk.runs) {
+            builder.SetBuffer(run.first);
+            ARROW_RETURN_NOT_OK(
+                CopyRun(run.second, builder, chunk_options_, collect, stats_));
+        }
+        builder.SetBuffer(nullptr);
+        if (builder.num_rows() > 0)
+            ARROW_RETURN_NOT_OK(FlushBatch(builder, collect, stats_));
+        chunk.runs.clear();
+        return arrow::Status::OK();
+    }
+
+    // Hands the batches of the chunks over to the callback, in stream order
+    // unless told otherwise, one thread at a time
+    void Deliver(std::unique_ptr<CopyChunk> chunk) {
+        std::lock_guard<std::mutex> deliver_lock(deliver_mutex_);
+        auto sequence = chunk->sequence;
+        decoded_[sequence] = std::move(chunk);
+
+        while (!decoded_.empty()) {
+            auto it = options_.ordered_batches ? decoded_.find(next_delivery_)
+                                               : decoded_.begin();
+            if (it == decoded_.end())
+                break;
+            auto batches = std::move(it->second->batches);
+            decoded_.erase(it);
+            next_delivery_++;
+
+            arrow::Status status;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                status = status_;
+            }
+            for (size_t i = 0; i < batches.size() && status.ok(); i++) {
+                PhaseTimer timer(stats_ ? &stats_->write : nullptr);
+                status = callback_(std::move(batches[i]));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (status_.ok())
+                status_ = status;
+            pending_--;
+            cv_.notify_all();
+        }
+    }
+
+    std::shared_ptr<arrow::Schema> schema_;
+    UserOptions options_;
+    UserOptions chunk_options_;
+    const BatchCallback& callback_;
+    CopyStats* stats_;
+    int num_threads_;
+    int64_t max_rows_;
+
+    // State of the reading thread
+    std::unique_ptr<CopyChunk> chunk_;
+    arrow::BufferBuilder copy_;
+    std::vector<int64_t> copy_offsets_;
+    int64_t next_sequence_ = 0;
+    bool failed_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<CopyChunk>> queue_;
+    // Chunks queued or decoded but not handed over yet
+    int pending_ = 0;
+    bool reading_ = true;
+    arrow::Status status_;
+
+    std::mutex deliver_mutex_;
+    std::map<int64_t, std::unique_ptr<CopyChunk>> decoded_;
+    int64_t next_delivery_ = 0;
+};
+
+arrow::Status ParallelCopyRows(
+    CopyStream& stream,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    ParallelDecoder decoder(std::move(schema), options, callback, stats);
+    return decoder.Run(stream);
+}
+
+arrow::Status ParallelCopyQuery(
+    PGconn* conn,
+    const char* query,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options,
+    const BatchCallback& callback,
+    CopyStats* stats) {
+    ARROW_ASSIGN_OR_RAISE(auto stream, OpenCopyStream(conn, query, options));
+    if (!options.tee_filename.empty()) {
+        ARROW_ASSIGN_OR_RAISE(
+            stream, TeeCopyStream(
+                        std::move(stream), options.tee_filename.c_str(),
+                        options.memory_pool ? options.memory_pool
+                                            : arrow::default_memory_pool()));
+    }
+    return ParallelCopyRows(*stream, std::move(schema), options, callback, stats);
+}
+
+PgRecordBatchReader::PgRecordBatchReader(
+    PGconn* conn,
+    std::unique_ptr<CopyStream> stream,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options)
+    : conn_(conn),
+      stream_(std::move(stream)),
+      builder_(std::move(schema), options),
+      options_(options) {}
+
+PgRecordBatchReader::~PgRecordBatchReader() {
+    auto status = Close();
+}
+
+arrow::Result<std::shared_ptr<PgRecordBatchReader>> PgRecordBatchReader::Open(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options) {
+    ARROW_ASSIGN_OR_RAISE(auto schema, GetQuerySchema(conn, query, options));
+    ARROW_ASSIGN_OR_RAISE(auto stream, OpenCopyStream(conn, query, options));
+    std::shared_ptr<PgRecordBatchReader> reader(
+        new PgRecordBatchReader(conn, std::move(stream), schema, options));
+    ARROW_RETURN_NOT_OK(reader->Init());
+    return reader;
+}
+
+arrow::Result<std::shared_ptr<PgRecordBatchReader>> PgRecordBatchReader::Open(
+    std::unique_ptr<CopyStream> stream,
+    std::shared_ptr<arrow::Schema> schema,
+    const UserOptions& options) {
+    std::shared_ptr<PgRecordBatchReader> reader(
+        new PgRecordBatchReader(nullptr, std::move(stream), schema, options));
+    ARROW_RETURN_NOT_OK(reader->Init());
+    return reader;
+}
+
+// Automatic dictionaries settle on the schema by the end of the first batch
+arrow::Status PgRecordBatchReader::Init() {
+    if (options_.auto_dictionary)
+        ARROW_RETURN_NOT_OK(ReadNext(&first_batch_));
+    schema_ = first_batch_ ? first_batch_->schema() : builder_.schema();
+    return arrow::Status::OK();
+}
+
+arrow::Status PgRecordBatchReader::ReadNext(
+    std::shared_ptr<arrow::RecordBatch>* batch) {
+    if (first_batch_) {
+        *batch = std::move(first_batch_);
+        return arrow::Status::OK();
+    }
+
+    batch->reset();
+    while (!done_) {
+        if (next_row_ == rows_.size()) {
+            auto status = stream_->Next(&rows_);
+            next_row_ = 0;
+            done_ = !status.ok() || rows_.empty();
+            ARROW_RETURN_NOT_OK(status);
+            builder_.SetBuffer(stream_->buffer());
+            continue;
+        }
+
+        int64_t count = std::min<int64_t>(rows_.size() - next_row_, kBlockRows);
+        if (options_.batch_rows > 0)
+            count = std::min(count, options_.batch_rows - builder_.num_rows());
+        builder_.AppendRows(rows_.data() + next_row_, count);
+        next_row_ += count;
+        if (IsBatchFull(builder_, options_))
+            return builder_.Flush(batch);
+    }
+
+    if (builder_.num_rows() > 0)
+        return builder_.Flush(batch);
+    return arrow::Status::OK();
+}
+
+arrow::Status PgRecordBatchReader::Close() {
+    if (done_)
+        return arrow::Status::OK();
+    done_ = true;
+
+    // The server stops sending rows, those already sent are skipped
+    if (conn_ != nullptr) {
+        char message[256];
+        auto cancel = PQgetCancel(conn_);
+        PQcancel(cancel, message, sizeof(message));
+        PQfreeCancel(cancel);
+        while (stream_->Next(&rows_).ok() && !rows_.empty()) {
+        }
+    }
+    rows_.clear();
+    return arrow::Status::OK();
+}
+
+arrow::Status ExportQueryStream(
+    PGconn* conn,
+    const char* query,
+    const UserOptions& options,
+    struct ArrowArrayStream* out) {
+    ARROW_ASSIGN_OR_RAISE(auto reader, PgRecordBatchReader::Open(conn, query, options));
+    return arrow::ExportRecordBatchReader(std::move(reader), out);
+}
+
+void CopyQuery(PGconn* conn, const char* query, PgBuilder& builder) {
+    auto status = CopyQuery(conn, query, builder, UserOptions(), nullptr);
+    if (!status.ok())
+        std::cerr << status.message() << std::endl;
 }
 
 }  // namespace Pg2Arrow
@@ -0,0 +1,43 @@
+// Catalog description of the types of query columns, and the file caching it
+// across runs
+
+#pragma once
+
+#include <libpq-fe.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Pg2Arrow {
+
+// Attribute of a composite type or label of an enum
+struct TypeMember {
+    std::string name;
+    Oid typid;
+    int typmod;
+};
+
+struct TypeInfo {
+    // xmins of the catalog rows describing the type, which change with it
+    std::string version;
+    std::string name;
+    char type;
+    Oid elem;
+    std::vector<TypeMember> members;
+};
+
+typedef std::map<Oid, TypeInfo> TypeMap;
+
+// Types of every (system identifier, database) seen so far
+typedef std::map<std::pair<std::string, std::string>, TypeMap> TypeCache;
+
+// The records read in full, a file being written out of space, say, leaving
+// the last one cut short. Empty when the file is missing or corrupt.
+TypeCache LoadTypeCache(const std::string& filename);
+
+// Replaces the file, if it can be written
+void SaveTypeCache(const std::string& filename, const TypeCache& cache);
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,494 @@
+#include "./writer.h"
+
+#include "./memo_table.h"
+
+#include <arrow/io/api.h>
+#include <arrow/io/stdio.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/compression.h>
+#include <parquet/arrow/writer.h>
+
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+namespace Pg2Arrow {
+
+static arrow::Result<std::shared_ptr<arrow::io::OutputStream>> OpenOutput(
+    const std::string& filename) {
+    if (filename == "-")
+        return std::make_shared<arrow::io::StdoutStream>();
+    return arrow::io::FileOutputStream::Open(filename);
+}
+
+static arrow::Result<arrow::Compression::type> GetCompression(
+    const std::string& name) {
+    if (name == "none")
+        return arrow::Compression::UNCOMPRESSED;
+    if (name == "lz4")
+        return arrow::Compression::LZ4_FRAME;
+    if (name == "zstd")
+        return arrow::Compression::ZSTD;
+    return arrow::Status::Invalid("unknown compression: ", name);
+}
+
+// Distinct values of a column below which it stays dictionary encoded, as a
+// share of its values and in absolute terms as dictionary pages are limited
+static const int64_t kDictionaryRatio = 10;
+static const int64_t kMaxDictionaryValues = 1 << 16;
+
+// Counts distinct values by the share of bits their hashes leave unset in a
+// bitmap (linear counting), which is accurate up to a few times its size
+class DistinctSketch {
+   public:
+    DistinctSketch() : words_(kBits / 64, 0) {}
+
+    void Add(const void* data, size_t size) {
+        auto hash = std::hash<std::string_view>()(
+            std::string_view((const char*)data, size));
+        hash &= kBits - 1;
+        words_[hash / 64] |= uint64_t(1) << (hash % 64);
+    }
+
+    // -1 once the bitmap is full
+    int64_t Estimate() const {
+        int64_t unset = kBits;
+        for (auto word : words_)
+            unset -= __builtin_popcountll(word);
+        if (unset == 0)
+            return -1;
+        return std::llround(-kBits * std::log((double)unset / kBits));
+    }
+
+   private:
+    static const int64_t kBits = 1 << 18;
+    std::vector<uint64_t> words_;
+};
+
+template <typename ArrayType>
+static void ProfileIntegers(const arrow::Array& array, ColumnProfile* profile) {
+    auto& values = (const ArrayType&)array;
+    DistinctSketch sketch;
+    int64_t min = 0, max = 0, last = 0;
+    bool sorted = true, first = true;
+    for (int64_t i = 0; i < values.length(); i++) {
+        if (values.IsNull(i))
+            continue;
+        int64_t value = values.Value(i);
+        sketch.Add(&value, sizeof(value));
+        if (first) {
+            min = max = value;
+            first = false;
+        } else {
+            sorted &= value >= last;
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+        last = value;
+    }
+
+    auto range = (uint64_t)max - (uint64_t)min;
+    profile->integer = true;
+    profile->sorted = sorted;
+    profile->range_bits = range == 0 ? 0 : 64 - __builtin_clzll(range);
+    profile->distinct = sketch.Estimate();
+}
+
+ColumnProfile ProfileColumn(const arrow::Array& array) {
+    ColumnProfile profile;
+    profile.null_count = array.null_count();
+    profile.count = array.length() - profile.null_count;
+
+    switch (array.type_id()) {
+        case arrow::Type::INT8:
+            ProfileIntegers<arrow::Int8Array>(array, &profile);
+            return profile;
+        case arrow::Type::INT16:
+            ProfileIntegers<arrow::Int16Array>(array, &profile);
+            return profile;
+        case arrow::Type::INT32:
+            ProfileIntegers<arrow::Int32Array>(array, &profile);
+            return profile;
+        case arrow::Type::INT64:
+            ProfileIntegers<arrow::Int64Array>(array, &profile);
+            return profile;
+        case arrow::Type::DATE32:
+            ProfileIntegers<arrow::Date32Array>(array, &profile);
+            return profile;
+        case arrow::Type::TIMESTAMP:
+            ProfileIntegers<arrow::TimestampArray>(array, &profile);
+            return profile;
+        case arrow::Type::TIME64:
+            ProfileIntegers<arrow::Time64Array>(array, &profile);
+            return profile;
+        case arrow::Type::DURATION:
+            ProfileIntegers<arrow::DurationArray>(array, &profile);
+            return profile;
+        default:
+            break;
+    }
+
+    DistinctSketch sketch;
+    auto& type = *array.type();
+    if (arrow::is_binary_like(type.id())) {
+        auto& values = (const arrow::BinaryArray&)array;
+        for (int64_t i = 0; i < values.length(); i++) {
+            if (values.IsValid(i)) {
+                auto value = values.GetView(i);
+                sketch.Add(value.data(), value.size());
+            }
+        }
+#if ARROW_VERSION_MAJOR >= 15
+    } else if (arrow::is_binary_view_like(type.id())) {
+        auto& values = (const arrow::BinaryViewArray&)array;
+        for (int64_t i = 0; i < values.length(); i++) {
+            if (values.IsValid(i)) {
+                auto value = values.GetView(i);
+                sketch.Add(value.data(), value.size());
+            }
+        }
+#endif
+    } else if (arrow::is_fixed_width(type.id()) && type.id() != arrow::Type::BOOL &&
+               type.id() != arrow::Type::DICTIONARY) {
+        auto width = type.byte_width();
+        auto data = array.data()->buffers[1]->data() + array.offset() * width;
+        for (int64_t i = 0; i < array.length(); i++) {
+            if (array.IsValid(i))
+                sketch.Add(data + i * width, width);
+        }
+    } else {
+        return profile;
+    }
+    profile.distinct = sketch.Estimate();
+    return profile;
+}
+
+// Columns with few distinct values keep the dictionary encoding Parquet starts
+// with. The others skip it for an encoding suited to their values.
+void ChooseEncoding(
+    const arrow::Field& field,
+    const ColumnProfile& profile,
+    parquet::WriterProperties::Builder* properties) {
+    if (profile.count == 0 || field.type()->id() == arrow::Type::DICTIONARY)
+        return;
+    if (profile.distinct >= 0 && profile.distinct <= kMaxDictionaryValues &&
+        profile.distinct * kDictionaryRatio <= profile.count)
+        return;
+
+    auto& name = field.name();
+    properties->disable_dictionary(name);
+    // Deltas of sorted values, like ids or timestamps, or of values within a
+    // narrow range take few bits
+    if (profile.integer &&
+        (profile.sorted || 2 * profile.range_bits <= field.type()->bit_width())) {
+        properties->encoding(name, parquet::Encoding::DELTA_BINARY_PACKED);
+    } else if (
+        field.type()->id() == arrow::Type::FLOAT ||
+        field.type()->id() == arrow::Type::DOUBLE) {
+        properties->encoding(name, parquet::Encoding::BYTE_STREAM_SPLIT);
+    }
+}
+
+// Each batch goes to its own row group. With automatic encodings, or with
+// bloom filters, the file is only started along with the first batch, from
+// which the properties of its columns are picked.
+class ParquetBatchWriter : public BatchWriter {
+   public:
+    ParquetBatchWriter(
+        std::shared_ptr<arrow::io::OutputStream> output,
+        const WriterOptions& options,
+        arrow::Compression::type compression)
+        : output_(std::move(output)), options_(options), compression_(compression) {}
+
+    arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema) override {
+        schema_ = schema;
+        if (!options_.auto_encodings && options_.bloom_filter_columns.empty())
+            return Start(nullptr);
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Write(std::shared_ptr<arrow::RecordBatch> batch) override {
+        if (!writer_)
+            ARROW_RETURN_NOT_OK(Start(batch.get()));
+        ARROW_RETURN_NOT_OK(writer_->NewBufferedRowGroup());
+        return writer_->WriteRecordBatch(*batch);
+    }
+
+    arrow::Status Close() override {
+        if (!writer_)
+            ARROW_RETURN_NOT_OK(Start(nullptr));
+        ARROW_RETURN_NOT_OK(writer_->Close());
+        return output_->Close();
+    }
+
+   private:
+    arrow::Status Start(const arrow::RecordBatch* batch) {
+        parquet::WriterProperties::Builder properties;
+        properties.memory_pool(options_.memory_pool);
+        if (options_.max_row_group_length > 0)
+            properties.max_row_group_length(options_.max_row_group_length);
+        properties.compression(compression_);
+        if (options_.page_index)
+            properties.enable_write_page_index();
+
+        std::vector<ColumnProfile> profiles(schema_->num_fields());
+        for (int i = 0; batch && i < batch->num_columns(); i++) {
+            profiles[i] = ProfileColumn(*batch->column(i));
+            if (options_.auto_encodings)
+                ChooseEncoding(*schema_->field(i), profiles[i], &properties);
+        }
+
+#if ARROW_VERSION_MAJOR >= 22
+        for (auto& name : options_.bloom_filter_columns) {
+            // Columns left out of the files of a partitioned dataset included
+            int i = schema_->GetFieldIndex(name);
+            if (i < 0)
+                continue;
+            parquet::BloomFilterOptions bloom_filter;
+            if (profiles[i].distinct > 0)
+                bloom_filter.ndv = profiles[i].distinct;
+            properties.enable_bloom_filter(name, bloom_filter);
+        }
+#else
+        if (!options_.bloom_filter_columns.empty())
+            return arrow::Status::NotImplemented(
+                "bloom filters need Arrow 22 or later");
+#endif
+
+        parquet::ArrowWriterProperties::Builder arrow_properties;
+        arrow_properties.set_use_threads(options_.use_threads);
+        ARROW_ASSIGN_OR_RAISE(
+            writer_, parquet::arrow::FileWriter::Open(
+                         *schema_, options_.memory_pool, output_, properties.build(),
+                         arrow_properties.build()));
+        return arrow::Status::OK();
+    }
+
+    std::shared_ptr<arrow::io::OutputStream> output_;
+    WriterOptions options_;
+    arrow::Compression::type compression_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::unique_ptr<parquet::arrow::FileWriter> writer_;
+};
+
+// Arrow IPC stream or file. The output is flushed after every batch so that
+// readers at the other end of a pipe get it right away.
+// The IPC file format takes a single dictionary per column, which may only grow
+// from one batch to the next. Batches of different builders, or of a builder
+// whose dictionary started over once too large, come with unrelated
+// dictionaries: their values are merged into the dictionary of the file and
+// their indices remapped to it.
+class IpcBatchWriter : public BatchWriter {
+   public:
+    IpcBatchWriter(
+        std::shared_ptr<arrow::io::OutputStream> output,
+        arrow::ipc::IpcWriteOptions options,
+        bool file_format)
+        : output_(std::move(output)),
+          options_(std::move(options)),
+          file_format_(file_format) {}
+
+    arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema) override {
+        if (file_format_) {
+            for (auto& field : schema->fields()) {
+                auto type = field->type();
+                bool merged =
+                    type->id() == arrow::Type::DICTIONARY &&
+                    ((const arrow::DictionaryType&)*type).index_type()->id() ==
+                        arrow::Type::INT32 &&
+                    ((const arrow::DictionaryType&)*type).value_type()->id() ==
+                        arrow::Type::STRING;
+                dictionaries_.push_back(
+                    merged ? std::make_unique<StringMemoTable>() : nullptr);
+            }
+            ARROW_ASSIGN_OR_RAISE(
+                writer_, arrow::ipc::MakeFileWriter(output_, schema, options_));
+        } else {
+            ARROW_ASSIGN_OR_RAISE(
+                writer_, arrow::ipc::MakeStreamWriter(output_, schema, options_));
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Write(std::shared_ptr<arrow::RecordBatch> batch) override {
+        for (size_t i = 0; i < dictionaries_.size(); i++) {
+            if (!dictionaries_[i])
+                continue;
+            ARROW_ASSIGN_OR_RAISE(
+                auto column, MergeDictionary(*dictionaries_[i], *batch->column(i)));
+            if (!column)
+                continue;
+            ARROW_ASSIGN_OR_RAISE(
+                batch, batch->SetColumn(i, batch->schema()->field(i), column));
+        }
+        ARROW_RETURN_NOT_OK(writer_->WriteRecordBatch(*batch));
+        return output_->Flush();
+    }
+
+    arrow::Status Close() override {
+        ARROW_RETURN_NOT_OK(writer_->Close());
+        return output_->Close();
+    }
+
+   private:
+    // Null when the dictionary of the column only grew since the last batch
+    arrow::Result<std::shared_ptr<arrow::Array>> MergeDictionary(
+        StringMemoTable& memo,
+        const arrow::Array& column) {
+        auto& array = (const arrow::DictionaryArray&)column;
+        auto& values = (const arrow::StringArray&)*array.dictionary();
+        std::vector<int32_t> transpose(values.length());
+        bool same = true;
+        for (int64_t i = 0; i < values.length(); i++) {
+            auto value = values.GetView(i);
+            transpose[i] = memo.GetOrInsert(value.data(), value.size());
+            same = same && transpose[i] == i;
+        }
+        if (same && memo.size() == values.length())
+            return nullptr;
+
+        auto& offsets = memo.offsets();
+        auto& data = memo.data();
+        auto pool = options_.memory_pool;
+        ARROW_ASSIGN_OR_RAISE(
+            auto offsets_buffer,
+            arrow::AllocateBuffer(offsets.size() * sizeof(int32_t), pool));
+        ARROW_ASSIGN_OR_RAISE(
+            auto data_buffer, arrow::AllocateBuffer(data.size(), pool));
+        memcpy(offsets_buffer->mutable_data(), offsets.data(), offsets_buffer->size());
+        memcpy(data_buffer->mutable_data(), data.data(), data.size());
+        auto dictionary = std::make_shared<arrow::StringArray>(
+            memo.size(), std::move(offsets_buffer), std::move(data_buffer));
+        return array.Transpose(array.type(), dictionary, transpose.data(), pool);
+    }
+
+    std::shared_ptr<arrow::io::OutputStream> output_;
+    arrow::ipc::IpcWriteOptions options_;
+    bool file_format_;
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> writer_;
+    // Dictionary of the file for the columns merged, file format only
+    std::vector<std::unique_ptr<StringMemoTable>> dictionaries_;
+};
+
+// Hands batches over to `writer` on a thread of its own, through a queue of at
+// most `max_queued` batches. Errors of the writer thread come out of the next
+// call to Write or Close.
+class QueuedBatchWriter : public BatchWriter {
+   public:
+    QueuedBatchWriter(std::unique_ptr<BatchWriter> writer, int32_t max_queued)
+        : writer_(std::move(writer)), max_queued_(max_queued) {}
+    ~QueuedBatchWriter() override { Stop(); }
+
+    arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema) override {
+        ARROW_RETURN_NOT_OK(writer_->Open(schema));
+        thread_ = std::thread(&QueuedBatchWriter::Run, this);
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Write(std::shared_ptr<arrow::RecordBatch> batch) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return queue_.size() < max_queued_ || !status_.ok(); });
+        ARROW_RETURN_NOT_OK(status_);
+        queue_.push_back(std::move(batch));
+        cv_.notify_all();
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Close() override {
+        Stop();
+        ARROW_RETURN_NOT_OK(status_);
+        return writer_->Close();
+    }
+
+   private:
+    // Batches are dropped as soon as they are written, and skipped after an
+    // error
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [&] { return !queue_.empty() || closing_; });
+            if (queue_.empty())
+                return;
+            auto batch = std::move(queue_.front());
+            queue_.pop_front();
+            cv_.notify_all();
+
+            if (status_.ok()) {
+                lock.unlock();
+                auto status = writer_->Write(std::move(batch));
+                lock.lock();
+                status_ = status;
+            }
+        }
+    }
+
+    // Waits for the queued batches to be written
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    std::unique_ptr<BatchWriter> writer_;
+    size_t max_queued_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<arrow::RecordBatch>> queue_;
+    bool closing_ = false;
+    arrow::Status status_;
+};
+
+static arrow::Result<std::unique_ptr<BatchWriter>> MakeFileWriter(
+    const WriterOptions& options) {
+    ARROW_ASSIGN_OR_RAISE(auto compression, GetCompression(options.compression));
+
+    if (options.format == "parquet") {
+        // Parquet has its own LZ4 framing
+        if (compression == arrow::Compression::LZ4_FRAME)
+            compression = arrow::Compression::LZ4;
+        ARROW_ASSIGN_OR_RAISE(auto output, OpenOutput(options.filename));
+        return std::make_unique<ParquetBatchWriter>(output, options, compression);
+    }
+
+    if (options.format == "ipc-stream" || options.format == "ipc-file" ||
+        options.format == "feather") {
+        // Dictionaries that grow from one batch to the next are sent as deltas. The
+        // file format has no room for replacements, see IpcBatchWriter.
+        auto ipc_options = arrow::ipc::IpcWriteOptions::Defaults();
+        ipc_options.emit_dictionary_deltas = true;
+        ipc_options.memory_pool = options.memory_pool;
+        ipc_options.use_threads = options.use_threads;
+        if (compression != arrow::Compression::UNCOMPRESSED) {
+            ARROW_ASSIGN_OR_RAISE(
+                ipc_options.codec, arrow::util::Codec::Create(compression));
+        }
+        ARROW_ASSIGN_OR_RAISE(auto output, OpenOutput(options.filename));
+        return std::make_unique<IpcBatchWriter>(
+            output, ipc_options, options.format != "ipc-stream");
+    }
+
+    return arrow::Status::Invalid("unknown output format: ", options.format);
+}
+
+arrow::Result<std::unique_ptr<BatchWriter>> MakeBatchWriter(
+    const WriterOptions& options) {
+    if (options.max_file_rows > 0 || options.max_file_bytes > 0 ||
+        !options.partition_column.empty())
+        return MakeDatasetWriter(options);
+
+    ARROW_ASSIGN_OR_RAISE(auto writer, MakeFileWriter(options));
+    if (options.max_queued_batches > 0)
+        writer = std::make_unique<QueuedBatchWriter>(
+            std::move(writer), options.max_queued_batches);
+    return writer;
+}
+
+}  // namespace Pg2Arrow
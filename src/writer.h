@@ -0,0 +1,90 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <parquet/properties.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Pg2Arrow {
+
+struct WriterOptions {
+    // parquet, ipc-stream or ipc-file (also known as feather)
+    std::string format = "parquet";
+    // Output file, "-" for stdout
+    std::string filename;
+    // none, lz4 or zstd: IPC buffer compression or Parquet page compression
+    std::string compression = "none";
+    // Rows per Parquet row group (0 means the Parquet default)
+    int64_t max_row_group_length = 0;
+    // Pool of the encoding and compression buffers
+    arrow::MemoryPool* memory_pool = arrow::default_memory_pool();
+    // Encode and compress the columns of a batch in parallel on the Arrow CPU
+    // thread pool
+    bool use_threads = false;
+    // Batches waiting for a writer thread of their own, which encodes them
+    // while the next ones are decoded. Write blocks once that many are queued.
+    // 0 writes batches on the calling thread.
+    int32_t max_queued_batches = 0;
+    // Dataset output, `filename` being a directory of files that roll over
+    // past that many rows or bytes of Arrow data (0 for no limit)
+    int64_t max_file_rows = 0;
+    int64_t max_file_bytes = 0;
+    // Hive partitioning by the values of a column, or by the hour, day, month
+    // or year of a timestamp or date column
+    std::string partition_column;
+    std::string partition_unit;
+    // Dataset files open at once
+    int32_t max_open_files = 16;
+    // Parquet encoding of every top level column picked from a profile of the
+    // first batch: dictionary for few distinct values, otherwise
+    // DELTA_BINARY_PACKED for sorted or narrow integers and BYTE_STREAM_SPLIT
+    // for floats
+    bool auto_encodings = false;
+    // Parquet column and offset indexes, and bloom filters of top level columns
+    bool page_index = false;
+    std::vector<std::string> bloom_filter_columns;
+};
+
+// Writes record batches to the output file as soon as they are flushed
+class BatchWriter {
+   public:
+    virtual ~BatchWriter() = default;
+
+    // Starts the output with the schema of the first batch
+    virtual arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema) = 0;
+    virtual arrow::Status Write(std::shared_ptr<arrow::RecordBatch> batch) = 0;
+    virtual arrow::Status Close() = 0;
+};
+
+// Values of a top level column of the first batch, from which its Parquet
+// encoding is picked
+struct ColumnProfile {
+    int64_t count = 0;
+    int64_t null_count = 0;
+    // Estimate of the distinct values, -1 for too many to tell
+    int64_t distinct = -1;
+    // Integers only: whether they never decrease, and the bits spanned by the
+    // range between the smallest and the largest
+    bool integer = false;
+    bool sorted = false;
+    int range_bits = 0;
+};
+
+ColumnProfile ProfileColumn(const arrow::Array& array);
+
+// Parquet encoding of the column of `field` with --auto-encoding
+void ChooseEncoding(
+    const arrow::Field& field,
+    const ColumnProfile& profile,
+    parquet::WriterProperties::Builder* properties);
+
+// Dataset writer when any of the dataset options is set, file writer otherwise
+arrow::Result<std::unique_ptr<BatchWriter>> MakeBatchWriter(
+    const WriterOptions& options);
+
+arrow::Result<std::unique_ptr<BatchWriter>> MakeDatasetWriter(
+    const WriterOptions& options);
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,621 @@
+// Round trips of synthetic binary COPY rows through PgBuilder
+
+#include "../src/pg2arrow.h"
+#include "./row_writer.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+
+namespace Pg2Arrow {
+namespace {
+
+typedef std::function<void(int64_t, RowWriter&)> FieldWriter;
+
+// Rows of one field writer per column, laid out one after the other in a
+// buffer as in a COPY stream
+struct Rows {
+    std::shared_ptr<arrow::Buffer> buffer;
+    std::vector<const char*> rows;
+
+    Rows(int64_t num_rows, const std::vector<FieldWriter>& fields) {
+        RowWriter data;
+        std::vector<size_t> offsets;
+        for (int64_t i = 0; i < num_rows; i++) {
+            offsets.push_back(data.data().size());
+            data.Int16(fields.size());
+            for (auto& field : fields)
+                field(i, data);
+        }
+        buffer = arrow::Buffer::FromString(data.data());
+        for (auto offset : offsets)
+            rows.push_back((const char*)buffer->data() + offset);
+    }
+};
+
+// Appends the rows in runs of the given sizes, flushing every `batch_rows` rows
+std::shared_ptr<arrow::Table> Decode(
+    PgBuilder& builder,
+    const Rows& rows,
+    const std::vector<int64_t>& runs,
+    int64_t batch_rows = 0) {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    size_t next = 0;
+    for (size_t r = 0; next < rows.rows.size(); r++) {
+        int64_t size =
+            std::min<int64_t>(runs[r % runs.size()], rows.rows.size() - next);
+        EXPECT_EQ(builder.AppendRows(rows.rows.data() + next, size), size);
+        next += size;
+        if (batch_rows > 0 && builder.num_rows() >= batch_rows) {
+            std::shared_ptr<arrow::RecordBatch> batch;
+            auto status = builder.Flush(&batch);
+            EXPECT_TRUE(status.ok()) << status.ToString();
+            batches.push_back(batch);
+        }
+    }
+    std::shared_ptr<arrow::RecordBatch> batch;
+    auto status = builder.Flush(&batch);
+    EXPECT_TRUE(status.ok()) << status.ToString();
+    batches.push_back(batch);
+    for (auto& batch : batches)
+        EXPECT_TRUE(batch->ValidateFull().ok());
+    return *arrow::Table::FromRecordBatches(builder.schema(), batches);
+}
+
+// Values of a column as text, lists in brackets, structs in braces and
+// dictionaries by their value
+std::string Format(const arrow::Array& array, int64_t i) {
+    if (array.IsNull(i))
+        return "null";
+    std::string text;
+    auto join = [&text](const arrow::Array& values, int64_t begin, int64_t end) {
+        for (auto j = begin; j < end; j++)
+            text += (j > begin ? "," : "") + Format(values, j);
+    };
+    switch (array.type_id()) {
+        case arrow::Type::LIST: {
+            auto& list = (const arrow::ListArray&)array;
+            join(*list.values(), list.value_offset(i), list.value_offset(i + 1));
+            return "[" + text + "]";
+        }
+        case arrow::Type::FIXED_SIZE_LIST: {
+            auto& list = (const arrow::FixedSizeListArray&)array;
+            auto begin = list.value_offset(i);
+            join(*list.values(), begin, begin + list.value_length(i));
+            return "[" + text + "]";
+        }
+        case arrow::Type::STRUCT: {
+            auto& strukt = (const arrow::StructArray&)array;
+            for (int k = 0; k < strukt.num_fields(); k++)
+                text += (k > 0 ? "," : "") + Format(*strukt.field(k), i);
+            return "{" + text + "}";
+        }
+        case arrow::Type::DICTIONARY: {
+            auto& dictionary = (const arrow::DictionaryArray&)array;
+            return Format(*dictionary.dictionary(), dictionary.GetValueIndex(i));
+        }
+        default:
+            return (*array.GetScalar(i))->ToString();
+    }
+}
+
+std::vector<std::string> Format(const arrow::ChunkedArray& column) {
+    std::vector<std::string> values;
+    for (auto& chunk : column.chunks()) {
+        for (int64_t i = 0; i < chunk->length(); i++)
+            values.push_back(Format(*chunk, i));
+    }
+    return values;
+}
+
+void Int64Field(int64_t i, RowWriter& row) {
+    RowWriter value;
+    value.Int64(i);
+    row.Field(value);
+}
+
+// A decimal string as a binary COPY numeric: base 10000 digit groups, the
+// weight of the first one, the sign and the display scale
+void NumericField(std::string value, RowWriter& row) {
+    bool negative = value[0] == '-';
+    if (negative)
+        value.erase(0, 1);
+    auto dot = value.find('.');
+    auto integer = value.substr(0, dot);
+    auto fraction = dot == std::string::npos ? "" : value.substr(dot + 1);
+    int16_t scale = fraction.size();
+    integer.insert(0, (4 - integer.size() % 4) % 4, '0');
+    fraction.append((4 - fraction.size() % 4) % 4, '0');
+
+    std::vector<int16_t> groups;
+    for (auto digits = integer + fraction; !digits.empty(); digits.erase(0, 4))
+        groups.push_back(std::stoi(digits.substr(0, 4)));
+    int16_t weight = integer.size() / 4 - 1;
+    while (!groups.empty() && groups.front() == 0) {
+        groups.erase(groups.begin());
+        weight--;
+    }
+    while (!groups.empty() && groups.back() == 0)
+        groups.pop_back();
+
+    RowWriter numeric;
+    numeric.Int16(groups.size());
+    numeric.Int16(groups.empty() ? 0 : weight);
+    numeric.Int16(negative ? 0x4000 : 0);
+    numeric.Int16(scale);
+    for (auto group : groups)
+        numeric.Int16(group);
+    row.Field(numeric);
+}
+
+// A binary COPY array of the given dimensions, its elements being fields
+void ArrayField(
+    const std::vector<int32_t>& dims,
+    const std::vector<RowWriter>& elements,
+    RowWriter& row) {
+    bool hasnulls = false;
+    for (auto& element : elements)
+        hasnulls = hasnulls || element.data() == std::string(4, '\xff');
+    RowWriter array;
+    array.Int32(dims.size());
+    array.Int32(hasnulls);
+    array.Int32(0);
+    for (auto dim : dims) {
+        array.Int32(dim);
+        array.Int32(1);
+    }
+    for (auto& element : elements)
+        array.Bytes(element.data());
+    row.Field(array);
+}
+
+RowWriter Int32Element(int32_t value) {
+    RowWriter element;
+    element.Int32(4);
+    element.Int32(value);
+    return element;
+}
+
+RowWriter NullElement() {
+    RowWriter element;
+    element.Null();
+    return element;
+}
+
+// Fixed width values appended unchecked must stay within the reserved
+// capacity, which runs of uneven sizes used to overrun
+TEST(BuilderTest, UnevenRuns) {
+    auto schema = arrow::schema(
+        {arrow::field("id", arrow::int64()),
+         arrow::field("d", arrow::duration(arrow::TimeUnit::MICRO)),
+         arrow::field("s", arrow::utf8())});
+    // Overruns are only caught by sanitizers in the system allocator
+    UserOptions options;
+    options.expected_rows = 600;
+    options.memory_pool = arrow::system_memory_pool();
+    PgBuilder builder(schema, options);
+
+    Rows rows(
+        20000,
+        {Int64Field,
+         [](int64_t i, RowWriter& row) {
+             RowWriter value;
+             value.Int64(i);
+             value.Int32(1);
+             value.Int32(0);
+             row.Field(value);
+         },
+         [](int64_t i, RowWriter& row) {
+             if (i % 3 == 0)
+                 return row.Null();
+             row.Text(std::to_string(i));
+         }});
+    auto table = Decode(builder, rows, {500, 1024, 4, 3000, 1, 777}, 7000);
+
+    ASSERT_EQ(table->num_rows(), 20000);
+    auto ids = table->column(0);
+    auto durations = table->column(1);
+    auto strings = table->column(2);
+    for (int64_t i = 0; i < 20000; i++) {
+        EXPECT_EQ(
+            std::static_pointer_cast<arrow::Int64Scalar>(*ids->GetScalar(i))->value, i);
+        EXPECT_EQ(
+            std::static_pointer_cast<arrow::DurationScalar>(*durations->GetScalar(i))
+                ->value,
+            i + 86400000000LL);
+        auto string = *strings->GetScalar(i);
+        EXPECT_EQ(string->is_valid, i % 3 != 0);
+        if (string->is_valid) {
+            EXPECT_EQ(string->ToString(), std::to_string(i));
+        }
+    }
+}
+
+// Views of long strings point into the stream buffer, which only the arrays
+// hold on to, so that streams keep reusing it while no array needs it
+TEST(BuilderTest, ViewsHoldStreamBuffer) {
+    auto schema = arrow::schema({arrow::field("s", arrow::utf8())});
+    UserOptions options;
+    options.string_views = true;
+    PgBuilder builder(schema, options);
+
+    auto Decode = [&builder](const std::string& value) {
+        RowWriter row;
+        row.Int16(1);
+        row.Text(value);
+        auto buffer = std::make_shared<arrow::Buffer>(row.data());
+        builder.SetBuffer(buffer);
+        const char* rows[] = {(const char*)buffer->data()};
+        EXPECT_EQ(builder.AppendRows(rows, 1), 1);
+        std::shared_ptr<arrow::RecordBatch> batch;
+        EXPECT_TRUE(builder.Flush(&batch).ok());
+        EXPECT_TRUE(batch->ValidateFull().ok());
+        EXPECT_EQ((*batch->column(0)->GetScalar(0))->ToString(), value);
+        return buffer.use_count();
+    };
+    EXPECT_EQ(Decode("inlined"), 1);
+    EXPECT_EQ(Decode("long enough to point into the buffer"), 2);
+}
+
+// The memory limit applies to the rows of the batch being built, whatever else
+// the pool holds
+TEST(BuilderTest, MemorySize) {
+    auto schema = arrow::schema(
+        {arrow::field("id", arrow::int64()), arrow::field("s", arrow::utf8())});
+    PgBuilder builder(schema, UserOptions());
+    Rows rows(10000, {Int64Field, [](int64_t i, RowWriter& row) {
+                          row.Text(std::string(100, 'a' + i % 26));
+                      }});
+    auto other = *arrow::AllocateBuffer(64 << 20, builder.memory_pool());
+
+    auto empty = builder.memory_size();
+    EXPECT_LT(empty, 1 << 20);
+    EXPECT_EQ(builder.AppendRows(rows.rows.data(), 10000), 10000);
+    EXPECT_GE(builder.memory_size(), 10000 * (8 + 4 + 100));
+    EXPECT_LT(builder.memory_size(), 4 * 10000 * (8 + 4 + 100));
+
+    std::shared_ptr<arrow::RecordBatch> batch;
+    EXPECT_TRUE(builder.Flush(&batch).ok());
+    EXPECT_EQ(batch->num_rows(), 10000);
+    EXPECT_LE(builder.memory_size(), empty);
+}
+
+// Numerics are truncated to the scale of the decimal
+TEST(BuilderTest, Numeric) {
+    std::vector<std::string> values = {
+        "0", "1", "-1", "12.5", "-0.001", "1234.56789", "99999999",
+        "0.0000000001", "12345678901234567890123456789.123456789"};
+    auto schema = arrow::schema(
+        {arrow::field("n", arrow::decimal128(38, 9)),
+         arrow::field("m", arrow::decimal128(10, 2))});
+    PgBuilder builder(schema);
+    Rows rows(values.size(), {[&](int64_t i, RowWriter& row) {
+                                  NumericField(values[i], row);
+                              },
+                              [&](int64_t i, RowWriter& row) {
+                                  // Within the 8 integer digits of numeric(10, 2)
+                                  NumericField(values[std::min<int64_t>(i, 6)], row);
+                              }});
+    auto table = Decode(builder, rows, {(int64_t)values.size()});
+
+    std::vector<std::string> n = {
+        "0E-9",         "1.000000000",    "-1.000000000",       "12.500000000",
+        "-0.001000000", "1234.567890000", "99999999.000000000", "0E-9",
+        "12345678901234567890123456789.123456789"};
+    std::vector<std::string> m = {"0.00",    "1.00",    "-1.00",      "12.50",
+                                  "0.00",    "1234.56", "99999999.00", "99999999.00",
+                                  "99999999.00"};
+    for (size_t i = 0; i < values.size(); i++) {
+        EXPECT_EQ((*table->column(0)->GetScalar(i))->ToString(), n[i]);
+        EXPECT_EQ((*table->column(1)->GetScalar(i))->ToString(), m[i]);
+    }
+}
+
+// Values with more integer digits than the precision leaves room for fail the
+// batch instead of wrapping around
+TEST(BuilderTest, NumericOverflow) {
+    auto schema = arrow::schema({arrow::field("n", arrow::decimal128(38, 9))});
+    for (auto value : {"1234567890123456789012345678901", "2e38", "-9e40"}) {
+        std::string digits = value;
+        if (digits.find('e') != std::string::npos) {
+            auto exponent = std::stoi(digits.substr(digits.find('e') + 1));
+            digits = digits.substr(0, digits.find('e')) + std::string(exponent, '0');
+        }
+        PgBuilder builder(schema);
+        Rows rows(3, {[&](int64_t i, RowWriter& row) {
+                      NumericField(i == 1 ? digits : "1", row);
+                  }});
+        EXPECT_EQ(builder.AppendRows(rows.rows.data(), 3), 3);
+        std::shared_ptr<arrow::RecordBatch> batch;
+        auto status = builder.Flush(&batch);
+        EXPECT_TRUE(status.IsInvalid()) << value;
+        EXPECT_EQ(batch, nullptr);
+
+        // The next batch goes on
+        EXPECT_EQ(builder.AppendRows(rows.rows.data(), 1), 1);
+        EXPECT_TRUE(builder.Flush(&batch).ok());
+    }
+
+    // 29 integer digits still fit
+    PgBuilder builder(schema);
+    std::string value = std::string(29, '9') + "." + std::string(9, '9');
+    Rows rows(1, {[&](int64_t, RowWriter& row) { NumericField(value, row); }});
+    auto table = Decode(builder, rows, {1});
+    EXPECT_EQ((*table->column(0)->GetScalar(0))->ToString(), value);
+}
+
+// Arrays have as many nested lists as dimensions, fixed size or not. Arrays
+// of another shape are nulls, except in one dimensional lists which take all
+// the elements.
+TEST(BuilderTest, Arrays) {
+    auto schema = arrow::schema(
+        {arrow::field("a", arrow::list(arrow::int32())),
+         arrow::field("f", arrow::list(arrow::int32())),
+         arrow::field("flat", arrow::list(arrow::int32()))});
+    UserOptions options;
+    options.array_shapes = {{"a", {-1, -1}}, {"f", {-1, 3}}};
+    PgBuilder builder(schema, options);
+    EXPECT_TRUE(builder.schema()->field(0)->type()->Equals(
+        arrow::list(arrow::list(arrow::int32()))));
+    EXPECT_TRUE(builder.schema()->field(1)->type()->Equals(
+        arrow::list(arrow::fixed_size_list(arrow::int32(), 3))));
+
+    auto array = [](int64_t i, RowWriter& row) {
+        switch (i % 6) {
+            case 0:
+                return row.Null();
+            case 1:
+                return ArrayField(
+                    {2, 3},
+                    {Int32Element(1), Int32Element(2), Int32Element(3),
+                     Int32Element(4), Int32Element(5), Int32Element(6)},
+                    row);
+            case 2:
+                return ArrayField(
+                    {2, 3},
+                    {Int32Element(1), NullElement(), Int32Element(3),
+                     Int32Element(4), Int32Element(5), NullElement()},
+                    row);
+            case 3:
+                return ArrayField(
+                    {4}, {Int32Element(1), Int32Element(2), Int32Element(3),
+                          Int32Element(4)},
+                    row);
+            case 4:
+                return ArrayField(
+                    {2, 2},
+                    {Int32Element(1), Int32Element(2), Int32Element(3),
+                     Int32Element(4)},
+                    row);
+            default:
+                return ArrayField({}, {}, row);
+        }
+    };
+    Rows rows(600, {array, array, array});
+    auto table = Decode(builder, rows, {1, 100, 7});
+
+    std::vector<std::vector<std::string>> expected = {
+        {"null", "[[1,2,3],[4,5,6]]", "[[1,null,3],[4,5,null]]", "null",
+         "[[1,2],[3,4]]", "[]"},
+        {"null", "[[1,2,3],[4,5,6]]", "[[1,null,3],[4,5,null]]", "null", "null",
+         "[]"},
+        {"null", "[1,2,3,4,5,6]", "[1,null,3,4,5,null]", "[1,2,3,4]", "[1,2,3,4]",
+         "[]"}};
+    for (int k = 0; k < 3; k++) {
+        auto values = Format(*table->column(k));
+        for (int64_t i = 0; i < 600; i++)
+            ASSERT_EQ(values[i], expected[k][i % 6]) << k << " " << i;
+    }
+}
+
+// Elements that the pool has no room for are appended one by one, which fail
+// as well, instead of being written past the end of the buffer
+TEST(BuilderTest, ArraysOutOfMemory) {
+    auto schema = arrow::schema({arrow::field("a", arrow::list(arrow::int32()))});
+    arrow::CappedMemoryPool pool(arrow::system_memory_pool(), 1 << 20);
+    UserOptions options;
+    options.memory_pool = &pool;
+    PgBuilder builder(schema, options);
+
+    Rows rows(3, {[](int64_t i, RowWriter& row) {
+                  int32_t size = i == 1 ? 300000 : 10;
+                  std::vector<RowWriter> elements;
+                  for (int32_t k = 0; k < size; k++)
+                      elements.push_back(Int32Element(k));
+                  ArrayField({size}, elements, row);
+              }});
+    EXPECT_EQ(builder.AppendRows(rows.rows.data(), 3), 3);
+    EXPECT_LE(pool.bytes_allocated(), 1 << 20);
+}
+
+// Composite types are structs, their fields coming with a type oid
+TEST(BuilderTest, Struct) {
+    auto type = arrow::struct_(
+        {arrow::field("i", arrow::int32()), arrow::field("t", arrow::utf8())});
+    auto schema = arrow::schema({arrow::field("c", type)});
+    PgBuilder builder(schema);
+    Rows rows(100, {[](int64_t i, RowWriter& row) {
+                  if (i % 4 == 0)
+                      return row.Null();
+                  RowWriter value;
+                  value.Int32(2);
+                  value.Int32(23);
+                  value.Bytes(Int32Element(i).data());
+                  value.Int32(25);
+                  if (i % 4 == 1)
+                      value.Null();
+                  else
+                      value.Text("t" + std::to_string(i));
+                  row.Field(value);
+              }});
+    auto values = Format(*Decode(builder, rows, {64})->column(0));
+    for (int64_t i = 0; i < 100; i++) {
+        auto text = i % 4 == 1 ? "null" : "t" + std::to_string(i);
+        auto expected = "{" + std::to_string(i) + "," + text + "}";
+        ASSERT_EQ(values[i], i % 4 == 0 ? "null" : expected);
+    }
+}
+
+// Enums are dictionaries of their labels, the same in every batch, whatever
+// the number of labels of the same length
+TEST(BuilderTest, Enum) {
+    std::vector<std::string> labels = {"sad", "ok", "happy"};
+    for (int i = 0; i < 20; i++)
+        labels.push_back("l" + std::to_string(10 + i));
+    std::string metadata;
+    for (auto& label : labels)
+        metadata += (metadata.empty() ? "" : std::string(1, '\0')) + label;
+    auto type = arrow::dictionary(arrow::int8(), arrow::utf8());
+    auto enum_field = arrow::field(
+        "e", type, arrow::key_value_metadata({kEnumLabelsKey}, {metadata}));
+    auto schema = arrow::schema(
+        {enum_field,
+         arrow::field("l", arrow::list(enum_field->WithName("item")))});
+    PgBuilder builder(schema);
+
+    // Every label, then an unknown one and a null
+    auto value = [&labels](int64_t i) -> std::string {
+        auto k = i % (labels.size() + 2);
+        return k < labels.size() ? labels[k] : k == labels.size() ? "meh" : "null";
+    };
+    Rows rows(
+        1000,
+        {[&](int64_t i, RowWriter& row) {
+             if (value(i) == "null")
+                 return row.Null();
+             row.Text(value(i));
+         },
+         [&](int64_t i, RowWriter& row) {
+             RowWriter first, second;
+             first.Text(value(i));
+             second.Text(labels[i % labels.size()]);
+             ArrayField({2}, {first, second}, row);
+         }});
+    auto table = Decode(builder, rows, {300}, 300);
+
+    EXPECT_TRUE(table->schema()->field(0)->type()->Equals(type));
+    for (auto& chunk : table->column(0)->chunks()) {
+        auto& dictionary = *((const arrow::DictionaryArray&)*chunk).dictionary();
+        ASSERT_EQ(dictionary.length(), (int64_t)labels.size());
+        for (size_t k = 0; k < labels.size(); k++)
+            EXPECT_EQ(Format(dictionary, k), labels[k]);
+    }
+    auto e = Format(*table->column(0));
+    auto l = Format(*table->column(1));
+    for (int64_t i = 0; i < 1000; i++) {
+        auto expected = value(i) == "meh" ? "null" : value(i);
+        ASSERT_EQ(e[i], expected) << i;
+        ASSERT_EQ(l[i], "[" + expected + "," + labels[i % labels.size()] + "]") << i;
+    }
+}
+
+// Long values of view columns point into the buffer set, or are copied when
+// there is none
+TEST(BuilderTest, Views) {
+    auto schema = arrow::schema({arrow::field("s", arrow::utf8())});
+    UserOptions options;
+    options.string_views = true;
+    auto value = [](int64_t i) {
+        auto text = std::to_string(i);
+        return i % 3 == 0 ? text : "a longer value, number " + text;
+    };
+    Rows rows(3000, {[&](int64_t i, RowWriter& row) {
+                  if (i % 7 == 0)
+                      return row.Null();
+                  row.Text(value(i));
+              }});
+
+    for (bool buffer : {true, false}) {
+        PgBuilder builder(schema, options);
+        if (buffer)
+            builder.SetBuffer(rows.buffer);
+        auto table = Decode(builder, rows, {1000, 1, 33}, 1000);
+        EXPECT_TRUE(table->schema()->field(0)->type()->Equals(arrow::utf8_view()));
+        auto values = Format(*table->column(0));
+        for (int64_t i = 0; i < 3000; i++)
+            ASSERT_EQ(values[i], i % 7 == 0 ? "null" : value(i)) << i;
+    }
+}
+
+// Forced dictionaries keep growing from one batch to the next, until they get
+// too large and start over
+TEST(BuilderTest, Dictionary) {
+    auto schema = arrow::schema(
+        {arrow::field("small", arrow::utf8()), arrow::field("large", arrow::utf8())});
+    UserOptions options;
+    options.dictionary_columns = {"small", "large"};
+    options.dictionary_max_size = 100;
+    PgBuilder builder(schema, options);
+    auto small = [](int64_t i) { return "s" + std::to_string(i % 10); };
+    auto large = [](int64_t i) { return "l" + std::to_string(i * 7 % 150); };
+    Rows rows(
+        3000, {[&](int64_t i, RowWriter& row) {
+                   if (i % 11 == 0)
+                       return row.Null();
+                   row.Text(small(i));
+               },
+               [&](int64_t i, RowWriter& row) { row.Text(large(i)); }});
+    auto table = Decode(builder, rows, {500, 3}, 1000);
+
+    auto dictionary = arrow::dictionary(arrow::int32(), arrow::utf8());
+    EXPECT_TRUE(table->schema()->field(0)->type()->Equals(dictionary));
+    EXPECT_TRUE(table->schema()->field(1)->type()->Equals(dictionary));
+    auto s = Format(*table->column(0));
+    auto l = Format(*table->column(1));
+    for (int64_t i = 0; i < 3000; i++) {
+        ASSERT_EQ(s[i], i % 11 == 0 ? "null" : small(i)) << i;
+        ASSERT_EQ(l[i], large(i)) << i;
+    }
+
+    ASSERT_EQ(table->column(0)->num_chunks(), 3);
+    std::shared_ptr<arrow::Array> previous;
+    for (auto& chunk : table->column(0)->chunks()) {
+        auto values = ((const arrow::DictionaryArray&)*chunk).dictionary();
+        if (previous) {
+            EXPECT_TRUE(values->Slice(0, previous->length())->Equals(previous));
+        }
+        previous = values;
+    }
+    for (auto& chunk : table->column(1)->chunks())
+        EXPECT_EQ(((const arrow::DictionaryArray&)*chunk).dictionary()->length(), 150);
+}
+
+// Automatic dictionaries go back to plain strings, or views, once too large
+TEST(BuilderTest, AutoDictionary) {
+    auto schema = arrow::schema(
+        {arrow::field("small", arrow::utf8()), arrow::field("large", arrow::utf8())});
+    for (bool views : {false, true}) {
+        UserOptions options;
+        options.auto_dictionary = true;
+        options.dictionary_max_size = 100;
+        options.string_views = views;
+        PgBuilder builder(schema, options);
+        Rows rows(
+            3000, {[](int64_t i, RowWriter& row) {
+                       row.Text("s" + std::to_string(i % 10));
+                   },
+                   [](int64_t i, RowWriter& row) {
+                       if (i % 5 == 0)
+                           return row.Null();
+                       row.Text("a long enough value " + std::to_string(i));
+                   }});
+        if (views)
+            builder.SetBuffer(rows.buffer);
+        auto table = Decode(builder, rows, {700, 3}, 1000);
+
+        EXPECT_TRUE(table->schema()->field(0)->type()->Equals(
+            arrow::dictionary(arrow::int32(), arrow::utf8())));
+        EXPECT_TRUE(table->schema()->field(1)->type()->Equals(
+            views ? arrow::utf8_view() : arrow::utf8()));
+        auto s = Format(*table->column(0));
+        auto l = Format(*table->column(1));
+        for (int64_t i = 0; i < 3000; i++) {
+            ASSERT_EQ(s[i], "s" + std::to_string(i % 10)) << i;
+            auto large = "a long enough value " + std::to_string(i);
+            ASSERT_EQ(l[i], i % 5 == 0 ? "null" : large) << i;
+        }
+    }
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
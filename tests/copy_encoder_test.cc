@@ -0,0 +1,342 @@
+// Round trips of record batches through CopyEncoder and back through PgBuilder
+
+#include "../src/pg2arrow.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <optional>
+
+namespace Pg2Arrow {
+namespace {
+
+// Element type oids of the array columns
+const Oid kInt4Oid = 23;
+const Oid kTextOid = 25;
+const Oid kFloat8Oid = 701;
+const Oid kNumericOid = 1700;
+
+// Encodes the columns of `target` from `batch`, splits the COPY data into rows
+// and decodes them back
+std::shared_ptr<arrow::RecordBatch> RoundTrip(
+    const arrow::RecordBatch& batch,
+    const std::shared_ptr<arrow::Schema>& target,
+    const std::map<std::string, Oid>& element_types = {}) {
+    auto encoder = CopyEncoder::Make(*batch.schema(), *target, element_types);
+    EXPECT_TRUE(encoder.ok()) << encoder.status().ToString();
+    if (!encoder.ok())
+        return nullptr;
+    auto data = (*encoder)->Encode(batch);
+    EXPECT_TRUE(data.ok()) << data.status().ToString();
+    if (!data.ok())
+        return nullptr;
+
+    std::vector<const char*> rows;
+    auto cursor = (const char*)(*data)->data();
+    auto end = cursor + (*data)->size();
+    while (cursor < end) {
+        int64_t size = CopyRowSize(cursor, end);
+        EXPECT_GT(size, 0) << "row " << rows.size();
+        if (size <= 0)
+            return nullptr;
+        rows.push_back(cursor);
+        cursor += size;
+    }
+    EXPECT_EQ((int64_t)rows.size(), batch.num_rows());
+
+    PgBuilder builder(target);
+    EXPECT_EQ(builder.AppendRows(rows.data(), rows.size()), (int64_t)rows.size());
+    std::shared_ptr<arrow::RecordBatch> decoded;
+    auto status = builder.Flush(&decoded);
+    EXPECT_TRUE(status.ok()) << status.ToString();
+    if (decoded) {
+        EXPECT_TRUE(decoded->ValidateFull().ok());
+    }
+    return decoded;
+}
+
+// Round trip of a single column, compared with `expected`
+void ExpectRoundTrip(
+    const std::shared_ptr<arrow::Array>& source,
+    const std::shared_ptr<arrow::Array>& expected,
+    Oid element_type = 0) {
+    auto batch = arrow::RecordBatch::Make(
+        arrow::schema({arrow::field("c", source->type())}), source->length(),
+        {source});
+    auto target = arrow::schema({arrow::field("c", expected->type())});
+    std::map<std::string, Oid> element_types;
+    if (element_type != 0)
+        element_types["c"] = element_type;
+    auto decoded = RoundTrip(*batch, target, element_types);
+    ASSERT_NE(decoded, nullptr) << source->type()->ToString();
+    auto options = arrow::EqualOptions::Defaults().nans_equal(true);
+    EXPECT_TRUE(decoded->column(0)->Equals(*expected, options))
+        << source->type()->ToString() << " into " << expected->type()->ToString()
+        << "\n"
+        << expected->Diff(*decoded->column(0));
+}
+
+template <typename Builder, typename T>
+std::shared_ptr<arrow::Array> MakeArray(
+    const std::shared_ptr<arrow::DataType>& type,
+    const std::vector<std::optional<T>>& values) {
+    std::unique_ptr<arrow::ArrayBuilder> builder;
+    EXPECT_TRUE(arrow::MakeBuilder(arrow::default_memory_pool(), type, &builder).ok());
+    auto typed = (Builder*)builder.get();
+    for (auto& value : values) {
+        if (value)
+            EXPECT_TRUE(typed->Append(*value).ok());
+        else
+            EXPECT_TRUE(typed->AppendNull().ok());
+    }
+    return *builder->Finish();
+}
+
+template <typename T>
+using Lists = std::vector<std::optional<std::vector<std::optional<T>>>>;
+
+template <typename ListBuilder, typename ValueBuilder, typename T>
+std::shared_ptr<arrow::Array> MakeList(
+    const std::shared_ptr<arrow::DataType>& type,
+    const Lists<T>& lists) {
+    std::unique_ptr<arrow::ArrayBuilder> builder;
+    EXPECT_TRUE(arrow::MakeBuilder(arrow::default_memory_pool(), type, &builder).ok());
+    auto list = (ListBuilder*)builder.get();
+    auto values = (ValueBuilder*)list->value_builder();
+    for (auto& elements : lists) {
+        if (!elements) {
+            EXPECT_TRUE(list->AppendNull().ok());
+            continue;
+        }
+        EXPECT_TRUE(list->Append().ok());
+        for (auto& value : *elements) {
+            if (value)
+                EXPECT_TRUE(values->Append(*value).ok());
+            else
+                EXPECT_TRUE(values->AppendNull().ok());
+        }
+    }
+    return *builder->Finish();
+}
+
+// Unscaled values on both sides of every power of ten up to `precision`
+// digits, where base 10000 groups begin and end, of both signs, and a null
+template <typename Decimal>
+std::vector<std::optional<Decimal>> Boundaries(int32_t precision) {
+    std::vector<std::string> digits = {"0"};
+    for (int32_t n = 1; n <= precision; n++) {
+        digits.push_back(std::string(n, '9'));
+        if (n < precision) {
+            digits.push_back("1" + std::string(n, '0'));
+            digits.push_back("1" + std::string(n - 1, '0') + "1");
+        }
+    }
+    std::vector<std::optional<Decimal>> values;
+    for (auto& value : digits) {
+        values.push_back(Decimal(value));
+        values.push_back(Decimal("-" + value));
+    }
+    values.insert(values.begin() + values.size() / 2, std::nullopt);
+    return values;
+}
+
+TEST(CopyEncoderTest, Decimal128) {
+    auto values = Boundaries<arrow::Decimal128>(38);
+    for (int32_t scale : {0, 1, 2, 3, 4, 5, 7, 8, 9, 12, 20, 37, 38}) {
+        auto array = MakeArray<arrow::Decimal128Builder>(
+            arrow::decimal128(38, scale), values);
+        ExpectRoundTrip(array, array);
+    }
+}
+
+TEST(CopyEncoderTest, Decimal256) {
+    auto values = Boundaries<arrow::Decimal256>(76);
+    for (int32_t scale : {0, 1, 3, 4, 5, 16, 38, 40, 75, 76}) {
+        auto array = MakeArray<arrow::Decimal256Builder>(
+            arrow::decimal256(76, scale), values);
+        ExpectRoundTrip(array, array);
+    }
+}
+
+// Decimals of another scale than the column, negative ones included, are sent
+// with their own and decoded into that of the column
+TEST(CopyEncoderTest, DecimalRescale) {
+    for (auto [precision, from, to] :
+         {std::tuple{30, 2, 9}, {24, 0, 14}, {10, -3, 0}, {12, -5, 4}}) {
+        std::vector<std::optional<arrow::Decimal128>> expected;
+        auto values = Boundaries<arrow::Decimal128>(precision);
+        for (auto& value : values) {
+            expected.push_back(
+                value ? std::optional(*value->Rescale(from, to)) : std::nullopt);
+        }
+        ExpectRoundTrip(
+            MakeArray<arrow::Decimal128Builder>(
+                arrow::decimal128(precision, from), values),
+            MakeArray<arrow::Decimal128Builder>(arrow::decimal128(38, to), expected));
+    }
+}
+
+int64_t FloorDiv(int64_t value, int64_t div) {
+    return value >= 0 ? value / div : -((-value + div - 1) / div);
+}
+
+// Microseconds of `value` in `unit`, rounded down
+std::optional<int64_t> ToMicros(
+    std::optional<int64_t> value,
+    arrow::TimeUnit::type unit) {
+    if (!value)
+        return std::nullopt;
+    switch (unit) {
+        case arrow::TimeUnit::SECOND:
+            return *value * 1000000;
+        case arrow::TimeUnit::MILLI:
+            return *value * 1000;
+        case arrow::TimeUnit::MICRO:
+            return *value;
+        default:
+            return FloorDiv(*value, 1000);
+    }
+}
+
+const arrow::TimeUnit::type kUnits[] = {
+    arrow::TimeUnit::SECOND, arrow::TimeUnit::MILLI, arrow::TimeUnit::MICRO,
+    arrow::TimeUnit::NANO};
+
+// Timestamps and durations of every unit, around the PostgreSQL epoch and
+// before 1970, go as microseconds
+TEST(CopyEncoderTest, Temporal) {
+    std::vector<std::optional<int64_t>> values = {
+        0,         1,         -1,         999,          -1001,        std::nullopt,
+        86399,     946684800, 946684799,  -946684801,   1700000000123};
+    for (auto unit : kUnits) {
+        std::vector<std::optional<int64_t>> micros;
+        for (auto value : values)
+            micros.push_back(ToMicros(value, unit));
+
+        ExpectRoundTrip(
+            MakeArray<arrow::TimestampBuilder>(arrow::timestamp(unit), values),
+            MakeArray<arrow::TimestampBuilder>(
+                arrow::timestamp(arrow::TimeUnit::MICRO), micros));
+        ExpectRoundTrip(
+            MakeArray<arrow::TimestampBuilder>(arrow::timestamp(unit, "UTC"), values),
+            MakeArray<arrow::TimestampBuilder>(
+                arrow::timestamp(arrow::TimeUnit::MICRO, "UTC"), micros));
+        ExpectRoundTrip(
+            MakeArray<arrow::DurationBuilder>(arrow::duration(unit), values),
+            MakeArray<arrow::DurationBuilder>(
+                arrow::duration(arrow::TimeUnit::MICRO), micros));
+    }
+
+    // Times of day
+    std::vector<std::optional<int64_t>> seconds = {0, 1, std::nullopt, 86399};
+    std::vector<std::optional<int64_t>> nanos = {0, 999, 1001, 86399999999999};
+    auto time = arrow::time64(arrow::TimeUnit::MICRO);
+    ExpectRoundTrip(
+        MakeArray<arrow::Time32Builder>(
+            arrow::time32(arrow::TimeUnit::SECOND),
+            std::vector<std::optional<int32_t>>(seconds.begin(), seconds.end())),
+        MakeArray<arrow::Time64Builder>(
+            time, std::vector<std::optional<int64_t>>({0, 1000000, {}, 86399000000})));
+    ExpectRoundTrip(
+        MakeArray<arrow::Time32Builder>(
+            arrow::time32(arrow::TimeUnit::MILLI),
+            std::vector<std::optional<int32_t>>({0, 1, std::nullopt, 86399999})),
+        MakeArray<arrow::Time64Builder>(
+            time, std::vector<std::optional<int64_t>>({0, 1000, {}, 86399999000})));
+    ExpectRoundTrip(
+        MakeArray<arrow::Time64Builder>(arrow::time64(arrow::TimeUnit::NANO), nanos),
+        MakeArray<arrow::Time64Builder>(
+            time, std::vector<std::optional<int64_t>>({0, 0, 1, 86399999999})));
+
+    // Dates, from milliseconds rounded down to the day
+    std::vector<std::optional<int32_t>> days = {
+        0, -1, 10957, 10956, -10958, std::nullopt, 2932896, -719162};
+    auto date32 = MakeArray<arrow::Date32Builder>(arrow::date32(), days);
+    ExpectRoundTrip(date32, date32);
+    std::vector<std::optional<int64_t>> millis;
+    for (auto day : days)
+        millis.push_back(day ? std::optional(*day * 86400000LL + 1) : std::nullopt);
+    millis[1] = -1;
+    ExpectRoundTrip(MakeArray<arrow::Date64Builder>(arrow::date64(), millis), date32);
+}
+
+// Arrays of one dimension, empty or with null elements, from any list type
+TEST(CopyEncoderTest, Lists) {
+    typedef std::vector<std::optional<int32_t>> Ints;
+    Lists<int32_t> ints = {Ints{1, 2, 3}, Ints{}, std::nullopt, Ints{std::nullopt, 4},
+                           Ints{-5}};
+    auto int_list = MakeList<arrow::ListBuilder, arrow::Int32Builder>(
+        arrow::list(arrow::int32()), ints);
+    ExpectRoundTrip(int_list, int_list, kInt4Oid);
+    // Narrower elements are widened
+    Lists<int16_t> shorts = {
+        std::vector<std::optional<int16_t>>{1, 2, 3},
+        std::vector<std::optional<int16_t>>{}, std::nullopt,
+        std::vector<std::optional<int16_t>>{std::nullopt, 4},
+        std::vector<std::optional<int16_t>>{-5}};
+    ExpectRoundTrip(
+        MakeList<arrow::ListBuilder, arrow::Int16Builder>(
+            arrow::list(arrow::int16()), shorts),
+        int_list, kInt4Oid);
+
+    typedef std::vector<std::optional<std::string>> Strings;
+    Lists<std::string> strings = {
+        Strings{"a", "bc"}, Strings{}, std::nullopt, Strings{"", std::nullopt}};
+    ExpectRoundTrip(
+        MakeList<arrow::LargeListBuilder, arrow::LargeStringBuilder>(
+            arrow::large_list(arrow::large_utf8()), strings),
+        MakeList<arrow::ListBuilder, arrow::StringBuilder>(
+            arrow::list(arrow::utf8()), strings),
+        kTextOid);
+
+    // Float NULLs are decoded as NaN
+    typedef std::vector<std::optional<double>> Doubles;
+    ExpectRoundTrip(
+        MakeList<arrow::FixedSizeListBuilder, arrow::DoubleBuilder>(
+            arrow::fixed_size_list(arrow::float64(), 2),
+            Lists<double>{Doubles{1.5, -2}, std::nullopt, Doubles{0, std::nullopt}}),
+        MakeList<arrow::ListBuilder, arrow::DoubleBuilder>(
+            arrow::list(arrow::float64()),
+            Lists<double>{Doubles{1.5, -2}, std::nullopt, Doubles{0, NAN}}),
+        kFloat8Oid);
+
+    typedef std::vector<std::optional<arrow::Decimal128>> Decimals;
+    Lists<arrow::Decimal128> decimals = {
+        Decimals{arrow::Decimal128(123), arrow::Decimal128(-1)},
+        Decimals{std::nullopt, arrow::Decimal128(1000000)}, Decimals{}};
+    auto decimal_list = MakeList<arrow::ListBuilder, arrow::Decimal128Builder>(
+        arrow::list(arrow::decimal128(12, 2)), decimals);
+    ExpectRoundTrip(decimal_list, decimal_list, kNumericOid);
+}
+
+// Columns of every row null, but floats that are decoded as NaN, and columns
+// loaded in another order than that of the batch
+TEST(CopyEncoderTest, Nulls) {
+    const int64_t n = 100;
+    std::vector<std::shared_ptr<arrow::Field>> fields;
+    std::vector<std::shared_ptr<arrow::Array>> columns;
+    for (auto& type :
+         {arrow::boolean(), arrow::int16(), arrow::int64(), arrow::utf8(),
+          arrow::binary(), arrow::decimal128(20, 4),
+          arrow::timestamp(arrow::TimeUnit::MICRO), arrow::list(arrow::int32())}) {
+        std::unique_ptr<arrow::ArrayBuilder> builder;
+        ASSERT_TRUE(arrow::MakeBuilder(arrow::default_memory_pool(), type, &builder)
+                        .ok());
+        ASSERT_TRUE(builder->AppendNulls(n).ok());
+        fields.push_back(arrow::field("c" + std::to_string(fields.size()), type));
+        columns.push_back(*builder->Finish());
+    }
+    auto batch = arrow::RecordBatch::Make(arrow::schema(fields), n, columns);
+
+    std::reverse(fields.begin(), fields.end());
+    auto decoded = RoundTrip(*batch, arrow::schema(fields), {{"c7", kInt4Oid}});
+    ASSERT_NE(decoded, nullptr);
+    for (int i = 0; i < decoded->num_columns(); i++) {
+        auto expected = batch->GetColumnByName(decoded->schema()->field(i)->name());
+        EXPECT_TRUE(decoded->column(i)->Equals(*expected))
+            << decoded->schema()->field(i)->ToString();
+    }
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
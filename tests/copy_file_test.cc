@@ -0,0 +1,198 @@
+// Binary COPY files walked in place, and decoded through the readers against
+// the rows appended to a builder directly
+
+#include "../src/pg2arrow.h"
+#include "./row_writer.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+
+namespace Pg2Arrow {
+namespace {
+
+static const char kSignature[] = "PGCOPY\n\377\r\n";
+
+class CopyFileTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        filename_ = ::testing::TempDir() + "copy_file_test.pgcopy";
+        schema_ = arrow::schema(
+            {arrow::field("id", arrow::int64()),
+             arrow::field("s", arrow::utf8()),
+             arrow::field("a", arrow::list(arrow::int32()))});
+        for (int64_t i = 0; i < kRows; i++) {
+            RowWriter row;
+            row.Int16(3);
+            RowWriter id;
+            id.Int64(i);
+            row.Field(id);
+            if (i % 5 == 0)
+                row.Null();
+            else
+                row.Text("value " + std::to_string(i % 1000) + " of the file");
+            RowWriter array;
+            array.Int32(1);
+            array.Int32(0);
+            array.Int32(23);
+            array.Int32(i % 4);
+            array.Int32(1);
+            for (int64_t k = 0; k < i % 4; k++) {
+                array.Int32(4);
+                array.Int32(i + k);
+            }
+            row.Field(array);
+            rows_.push_back(row.data());
+        }
+    }
+
+    void TearDown() override { std::remove(filename_.c_str()); }
+
+    void WriteFile(const std::string& data) {
+        std::ofstream(filename_, std::ios::binary) << data;
+    }
+
+    std::string Contents() {
+        RowWriter file;
+        file.Bytes(std::string(kSignature, sizeof(kSignature)));
+        file.Int32(0);
+        file.Int32(0);
+        for (auto& row : rows_)
+            file.Bytes(row);
+        file.Int16(-1);
+        return file.data();
+    }
+
+    // The rows appended straight to a builder, in batches of `batch_rows`
+    std::shared_ptr<arrow::Table> Expected(const UserOptions& options) {
+        PgBuilder builder(schema_, options);
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        for (auto& row : rows_) {
+            const char* rows[] = {row.data()};
+            builder.AppendRows(rows, 1);
+            if (builder.num_rows() == options.batch_rows) {
+                batches.emplace_back();
+                EXPECT_TRUE(builder.Flush(&batches.back()).ok());
+            }
+        }
+        batches.emplace_back();
+        EXPECT_TRUE(builder.Flush(&batches.back()).ok());
+        return *arrow::Table::FromRecordBatches(builder.schema(), batches);
+    }
+
+    static constexpr int64_t kRows = 10000;
+
+    std::string filename_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::vector<std::string> rows_;
+};
+
+// Rows come out in runs pointing into the mapping, as written, followed by
+// the trailer
+TEST_F(CopyFileTest, Rows) {
+    WriteFile(Contents());
+    auto stream = OpenCopyFile(filename_.c_str());
+    ASSERT_TRUE(stream.ok()) << stream.status().ToString();
+    std::vector<const char*> rows;
+    size_t next = 0;
+    while (true) {
+        auto status = (*stream)->Next(&rows);
+        ASSERT_TRUE(status.ok()) << status.ToString();
+        if (rows.empty())
+            break;
+        for (auto row : rows) {
+            ASSERT_LE(next, rows_.size());
+            auto expected = next < rows_.size() ? rows_[next] : "\xff\xff";
+            ASSERT_EQ(std::string(row, expected.size()), expected);
+            next++;
+        }
+    }
+    EXPECT_EQ(next, rows_.size() + 1);
+}
+
+// The pull based reader, which read_copy_file goes through in Python
+TEST_F(CopyFileTest, RecordBatchReader) {
+    WriteFile(Contents());
+    UserOptions options;
+    options.batch_rows = 3000;
+    options.dictionary_columns = {"s"};
+
+    auto stream = OpenCopyFile(filename_.c_str());
+    ASSERT_TRUE(stream.ok()) << stream.status().ToString();
+    auto reader = PgRecordBatchReader::Open(std::move(*stream), schema_, options);
+    ASSERT_TRUE(reader.ok()) << reader.status().ToString();
+    auto table = (*reader)->ToTable();
+    ASSERT_TRUE(table.ok()) << table.status().ToString();
+    ASSERT_TRUE((*table)->ValidateFull().ok());
+    EXPECT_EQ((*table)->column(0)->num_chunks(), 4);
+    EXPECT_TRUE((*table)->Equals(*Expected(options)));
+}
+
+// Views point into the mapping of the file, kept as long as the arrays are
+TEST_F(CopyFileTest, Views) {
+    WriteFile(Contents());
+    UserOptions options;
+    options.batch_rows = 3000;
+    options.string_views = true;
+
+    std::shared_ptr<arrow::Table> table;
+    {
+        auto stream = OpenCopyFile(filename_.c_str());
+        ASSERT_TRUE(stream.ok()) << stream.status().ToString();
+        auto reader = PgRecordBatchReader::Open(std::move(*stream), schema_, options);
+        ASSERT_TRUE(reader.ok()) << reader.status().ToString();
+        table = *(*reader)->ToTable();
+    }
+    TearDown();
+    ASSERT_TRUE(table->ValidateFull().ok());
+    EXPECT_TRUE(table->schema()->field(1)->type()->Equals(arrow::utf8_view()));
+    EXPECT_TRUE(table->Equals(*Expected(options)));
+}
+
+// Batches come out in file order, however many threads decode them
+TEST_F(CopyFileTest, ParallelCopyRows) {
+    WriteFile(Contents());
+    for (int threads : {1, 3}) {
+        UserOptions options;
+        options.batch_rows = 1000;
+        options.decode_threads = threads;
+
+        auto stream = OpenCopyFile(filename_.c_str());
+        ASSERT_TRUE(stream.ok()) << stream.status().ToString();
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        auto status = ParallelCopyRows(
+            **stream, schema_, options, [&](std::shared_ptr<arrow::RecordBatch> batch) {
+                batches.push_back(std::move(batch));
+                return arrow::Status::OK();
+            });
+        ASSERT_TRUE(status.ok()) << status.ToString();
+        auto table = *arrow::Table::FromRecordBatches(batches);
+        EXPECT_EQ(table->num_rows(), kRows);
+        EXPECT_TRUE(table->Equals(*Expected(options)));
+    }
+}
+
+// Rows cut short, or a file that is not one, empty or not
+TEST_F(CopyFileTest, Truncated) {
+    auto contents = Contents();
+    WriteFile(contents.substr(0, contents.size() - 10));
+    auto stream = OpenCopyFile(filename_.c_str());
+    ASSERT_TRUE(stream.ok()) << stream.status().ToString();
+    std::vector<const char*> rows;
+    arrow::Status status;
+    do {
+        status = (*stream)->Next(&rows);
+    } while (status.ok() && !rows.empty());
+    EXPECT_TRUE(status.IsInvalid()) << status.ToString();
+
+    WriteFile("not a COPY file at all");
+    EXPECT_TRUE(OpenCopyFile(filename_.c_str()).status().IsInvalid());
+
+    WriteFile("");
+    auto empty = OpenCopyFile(filename_.c_str());
+    EXPECT_TRUE(empty.status().IsInvalid()) << empty.status().ToString();
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
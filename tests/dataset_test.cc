@@ -0,0 +1,220 @@
+// Dataset output written to a temporary directory: file names, partition
+// directories and the rows of every file
+
+#include "../src/writer.h"
+
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <map>
+
+namespace Pg2Arrow {
+namespace {
+
+class DatasetTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        directory_ = ::testing::TempDir() + "dataset_test";
+        std::filesystem::remove_all(directory_);
+        options_.format = "ipc-file";
+        options_.filename = directory_;
+    }
+
+    void TearDown() override { std::filesystem::remove_all(directory_); }
+
+    // Writes `batches` in order
+    void Write(const std::vector<std::shared_ptr<arrow::RecordBatch>>& batches) {
+        auto writer = MakeBatchWriter(options_);
+        ASSERT_TRUE(writer.ok()) << writer.status().ToString();
+        ASSERT_TRUE((*writer)->Open(batches[0]->schema()).ok());
+        for (auto& batch : batches) {
+            auto status = (*writer)->Write(batch);
+            ASSERT_TRUE(status.ok()) << status.ToString();
+        }
+        ASSERT_TRUE((*writer)->Close().ok());
+    }
+
+    // Files of the dataset, by path relative to its directory
+    std::map<std::string, std::shared_ptr<arrow::Table>> Files() {
+        std::map<std::string, std::shared_ptr<arrow::Table>> files;
+        for (auto& entry : std::filesystem::recursive_directory_iterator(directory_)) {
+            if (!entry.is_regular_file())
+                continue;
+            auto input = *arrow::io::ReadableFile::Open(entry.path().string());
+            auto reader = *arrow::ipc::RecordBatchFileReader::Open(input);
+            std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+            for (int i = 0; i < reader->num_record_batches(); i++)
+                batches.push_back(*reader->ReadRecordBatch(i));
+            auto path = entry.path().lexically_relative(directory_).string();
+            files[path] = *arrow::Table::FromRecordBatches(reader->schema(), batches);
+        }
+        return files;
+    }
+
+    std::string directory_;
+    WriterOptions options_;
+};
+
+std::shared_ptr<arrow::RecordBatch> IdBatch(int64_t start, int64_t length) {
+    arrow::Int64Builder ids;
+    for (int64_t i = start; i < start + length; i++)
+        EXPECT_TRUE(ids.Append(i).ok());
+    auto schema = arrow::schema({arrow::field("id", arrow::int64())});
+    return arrow::RecordBatch::Make(schema, length, {*ids.Finish()});
+}
+
+// Files roll over at the row limit, across batches, keeping the rows in order
+TEST_F(DatasetTest, RollingFiles) {
+    options_.max_file_rows = 1000;
+    Write({IdBatch(0, 700), IdBatch(700, 700), IdBatch(1400, 1100)});
+
+    auto files = Files();
+    std::vector<std::string> names;
+    for (auto& [name, table] : files)
+        names.push_back(name);
+    EXPECT_EQ(
+        names, std::vector<std::string>(
+                   {"part-00000.arrow", "part-00001.arrow", "part-00002.arrow"}));
+    int64_t next = 0;
+    for (auto& [name, table] : files) {
+        EXPECT_EQ(table->num_rows(), next < 2000 ? 1000 : 500) << name;
+        auto ids = table->column(0);
+        for (int64_t i = 0; i < table->num_rows(); i++, next++) {
+            auto id = std::static_pointer_cast<arrow::Int64Scalar>(*ids->GetScalar(i));
+            ASSERT_EQ(id->value, next) << name;
+        }
+    }
+    EXPECT_EQ(next, 2500);
+}
+
+// Files also roll over on the size of their rows in memory
+TEST_F(DatasetTest, RollingBytes) {
+    options_.max_file_bytes = 8 * 1000;
+    Write({IdBatch(0, 2500)});
+    auto files = Files();
+    ASSERT_EQ(files.size(), 1u);
+    EXPECT_EQ(files.begin()->second->num_rows(), 2500);
+
+    std::filesystem::remove_all(directory_);
+    Write({IdBatch(0, 600), IdBatch(600, 600), IdBatch(1200, 600)});
+    std::vector<int64_t> rows;
+    for (auto& [name, table] : Files())
+        rows.push_back(table->num_rows());
+    EXPECT_EQ(rows, std::vector<int64_t>({1200, 600}));
+}
+
+std::shared_ptr<arrow::RecordBatch> KeyBatch(
+    const std::vector<std::optional<std::string>>& keys,
+    int64_t start) {
+    arrow::StringBuilder key_builder;
+    arrow::Int64Builder ids;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i])
+            EXPECT_TRUE(key_builder.Append(*keys[i]).ok());
+        else
+            EXPECT_TRUE(key_builder.AppendNull().ok());
+        EXPECT_TRUE(ids.Append(start + i).ok());
+    }
+    auto schema = arrow::schema(
+        {arrow::field("k", arrow::utf8()), arrow::field("id", arrow::int64())});
+    return arrow::RecordBatch::Make(
+        schema, keys.size(), {*key_builder.Finish(), *ids.Finish()});
+}
+
+// Partition values are escaped as Hive does, nulls and empty values go to the
+// default partition, and the column is left out of the files
+TEST_F(DatasetTest, HivePartitions) {
+    options_.partition_column = "k";
+    Write(
+        {KeyBatch({"a/b", "a/b", "x=y", "plain", std::nullopt}, 0),
+         KeyBatch({"50%", "plain", "", "a/b", "x=y", "x=y"}, 5)});
+
+    std::map<std::string, std::vector<int64_t>> ids;
+    for (auto& [name, table] : Files()) {
+        ASSERT_EQ(table->num_columns(), 1) << name;
+        EXPECT_EQ(table->schema()->field(0)->name(), "id");
+        auto directory = std::filesystem::path(name).parent_path().string();
+        for (int64_t i = 0; i < table->num_rows(); i++) {
+            auto id = *table->column(0)->GetScalar(i);
+            ids[directory].push_back(
+                std::static_pointer_cast<arrow::Int64Scalar>(id)->value);
+        }
+    }
+    std::map<std::string, std::vector<int64_t>> expected = {
+        {"k=a%2Fb", {0, 1, 8}},
+        {"k=x%3Dy", {2, 9, 10}},
+        {"k=plain", {3, 6}},
+        {"k=50%25", {5}},
+        {"k=__HIVE_DEFAULT_PARTITION__", {4, 7}}};
+    EXPECT_EQ(ids, expected);
+}
+
+// Timestamps are truncated to the unit, before 1970 as well, and keep their
+// column
+TEST_F(DatasetTest, TimePartitions) {
+    auto type = arrow::timestamp(arrow::TimeUnit::MICRO);
+    arrow::TimestampBuilder times(type, arrow::default_memory_pool());
+    std::vector<int64_t> seconds = {
+        1706745599, 1706745600, 1709251199, 1709251200, -1, -86400 * 366};
+    for (auto value : seconds)
+        ASSERT_TRUE(times.Append(value * 1000000).ok());
+    auto schema = arrow::schema({arrow::field("t", type)});
+    auto batch = arrow::RecordBatch::Make(schema, seconds.size(), {*times.Finish()});
+
+    std::map<std::string, std::map<std::string, int64_t>> expected = {
+        {"day",
+         {{"t_day=2024-01-31", 1},
+          {"t_day=2024-02-01", 1},
+          {"t_day=2024-02-29", 1},
+          {"t_day=2024-03-01", 1},
+          {"t_day=1969-12-31", 1},
+          {"t_day=1968-12-31", 1}}},
+        {"month",
+         {{"t_month=2024-01", 1},
+          {"t_month=2024-02", 2},
+          {"t_month=2024-03", 1},
+          {"t_month=1969-12", 1},
+          {"t_month=1968-12", 1}}},
+        {"hour",
+         {{"t_hour=2024-01-31T23", 1},
+          {"t_hour=2024-02-01T00", 1},
+          {"t_hour=2024-02-29T23", 1},
+          {"t_hour=2024-03-01T00", 1},
+          {"t_hour=1969-12-31T23", 1},
+          {"t_hour=1968-12-31T00", 1}}}};
+    for (auto& [unit, partitions] : expected) {
+        std::filesystem::remove_all(directory_);
+        options_.partition_column = "t";
+        options_.partition_unit = unit;
+        Write({batch});
+        std::map<std::string, int64_t> rows;
+        for (auto& [name, table] : Files()) {
+            EXPECT_EQ(table->num_columns(), 1);
+            rows[std::filesystem::path(name).parent_path().string()] +=
+                table->num_rows();
+        }
+        EXPECT_EQ(rows, partitions) << unit;
+    }
+}
+
+// Past the limit of open files, the least recently written one is closed and
+// its partition goes on in a new file: "b" is still open for the second batch,
+// "a" is not
+TEST_F(DatasetTest, MaxOpenFiles) {
+    options_.partition_column = "k";
+    options_.max_open_files = 1;
+    Write({KeyBatch({"a", "b", "a"}, 0), KeyBatch({"b", "a"}, 3)});
+
+    std::map<std::string, int64_t> rows;
+    auto files = Files();
+    for (auto& [name, table] : files)
+        rows[std::filesystem::path(name).parent_path().string()] += table->num_rows();
+    EXPECT_EQ(rows, (std::map<std::string, int64_t>({{"k=a", 3}, {"k=b", 2}})));
+    EXPECT_EQ(files.size(), 3u);
+    EXPECT_EQ(files.count("k=a/part-00002.arrow"), 1u);
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
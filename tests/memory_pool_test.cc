@@ -0,0 +1,119 @@
+// Arena memory pool over a parent pool counting what reaches it
+
+#include "../src/pg2arrow.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+namespace Pg2Arrow {
+namespace {
+
+// Bytes the arena accounts for a buffer of `size`
+int64_t ClassSize(arrow::MemoryPool& pool, int64_t size) {
+    uint8_t* data;
+    auto before = pool.bytes_allocated();
+    EXPECT_TRUE(pool.Allocate(size, &data).ok());
+    auto class_size = pool.bytes_allocated() - before;
+    pool.Free(data, size);
+    return class_size;
+}
+
+// Sizes are rounded up to 64 bytes, then to a quarter of their power of two
+TEST(ArenaMemoryPoolTest, SizeClasses) {
+    arrow::ProxyMemoryPool parent(arrow::system_memory_pool());
+    auto pool = MakeArenaMemoryPool(&parent);
+    EXPECT_EQ(ClassSize(*pool, 1), 64);
+    EXPECT_EQ(ClassSize(*pool, 64), 64);
+    EXPECT_EQ(ClassSize(*pool, 65), 80);
+    EXPECT_EQ(ClassSize(*pool, 100), 112);
+    EXPECT_EQ(ClassSize(*pool, 128), 128);
+    EXPECT_EQ(ClassSize(*pool, 129), 160);
+    EXPECT_EQ(ClassSize(*pool, 1 << 20), 1 << 20);
+    EXPECT_EQ(ClassSize(*pool, (1 << 20) + 1), 5 << 18);
+    for (int64_t size = 65; size < 1 << 16; size += 7) {
+        auto class_size = ClassSize(*pool, size);
+        ASSERT_GE(class_size, size);
+        ASSERT_LE(class_size, size + size / 4) << size;
+    }
+    EXPECT_EQ(pool->bytes_allocated(), 0);
+}
+
+// Buffers keep their contents across reallocations, in place within their
+// class, and freed ones are reused without going back to the parent
+TEST(ArenaMemoryPoolTest, Reuse) {
+    arrow::ProxyMemoryPool parent(arrow::system_memory_pool());
+    auto pool = MakeArenaMemoryPool(&parent);
+
+    uint8_t* data;
+    ASSERT_TRUE(pool->Allocate(1000, &data).ok());
+    memset(data, 7, 1000);
+    auto first = data;
+    ASSERT_TRUE(pool->Reallocate(1000, 1020, &data).ok());
+    EXPECT_EQ(data, first);
+    ASSERT_TRUE(pool->Reallocate(1020, 100000, &data).ok());
+    EXPECT_EQ(pool->bytes_allocated(), 7 << 14);
+    for (int i = 0; i < 1000; i++)
+        ASSERT_EQ(data[i], 7) << i;
+    ASSERT_TRUE(pool->Reallocate(100000, 500, &data).ok());
+    for (int i = 0; i < 500; i++)
+        ASSERT_EQ(data[i], 7) << i;
+    pool->Free(data, 500);
+    EXPECT_EQ(pool->bytes_allocated(), 0);
+
+    // A batch worth of buffers, freed then allocated again
+    std::vector<uint8_t*> buffers(10);
+    for (auto& buffer : buffers)
+        ASSERT_TRUE(pool->Allocate(1 << 20, &buffer).ok());
+    for (auto& buffer : buffers)
+        pool->Free(buffer, 1 << 20);
+    auto allocations = parent.num_allocations();
+    for (auto& buffer : buffers)
+        ASSERT_TRUE(pool->Allocate(1 << 20, &buffer).ok());
+    EXPECT_EQ(parent.num_allocations(), allocations);
+    EXPECT_EQ(pool->bytes_allocated(), 10 << 20);
+    EXPECT_EQ(pool->max_memory(), 10 << 20);
+    for (auto& buffer : buffers)
+        pool->Free(buffer, 1 << 20);
+
+    pool->ReleaseUnused();
+    EXPECT_EQ(parent.bytes_allocated(), 0);
+}
+
+// The parent holds no more than the limit once buffers are freed, and nothing
+// once the arena is gone
+TEST(ArenaMemoryPoolTest, Limit) {
+    arrow::ProxyMemoryPool parent(arrow::system_memory_pool());
+    {
+        auto pool = MakeArenaMemoryPool(&parent, 3 << 20);
+        std::vector<uint8_t*> buffers(5);
+        for (auto& buffer : buffers)
+            ASSERT_TRUE(pool->Allocate(1 << 20, &buffer).ok());
+        EXPECT_EQ(parent.bytes_allocated(), 5 << 20);
+        for (auto& buffer : buffers)
+            pool->Free(buffer, 1 << 20);
+        EXPECT_EQ(pool->bytes_allocated(), 0);
+        EXPECT_EQ(parent.bytes_allocated(), 3 << 20);
+
+        // Cached buffers make room for larger ones
+        uint8_t* large;
+        ASSERT_TRUE(pool->Allocate(2 << 20, &large).ok());
+        EXPECT_LE(parent.bytes_allocated(), 3 << 20);
+
+        // Over aligned and empty buffers go straight to the parent
+        uint8_t* aligned;
+        ASSERT_TRUE(pool->Allocate(100, 4096, &aligned).ok());
+        EXPECT_EQ((uintptr_t)aligned % 4096, 0);
+        EXPECT_EQ(pool->bytes_allocated(), (2 << 20) + 100);
+        pool->Free(aligned, 100, 4096);
+        uint8_t* empty;
+        ASSERT_TRUE(pool->Allocate(0, &empty).ok());
+        pool->Free(empty, 0);
+        pool->Free(large, 2 << 20);
+        EXPECT_EQ(pool->bytes_allocated(), 0);
+    }
+    EXPECT_EQ(parent.bytes_allocated(), 0);
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
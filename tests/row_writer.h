@@ -0,0 +1,46 @@
+// Writes rows in the binary COPY format, for the tests and benchmarks to decode
+// without a database
+
+#pragma once
+
+#include "../src/hton.h"
+
+#include <string>
+
+namespace Pg2Arrow {
+
+// Appends fields in the binary COPY format
+class RowWriter {
+   public:
+    void Int16(int16_t value) { Pack(pack_int16, value, 2); }
+    void Int32(int32_t value) { Pack(pack_int32, value, 4); }
+    void Int64(int64_t value) { Pack(pack_int64, value, 8); }
+    void Float(float value) { Pack(pack_float, value, 4); }
+    void Double(double value) { Pack(pack_double, value, 8); }
+    void Bytes(const std::string& value) { data_ += value; }
+
+    // Length prefixed field
+    void Field(const RowWriter& value) {
+        Int32(value.data_.size());
+        data_ += value.data_;
+    }
+    void Text(const std::string& value) {
+        Int32(value.size());
+        data_ += value;
+    }
+    void Null() { Int32(-1); }
+
+    const std::string& data() const { return data_; }
+
+   private:
+    template <typename F, typename T>
+    void Pack(F pack, T value, int size) {
+        char buffer[8];
+        pack(buffer, value);
+        data_.append(buffer, size);
+    }
+
+    std::string data_;
+};
+
+}  // namespace Pg2Arrow
@@ -0,0 +1,114 @@
+// Type cache files written and read back, whole or damaged
+
+#include "../src/type_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace Pg2Arrow {
+namespace {
+
+TypeCache MakeCache() {
+    TypeCache cache;
+    auto& types = cache[{"7312345678901234567", "postgres"}];
+    types[23] = {"1", "int4", 'b', 0, {}};
+    types[1007] = {"2", "_int4", 'b', 23, {}};
+    types[16400] = {"731:732,733", "point3", 'c', 0,
+                    {{"x", 701, -1}, {"y", 701, -1}, {"label", 1043, 36}}};
+    types[16410] = {"740::741,742,743", "mood", 'e', 0,
+                    {{"sad", 0, -1}, {"ok", 0, -1}, {"", 0, -1}}};
+    cache[{"7312345678901234567", "other"}][25] = {"1", "text", 'b', 0, {}};
+    cache[{"42", "postgres"}][16400] = {"900", "point3", 'c', 0, {{"x", 20, -1}}};
+    return cache;
+}
+
+// Text of a cache, compared as a whole
+std::string Format(const TypeCache& cache) {
+    std::ostringstream text;
+    for (auto& [key, types] : cache) {
+        for (auto& [oid, info] : types) {
+            text << key.first << " " << key.second << " " << oid << " "
+                 << info.version << " " << info.name << " " << info.type << " "
+                 << info.elem;
+            for (auto& member : info.members)
+                text << " (" << member.name << " " << member.typid << " "
+                     << member.typmod << ")";
+            text << "\n";
+        }
+    }
+    return text.str();
+}
+
+class TypeCacheTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        directory_ = ::testing::TempDir() + "type_cache_test";
+        filename_ = directory_ + "/types";
+    }
+
+    void TearDown() override { std::filesystem::remove_all(directory_); }
+
+    std::string Contents() {
+        std::ifstream file(filename_, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), {});
+    }
+
+    void WriteFile(const std::string& data) {
+        std::ofstream(filename_, std::ios::binary) << data;
+    }
+
+    std::string directory_;
+    std::string filename_;
+};
+
+// Saved in a directory of its own, created as needed, replacing the cache of
+// a previous run
+TEST_F(TypeCacheTest, RoundTrip) {
+    EXPECT_TRUE(LoadTypeCache(filename_).empty());
+
+    TypeCache stale;
+    stale[{"42", "postgres"}][16400] = {"1", "point2", 'c', 0, {{"x", 701, -1}}};
+    SaveTypeCache(filename_, stale);
+    EXPECT_EQ(Format(LoadTypeCache(filename_)), Format(stale));
+
+    auto cache = MakeCache();
+    SaveTypeCache(filename_, cache);
+    EXPECT_EQ(Format(LoadTypeCache(filename_)), Format(cache));
+    EXPECT_EQ(std::distance(
+                  std::filesystem::directory_iterator(directory_),
+                  std::filesystem::directory_iterator()),
+              1);
+}
+
+// Files cut short keep the records before the cut, as they were saved, and
+// files holding something else are ignored
+TEST_F(TypeCacheTest, Damaged) {
+    auto cache = MakeCache();
+    SaveTypeCache(filename_, cache);
+    auto contents = Contents();
+    auto resaved = directory_ + "/resaved";
+    for (size_t size = 0; size < contents.size(); size++) {
+        WriteFile(contents.substr(0, size));
+        SaveTypeCache(resaved, LoadTypeCache(filename_));
+        std::ifstream file(resaved, std::ios::binary);
+        std::string records(std::istreambuf_iterator<char>(file), {});
+        ASSERT_LE(records.size(), size);
+        ASSERT_EQ(records, contents.substr(0, records.size())) << size;
+    }
+
+    // A negative number of members
+    std::string record;
+    for (auto field : {"42", "db", "16400", "1", "point", "c", "0", "-1", "x"})
+        record += std::string(field) + '\0';
+    WriteFile(record);
+    EXPECT_TRUE(LoadTypeCache(filename_).empty());
+
+    WriteFile("not a type cache at all\n");
+    EXPECT_TRUE(LoadTypeCache(filename_).empty());
+}
+
+}  // namespace
+}  // namespace Pg2Arrow
@@ -0,0 +1,153 @@
+// Batches written by the output writers and read back
+
+#include "../src/writer.h"
+
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+
+namespace Pg2Arrow {
+namespace {
+
+std::shared_ptr<arrow::RecordBatch> DictionaryBatch(
+    const std::vector<std::string>& dictionary,
+    const std::vector<int32_t>& indices) {
+    arrow::StringBuilder values;
+    EXPECT_TRUE(values.AppendValues(dictionary).ok());
+    arrow::Int32Builder index_builder;
+    for (auto index : indices) {
+        if (index < 0)
+            EXPECT_TRUE(index_builder.AppendNull().ok());
+        else
+            EXPECT_TRUE(index_builder.Append(index).ok());
+    }
+    auto type = arrow::dictionary(arrow::int32(), arrow::utf8());
+    auto array = *arrow::DictionaryArray::FromArrays(
+        type, *index_builder.Finish(), *values.Finish());
+    auto schema = arrow::schema({arrow::field("s", type)});
+    return arrow::RecordBatch::Make(schema, indices.size(), {array});
+}
+
+std::vector<std::string> Values(const arrow::RecordBatch& batch) {
+    auto& array = (const arrow::DictionaryArray&)*batch.column(0);
+    auto& dictionary = (const arrow::StringArray&)*array.dictionary();
+    std::vector<std::string> values;
+    for (int64_t i = 0; i < array.length(); i++) {
+        values.push_back(
+            array.IsNull(i) ? "null"
+                            : std::string(dictionary.GetView(array.GetValueIndex(i))));
+    }
+    return values;
+}
+
+// Dictionaries that grow, then start over, as those of a builder whose
+// dictionary got too large or of several builders
+TEST(WriterTest, IpcDictionaries) {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches = {
+        DictionaryBatch({"a", "b"}, {0, 1, -1, 0}),
+        DictionaryBatch({"a", "b", "c"}, {2, 0, 1}),
+        DictionaryBatch({"x", "c", "y"}, {0, 1, 2, -1, 1})};
+    auto filename = ::testing::TempDir() + "writer_test.arrow";
+
+    for (auto format : {"ipc-stream", "ipc-file"}) {
+        WriterOptions options;
+        options.format = format;
+        options.filename = filename;
+        auto writer = *MakeBatchWriter(options);
+        ASSERT_TRUE(writer->Open(batches[0]->schema()).ok());
+        for (auto& batch : batches) {
+            auto status = writer->Write(batch);
+            ASSERT_TRUE(status.ok()) << format << ": " << status.ToString();
+        }
+        ASSERT_TRUE(writer->Close().ok());
+
+        std::vector<std::shared_ptr<arrow::RecordBatch>> read;
+        auto input = *arrow::io::ReadableFile::Open(filename);
+        if (options.format == "ipc-stream") {
+            auto reader = *arrow::ipc::RecordBatchStreamReader::Open(input);
+            read = *reader->ToRecordBatches();
+        } else {
+            auto reader = *arrow::ipc::RecordBatchFileReader::Open(input);
+            for (int i = 0; i < reader->num_record_batches(); i++)
+                read.push_back(*reader->ReadRecordBatch(i));
+        }
+
+        ASSERT_EQ(read.size(), batches.size()) << format;
+        for (size_t i = 0; i < batches.size(); i++) {
+            ASSERT_TRUE(read[i]->ValidateFull().ok());
+            EXPECT_EQ(Values(*read[i]), Values(*batches[i])) << format << " " << i;
+        }
+    }
+    std::remove(filename.c_str());
+}
+
+// Properties of a column of `values` picked by ChooseEncoding, as the dictionary
+// encoding flag and the fallback encoding, UNKNOWN when left to the writer
+std::pair<bool, parquet::Encoding::type> Encoding(
+    const std::shared_ptr<arrow::Array>& values) {
+    auto field = arrow::field("c", values->type());
+    parquet::WriterProperties::Builder builder;
+    ChooseEncoding(*field, ProfileColumn(*values), &builder);
+    auto properties = builder.build();
+    auto path = parquet::schema::ColumnPath::FromDotString("c");
+    return {properties->dictionary_enabled(path), properties->encoding(path)};
+}
+
+template <typename Builder, typename Function>
+std::shared_ptr<arrow::Array> MakeArray(int64_t length, Function value) {
+    Builder builder;
+    for (int64_t i = 0; i < length; i++)
+        EXPECT_TRUE(builder.Append(value(i)).ok());
+    return *builder.Finish();
+}
+
+TEST(WriterTest, ChooseEncoding) {
+    const int64_t n = 10000;
+    auto unset = parquet::Encoding::UNKNOWN;
+    auto delta = parquet::Encoding::DELTA_BINARY_PACKED;
+
+    // Few distinct values stay dictionary encoded
+    auto few = MakeArray<arrow::StringBuilder>(n, [](int64_t i) {
+        return std::to_string(i % 10);
+    });
+    EXPECT_EQ(Encoding(few), std::make_pair(true, unset));
+    auto unique = MakeArray<arrow::StringBuilder>(n, [](int64_t i) {
+        return std::to_string(i);
+    });
+    EXPECT_EQ(Encoding(unique), std::make_pair(false, unset));
+
+    // Sorted ids, then unsorted integers within a narrow range, take deltas
+    auto ids = MakeArray<arrow::Int64Builder>(n, [](int64_t i) { return i; });
+    EXPECT_EQ(Encoding(ids), std::make_pair(false, delta));
+    auto narrow = MakeArray<arrow::Int64Builder>(n, [](int64_t i) {
+        return (i * 7919) % 100000;
+    });
+    EXPECT_EQ(Encoding(narrow), std::make_pair(false, delta));
+    // Unless the range spans more than half of their bits
+    auto wide = MakeArray<arrow::Int32Builder>(n, [](int64_t i) {
+        return (int32_t)((i * 7919) % 100000);
+    });
+    EXPECT_EQ(Encoding(wide), std::make_pair(false, unset));
+    auto hashes = MakeArray<arrow::Int64Builder>(n, [](int64_t i) {
+        return (int64_t)std::hash<int64_t>()(i) * 0x9e3779b97f4a7c15;
+    });
+    EXPECT_EQ(Encoding(hashes), std::make_pair(false, unset));
+
+    auto doubles = MakeArray<arrow::DoubleBuilder>(n, [](int64_t i) {
+        return 1.0 / (i + 1);
+    });
+    EXPECT_EQ(
+        Encoding(doubles), std::make_pair(false, parquet::Encoding::BYTE_STREAM_SPLIT));
+
+    // Columns without values, and dictionary columns, are left alone
+    arrow::Int64Builder nulls;
+    ASSERT_TRUE(nulls.AppendNulls(n).ok());
+    EXPECT_EQ(Encoding(*nulls.Finish()), std::make_pair(true, unset));
+    auto dictionary = DictionaryBatch({"a", "b"}, std::vector<int32_t>(n, 1));
+    EXPECT_EQ(Encoding(dictionary->column(0)), std::make_pair(true, unset));
+}
+
+}  // namespace
+}  // namespace Pg2Arrow